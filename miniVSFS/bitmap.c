@@ -0,0 +1,200 @@
+#include <string.h>
+#include "bitmap.h"
+#include "vsfs_stats.h"
+
+// Returns bits [w * 64, w * 64 + 64) with bit j of the result standing for
+// bit w * 64 + j. Bits past the end of the bitmap read as used, so searches
+// never have to special-case the last word.
+static uint64_t load_word(const bitmap_t* bm, uint64_t w) {
+    uint64_t first = w * 64;
+    uint64_t byte = first / 8;
+    uint64_t nbytes = (bm->nbits + 7) / 8;
+    uint64_t word = 0;
+
+    if (byte + 8 <= nbytes) {
+        memcpy(&word, bm->bits + byte, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        word = __builtin_bswap64(word);
+#endif
+    } else {
+        for (uint64_t b = 0; byte + b < nbytes; b++) word |= (uint64_t)bm->bits[byte + b] << (8 * b);
+    }
+    if (bm->nbits - first < 64) word |= ~0ull << (bm->nbits - first);
+    return word;
+}
+
+static uint64_t word_count(const bitmap_t* bm) {
+    return (bm->nbits + 63) / 64;
+}
+
+void bitmap_init(bitmap_t* bm, uint8_t* bits, uint64_t nbits) {
+    bm->bits = bits;
+    bm->nbits = nbits;
+    bm->cursor = 0;
+}
+
+int bitmap_test(const bitmap_t* bm, uint64_t bit) {
+    return (bm->bits[bit / 8] >> (bit % 8)) & 1;
+}
+
+void bitmap_set(bitmap_t* bm, uint64_t bit) {
+    bm->bits[bit / 8] |= (uint8_t)(1u << (bit % 8));
+}
+
+void bitmap_clear(bitmap_t* bm, uint64_t bit) {
+    bm->bits[bit / 8] &= (uint8_t)~(1u << (bit % 8));
+}
+
+void bitmap_set_range(bitmap_t* bm, uint64_t start, uint64_t length) {
+    uint64_t end = start + length;
+    while (start < end && start % 8) bitmap_set(bm, start++);
+    if (end - start >= 8) {
+        memset(bm->bits + start / 8, 0xFF, (end - start) / 8);
+        start += (end - start) / 8 * 8;
+    }
+    while (start < end) bitmap_set(bm, start++);
+}
+
+void bitmap_clear_range(bitmap_t* bm, uint64_t start, uint64_t length) {
+    uint64_t end = start + length;
+    while (start < end && start % 8) bitmap_clear(bm, start++);
+    if (end - start >= 8) {
+        memset(bm->bits + start / 8, 0, (end - start) / 8);
+        start += (end - start) / 8 * 8;
+    }
+    while (start < end) bitmap_clear(bm, start++);
+}
+
+uint64_t bitmap_count_free(const bitmap_t* bm) {
+    uint64_t free_bits = 0;
+    for (uint64_t w = 0; w < word_count(bm); w++) free_bits += __builtin_popcountll(~load_word(bm, w));
+    stats_add(STATS_BITMAP_WORDS, word_count(bm));
+    return free_bits;
+}
+
+uint64_t bitmap_next_free(const bitmap_t* bm, uint64_t from) {
+    if (from >= bm->nbits) return bm->nbits;
+    uint64_t w = from / 64;
+    uint64_t first = w;
+    uint64_t word = load_word(bm, w) | ((1ull << (from % 64)) - 1);
+    for (;;) {
+        if (~word) {
+            stats_add(STATS_BITMAP_WORDS, w - first + 1);
+            uint64_t bit = w * 64 + __builtin_ctzll(~word);
+            return bit < bm->nbits ? bit : bm->nbits;
+        }
+        if (++w >= word_count(bm)) {
+            stats_add(STATS_BITMAP_WORDS, w - first);
+            return bm->nbits;
+        }
+        word = load_word(bm, w);
+    }
+}
+
+uint64_t bitmap_next_used(const bitmap_t* bm, uint64_t from) {
+    if (from >= bm->nbits) return bm->nbits;
+    uint64_t w = from / 64;
+    uint64_t first = w;
+    uint64_t word = load_word(bm, w) & ~((1ull << (from % 64)) - 1);
+    for (;;) {
+        if (word) {
+            stats_add(STATS_BITMAP_WORDS, w - first + 1);
+            uint64_t bit = w * 64 + __builtin_ctzll(word);
+            return bit < bm->nbits ? bit : bm->nbits;
+        }
+        if (++w >= word_count(bm)) {
+            stats_add(STATS_BITMAP_WORDS, w - first);
+            return bm->nbits;
+        }
+        word = load_word(bm, w);
+    }
+}
+
+// First used bit in [from, limit), or limit. Keeps run searches from scanning
+// the whole free tail of a mostly empty bitmap.
+static uint64_t next_used_before(const bitmap_t* bm, uint64_t from, uint64_t limit) {
+    if (limit > bm->nbits) limit = bm->nbits;
+    if (from >= limit) return limit;
+    uint64_t w = from / 64;
+    uint64_t first = w;
+    uint64_t word = load_word(bm, w) & ~((1ull << (from % 64)) - 1);
+    for (;;) {
+        if (word) {
+            stats_add(STATS_BITMAP_WORDS, w - first + 1);
+            uint64_t bit = w * 64 + __builtin_ctzll(word);
+            return bit < limit ? bit : limit;
+        }
+        if (++w * 64 >= limit) {
+            stats_add(STATS_BITMAP_WORDS, w - first);
+            return limit;
+        }
+        word = load_word(bm, w);
+    }
+}
+
+int64_t bitmap_find_run(const bitmap_t* bm, uint64_t from, uint64_t length) {
+    uint64_t pos = from;
+    for (;;) {
+        uint64_t run_start = bitmap_next_free(bm, pos);
+        if (run_start >= bm->nbits) return -1;
+        uint64_t run_end = next_used_before(bm, run_start, run_start + length);
+        if (run_end - run_start >= length) return (int64_t)run_start;
+        pos = run_end;
+    }
+}
+
+int64_t bitmap_alloc(bitmap_t* bm) {
+    uint64_t bit = bitmap_next_free(bm, bm->cursor);
+    if (bit >= bm->nbits) bit = bitmap_next_free(bm, 0);
+    if (bit >= bm->nbits) return -1;
+    bitmap_set(bm, bit);
+    bm->cursor = bit + 1 < bm->nbits ? bit + 1 : 0;
+    return (int64_t)bit;
+}
+
+int bitmap_alloc_extents(bitmap_t* bm, uint64_t count, bitmap_extent_t* out, size_t max_extents) {
+    if (count == 0) return 0;
+    if (max_extents == 0) return -1;
+
+    int64_t run = bitmap_find_run(bm, bm->cursor, count);
+    if (run < 0 && bm->cursor > 0) run = bitmap_find_run(bm, 0, count);
+    if (run >= 0) {
+        out[0].start = (uint64_t)run;
+        out[0].length = count;
+        bitmap_set_range(bm, out[0].start, count);
+        bm->cursor = out[0].start + count < bm->nbits ? out[0].start + count : 0;
+        return 1;
+    }
+
+    // No single run is long enough: take free runs from the cursor to the
+    // end, then from the start back up to the cursor
+    size_t n = 0;
+    uint64_t remaining = count;
+    uint64_t pos = bm->cursor, limit = bm->nbits;
+    int wrapped = 0;
+    while (remaining > 0) {
+        uint64_t run_start = bitmap_next_free(bm, pos);
+        if (run_start >= limit) {
+            if (wrapped || bm->cursor == 0) break;
+            wrapped = 1;
+            pos = 0;
+            limit = bm->cursor;
+            continue;
+        }
+        uint64_t run_end = next_used_before(bm, run_start, run_start + remaining < limit ? run_start + remaining : limit);
+        if (n == max_extents) return -1;
+
+        uint64_t take = run_end - run_start < remaining ? run_end - run_start : remaining;
+        out[n].start = run_start;
+        out[n].length = take;
+        n++;
+        remaining -= take;
+        pos = run_end;
+    }
+    if (remaining > 0) return -1;
+
+    for (size_t i = 0; i < n; i++) bitmap_set_range(bm, out[i].start, out[i].length);
+    uint64_t last_end = out[n - 1].start + out[n - 1].length;
+    bm->cursor = last_end < bm->nbits ? last_end : 0;
+    return (int)n;
+}
@@ -0,0 +1,52 @@
+#ifndef MINIVSFS_BITMAP_H
+#define MINIVSFS_BITMAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Allocation bitmap in the on-disk layout: bit i lives in bits[i / 8] under
+// mask 1 << (i % 8), and a set bit means "in use". Searches scan 64 bits at a
+// time and skip full (or, for run ends, empty) words outright.
+//
+// Allocation is next-fit: each search starts at the cursor left by the
+// previous allocation and wraps around once, so consecutive allocations land
+// next to each other instead of refilling holes at the front.
+
+typedef struct {
+    uint64_t start;
+    uint64_t length;
+} bitmap_extent_t;
+
+typedef struct {
+    uint8_t* bits;
+    uint64_t nbits;
+    uint64_t cursor;
+} bitmap_t;
+
+void bitmap_init(bitmap_t* bm, uint8_t* bits, uint64_t nbits);
+
+int bitmap_test(const bitmap_t* bm, uint64_t bit);
+void bitmap_set(bitmap_t* bm, uint64_t bit);
+void bitmap_clear(bitmap_t* bm, uint64_t bit);
+void bitmap_set_range(bitmap_t* bm, uint64_t start, uint64_t length);
+void bitmap_clear_range(bitmap_t* bm, uint64_t start, uint64_t length);
+
+uint64_t bitmap_count_free(const bitmap_t* bm);
+
+// First free (or used) bit at or after `from`; returns nbits if there is none
+uint64_t bitmap_next_free(const bitmap_t* bm, uint64_t from);
+uint64_t bitmap_next_used(const bitmap_t* bm, uint64_t from);
+
+// Start of the first run of `length` free bits at or after `from`, or -1
+int64_t bitmap_find_run(const bitmap_t* bm, uint64_t from, uint64_t length);
+
+// Allocates one bit from the cursor onwards; returns it, or -1 when full
+int64_t bitmap_alloc(bitmap_t* bm);
+
+// Allocates `count` bits as at most `max_extents` runs. A single contiguous
+// run is preferred; otherwise free runs are taken in next-fit order. Returns
+// the number of extents written to `out`, or -1 (leaving the bitmap
+// untouched) when the request cannot be met.
+int bitmap_alloc_extents(bitmap_t* bm, uint64_t count, bitmap_extent_t* out, size_t max_extents);
+
+#endif
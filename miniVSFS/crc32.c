@@ -0,0 +1,268 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "crc32.h"
+#include "vsfs_stats.h"
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define HAVE_PCLMUL_KERNEL 1
+#endif
+
+#define CRC32_POLY 0xEDB88320u
+
+// CRC32_TAB[0] is the classic byte-at-a-time table. CRC32_TAB[k][b] is the
+// CRC of byte b followed by k zero bytes, which lets the slicing kernels
+// fold 8 or 16 input bytes per iteration with independent lookups.
+static uint32_t CRC32_TAB[16][256];
+
+static crc32_kernel_fn crc32_active;
+static const char* crc32_active_name;
+static pthread_once_t crc32_once = PTHREAD_ONCE_INIT;
+
+static inline uint32_t load_le32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap32(v);
+#endif
+    return v;
+}
+
+// ==================================KERNELS====================================
+
+static int always_supported(void) {
+    return 1;
+}
+
+static uint32_t crc32_bytewise(uint32_t c, const uint8_t* p, size_t n) {
+    for (size_t i = 0; i < n; i++) c = CRC32_TAB[0][(c ^ p[i]) & 0xFF] ^ (c >> 8);
+    return c;
+}
+
+static uint32_t crc32_slice8(uint32_t c, const uint8_t* p, size_t n) {
+    while (n >= 8) {
+        uint32_t one = load_le32(p) ^ c;
+        uint32_t two = load_le32(p + 4);
+        c = CRC32_TAB[7][one & 0xFF] ^ CRC32_TAB[6][(one >> 8) & 0xFF] ^
+            CRC32_TAB[5][(one >> 16) & 0xFF] ^ CRC32_TAB[4][one >> 24] ^
+            CRC32_TAB[3][two & 0xFF] ^ CRC32_TAB[2][(two >> 8) & 0xFF] ^
+            CRC32_TAB[1][(two >> 16) & 0xFF] ^ CRC32_TAB[0][two >> 24];
+        p += 8;
+        n -= 8;
+    }
+    return crc32_bytewise(c, p, n);
+}
+
+static uint32_t crc32_slice16(uint32_t c, const uint8_t* p, size_t n) {
+    while (n >= 16) {
+        uint32_t w0 = load_le32(p) ^ c;
+        uint32_t w1 = load_le32(p + 4);
+        uint32_t w2 = load_le32(p + 8);
+        uint32_t w3 = load_le32(p + 12);
+        c = CRC32_TAB[15][w0 & 0xFF] ^ CRC32_TAB[14][(w0 >> 8) & 0xFF] ^
+            CRC32_TAB[13][(w0 >> 16) & 0xFF] ^ CRC32_TAB[12][w0 >> 24] ^
+            CRC32_TAB[11][w1 & 0xFF] ^ CRC32_TAB[10][(w1 >> 8) & 0xFF] ^
+            CRC32_TAB[9][(w1 >> 16) & 0xFF] ^ CRC32_TAB[8][w1 >> 24] ^
+            CRC32_TAB[7][w2 & 0xFF] ^ CRC32_TAB[6][(w2 >> 8) & 0xFF] ^
+            CRC32_TAB[5][(w2 >> 16) & 0xFF] ^ CRC32_TAB[4][w2 >> 24] ^
+            CRC32_TAB[3][w3 & 0xFF] ^ CRC32_TAB[2][(w3 >> 8) & 0xFF] ^
+            CRC32_TAB[1][(w3 >> 16) & 0xFF] ^ CRC32_TAB[0][w3 >> 24];
+        p += 16;
+        n -= 16;
+    }
+    return crc32_slice8(c, p, n);
+}
+
+#ifdef HAVE_PCLMUL_KERNEL
+static int pclmul_supported(void) {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return 0;
+    return (ecx & bit_PCLMUL) && (ecx & bit_SSE4_1);
+}
+
+// Carry-less multiply folding, after Gopal et al., "Fast CRC Computation for
+// Generic Polynomials Using PCLMULQDQ Instruction" (Intel, 2009). Four 128-bit
+// lanes are folded 64 bytes at a time, reduced to one lane, then to 32 bits
+// with a Barrett reduction. The constants are the bit-reflected x^n mod P(x)
+// values from the paper for P = 0x104C11DB7.
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_pclmul(uint32_t c, const uint8_t* p, size_t n) {
+    static const uint64_t k1k2[2] __attribute__((aligned(16))) = { 0x0154442bd4, 0x01c6e41596 };
+    static const uint64_t k3k4[2] __attribute__((aligned(16))) = { 0x01751997d0, 0x00ccaa009e };
+    static const uint64_t k5k0[2] __attribute__((aligned(16))) = { 0x0163cd6124, 0x0000000000 };
+    static const uint64_t poly[2] __attribute__((aligned(16))) = { 0x01db710641, 0x01f7011641 };
+
+    if (n < 64) return crc32_slice16(c, p, n);
+
+    size_t tail = n & 15;
+    n -= tail;
+
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+    x1 = _mm_loadu_si128((const __m128i*)(p + 0x00));
+    x2 = _mm_loadu_si128((const __m128i*)(p + 0x10));
+    x3 = _mm_loadu_si128((const __m128i*)(p + 0x20));
+    x4 = _mm_loadu_si128((const __m128i*)(p + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)c));
+    x0 = _mm_load_si128((const __m128i*)k1k2);
+    p += 64;
+    n -= 64;
+
+    while (n >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        y5 = _mm_loadu_si128((const __m128i*)(p + 0x00));
+        y6 = _mm_loadu_si128((const __m128i*)(p + 0x10));
+        y7 = _mm_loadu_si128((const __m128i*)(p + 0x20));
+        y8 = _mm_loadu_si128((const __m128i*)(p + 0x30));
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+        p += 64;
+        n -= 64;
+    }
+
+    // Fold the four lanes into one
+    x0 = _mm_load_si128((const __m128i*)k3k4);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    while (n >= 16) {
+        x2 = _mm_loadu_si128((const __m128i*)p);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+        p += 16;
+        n -= 16;
+    }
+
+    // 128 -> 64 bits
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+    x0 = _mm_loadl_epi64((const __m128i*)k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduction to 32 bits
+    x0 = _mm_load_si128((const __m128i*)poly);
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    c = (uint32_t)_mm_extract_epi32(x1, 1);
+
+    return crc32_slice16(c, p, tail);
+}
+#endif
+
+// Fastest first; crc32_init() takes the first supported entry
+static const crc32_kernel_t CRC32_KERNELS[] = {
+#ifdef HAVE_PCLMUL_KERNEL
+    { "pclmul", crc32_pclmul, pclmul_supported },
+#endif
+    { "slice16", crc32_slice16, always_supported },
+    { "slice8", crc32_slice8, always_supported },
+    { "bytewise", crc32_bytewise, always_supported },
+};
+#define CRC32_KERNEL_COUNT (sizeof(CRC32_KERNELS) / sizeof(CRC32_KERNELS[0]))
+
+// =================================DISPATCH====================================
+
+static void crc32_build_tables(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int j = 0; j < 8; j++) c = (c & 1) ? (CRC32_POLY ^ (c >> 1)) : (c >> 1);
+        CRC32_TAB[0][i] = c;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int k = 1; k < 16; k++) {
+            uint32_t prev = CRC32_TAB[k - 1][i];
+            CRC32_TAB[k][i] = (prev >> 8) ^ CRC32_TAB[0][prev & 0xFF];
+        }
+    }
+}
+
+static int crc32_pick(const char* name) {
+    for (size_t i = 0; i < CRC32_KERNEL_COUNT; i++) {
+        if (strcmp(CRC32_KERNELS[i].name, name) == 0 && CRC32_KERNELS[i].supported()) {
+            crc32_active = CRC32_KERNELS[i].update;
+            crc32_active_name = CRC32_KERNELS[i].name;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static void crc32_setup(void) {
+    crc32_build_tables();
+
+    const char* forced = getenv("MINIVSFS_CRC32");
+    if (forced && crc32_pick(forced) == 0) return;
+
+    for (size_t i = 0; i < CRC32_KERNEL_COUNT; i++) {
+        if (CRC32_KERNELS[i].supported()) {
+            crc32_active = CRC32_KERNELS[i].update;
+            crc32_active_name = CRC32_KERNELS[i].name;
+            return;
+        }
+    }
+}
+
+// Threads that checksum at the same time can all be the first caller, so
+// the tables are built and the kernel picked exactly once
+void crc32_init(void) {
+    pthread_once(&crc32_once, crc32_setup);
+}
+
+uint32_t crc32_update(uint32_t crc, const void* data, size_t n) {
+    crc32_init();
+    if (!g_stats_enabled) return crc32_active(crc ^ 0xFFFFFFFFu, (const uint8_t*)data, n) ^ 0xFFFFFFFFu;
+    uint64_t start = stats_clock_ns();
+    crc = crc32_active(crc ^ 0xFFFFFFFFu, (const uint8_t*)data, n) ^ 0xFFFFFFFFu;
+    stats_checksum(start, n);
+    return crc;
+}
+
+uint32_t crc32(const void* data, size_t n) {
+    return crc32_update(0, data, n);
+}
+
+const char* crc32_kernel_name(void) {
+    crc32_init();
+    return crc32_active_name;
+}
+
+size_t crc32_kernel_count(void) {
+    return CRC32_KERNEL_COUNT;
+}
+
+const crc32_kernel_t* crc32_kernel(size_t index) {
+    return index < CRC32_KERNEL_COUNT ? &CRC32_KERNELS[index] : NULL;
+}
+
+int crc32_select(const char* name) {
+    // Initialized first, so the lazy initialization cannot undo the choice
+    crc32_init();
+    return crc32_pick(name);
+}
@@ -0,0 +1,42 @@
+#ifndef MINIVSFS_CRC32_H
+#define MINIVSFS_CRC32_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Reflected CRC-32 (polynomial 0xEDB88320, initial value and final xor
+// 0xFFFFFFFF), the same checksum zlib's crc32() computes.
+//
+// Several kernels are compiled in. crc32_init() picks the fastest one the
+// CPU supports; the MINIVSFS_CRC32 environment variable can force one by
+// name. Every kernel produces bit-identical results.
+//
+// crc32_init() runs once however many threads call it; the first checksum
+// calls it when the program has not.
+
+// A kernel advances the raw CRC register over n bytes. No pre/post inversion.
+typedef uint32_t (*crc32_kernel_fn)(uint32_t crc, const uint8_t* p, size_t n);
+
+typedef struct {
+    const char* name;
+    crc32_kernel_fn update;
+    int (*supported)(void);
+} crc32_kernel_t;
+
+void crc32_init(void);
+uint32_t crc32(const void* data, size_t n);
+
+// Continues a checksum: crc32_update(crc32(a, n), b, m) == crc32(a || b)
+uint32_t crc32_update(uint32_t crc, const void* data, size_t n);
+
+const char* crc32_kernel_name(void);
+
+// All compiled-in kernels, including ones this CPU cannot run
+size_t crc32_kernel_count(void);
+const crc32_kernel_t* crc32_kernel(size_t index);
+
+// Forces the kernel with the given name; returns -1 if unknown or unsupported.
+// Not thread safe: call it before other threads start checksumming.
+int crc32_select(const char* name);
+
+#endif
@@ -0,0 +1,458 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "crc32.h"
+#include "vsfs_format.h"
+#include "vsfs_image.h"
+#include "vsfs_dir.h"
+#include "vsfs_file.h"
+#include "vsfs_compress.h"
+#include "vsfs_dedup.h"
+#include "libminivsfs.h"
+
+_Static_assert(sizeof(((vsfs_dirent_t*)0)->name) == sizeof(((dirent64_t*)0)->name), "dirent name size mismatch");
+
+struct vsfs {
+    image_t img;
+    dcache_t dcache;
+    pthread_mutex_t lock;
+    int writable;
+    int poisoned;        // a write failed halfway; the batch must not be flushed
+};
+
+static void fs_enter(vsfs_t* fs) {
+    pthread_mutex_lock(&fs->lock);
+}
+
+// Block pointers never outlive a call, so this is where the cache shrinks
+static void fs_leave(vsfs_t* fs) {
+    image_trim(&fs->img);
+    pthread_mutex_unlock(&fs->lock);
+}
+
+static int fail(vsfs_t* fs, int err) {
+    fs_leave(fs);
+    errno = err;
+    return -1;
+}
+
+// The inode if it is allocated, NULL (ENOENT) otherwise
+static inode_t* live_inode(vsfs_t* fs, uint32_t inode_no) {
+    if (inode_no == 0 || inode_no > fs->img.sb.inode_count || !bitmap_test(&fs->img.inode_bm, inode_no - 1)) {
+        errno = ENOENT;
+        return NULL;
+    }
+    inode_t* inode = image_inode_peek(&fs->img, inode_no);
+    if (!inode) errno = EIO;
+    return inode;
+}
+
+// Resolves the directory part of path without creating anything; returns its
+// inode, or 0 with errno set
+static uint32_t parent_dir(vsfs_t* fs, const char* path) {
+    const char* end = path + strlen(path);
+    while (end > path && end[-1] == '/') end--;
+    while (end > path && end[-1] != '/') end--;
+
+    char* parent = strndup(path, (size_t)(end - path));
+    if (!parent) {
+        errno = EIO;
+        return 0;
+    }
+    int64_t inode_no = dir_resolve(&fs->img, &fs->dcache, parent);
+    free(parent);
+    if (inode_no <= 0) {
+        errno = inode_no == 0 ? ENOENT : EIO;
+        return 0;
+    }
+    inode_t* inode = live_inode(fs, (uint32_t)inode_no);
+    if (!inode) return 0;
+    if ((inode->mode & 0170000) != MODE_DIR) {
+        errno = ENOTDIR;
+        return 0;
+    }
+    return (uint32_t)inode_no;
+}
+
+// Whether the last component of path can name a file
+static int names_file(const char* path) {
+    size_t len = strlen(path);
+    if (len == 0 || path[len - 1] == '/') return 0;
+    const char* leaf = strrchr(path, '/');
+    leaf = leaf ? leaf + 1 : path;
+    return strcmp(leaf, ".") != 0 && strcmp(leaf, "..") != 0;
+}
+
+static int pread_full(int fd, void* buf, size_t len, uint64_t offset) {
+    for (size_t done = 0; done < len; ) {
+        ssize_t n = pread(fd, (uint8_t*)buf + done, len - done, (off_t)(offset + done));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        done += (size_t)n;
+    }
+    return 0;
+}
+
+vsfs_t* vsfs_open(const char* image_name, int flags, size_t cache_blocks) {
+    crc32_init();
+
+    vsfs_t* fs = calloc(1, sizeof(vsfs_t));
+    if (!fs) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    fs->writable = (flags & (VSFS_RDWR | VSFS_SHARED)) != 0;
+    int rc = image_open(&fs->img, image_name, fs->writable ? image_name : NULL, fs->writable);
+    if (rc == 0 && (flags & VSFS_SHARED) && image_share(&fs->img) != 0) {
+        rc = -1;
+        errno = EINVAL;
+    }
+    if (rc != 0) {
+        int err = errno == ENOENT || errno == EACCES || errno == EINVAL ? errno : EIO;
+        image_close(&fs->img);
+        free(fs);
+        errno = err;
+        return NULL;
+    }
+    image_set_cache_limit(&fs->img, cache_blocks);
+    fs->img.punch_freed = fs->writable;
+    dcache_init(&fs->dcache);
+    pthread_mutex_init(&fs->lock, NULL);
+    return fs;
+}
+
+int vsfs_close(vsfs_t* fs) {
+    if (!fs) return 0;
+    dcache_free(&fs->dcache);
+    int rc = image_close(&fs->img);
+    pthread_mutex_destroy(&fs->lock);
+    free(fs);
+    if (rc != 0) errno = EIO;
+    return rc;
+}
+
+int64_t vsfs_lookup(vsfs_t* fs, const char* path) {
+    fs_enter(fs);
+    int64_t inode_no = dir_resolve(&fs->img, &fs->dcache, path);
+    if (inode_no <= 0) return fail(fs, inode_no == 0 ? ENOENT : EIO);
+    fs_leave(fs);
+    return inode_no;
+}
+
+int vsfs_stat(vsfs_t* fs, uint32_t inode_no, vsfs_stat_t* st) {
+    fs_enter(fs);
+    inode_t* inode = live_inode(fs, inode_no);
+    if (!inode) return fail(fs, errno);
+    memset(st, 0, sizeof(*st));
+    st->inode_no = inode_no;
+    st->mode = inode->mode;
+    st->links = inode->links;
+    st->size = inode->size_bytes;
+    st->blocks = (inode->flags & INODE_FL_INLINE) ? 0 : (inode_stored_bytes(inode) + BS - 1) / BS;
+    st->atime = inode->atime;
+    st->mtime = inode->mtime;
+    st->ctime = inode->ctime;
+    fs_leave(fs);
+    return 0;
+}
+
+// Copies bytes [pos, end) of the blocks mapped by runs into out. Blocks
+// written by the pending batch are only in the cache; everything else is read
+// straight into out, one pread per stretch of uncached blocks within a run.
+static int read_runs(vsfs_t* fs, uint32_t inode_no, const bitmap_extent_t* runs, int n_runs, uint64_t pos,
+                     uint64_t end, uint8_t* out) {
+    uint64_t run_first = 0;
+    for (int r = 0; r < n_runs && pos < end; r++) {
+        uint64_t run_end = run_first + runs[r].length;
+        while (pos < end && pos < run_end * BS) {
+            uint64_t file_block = pos / BS;
+            uint64_t disk_block = runs[r].start + (file_block - run_first);
+            uint64_t in_block = pos % BS;
+            uint64_t n;
+            uint8_t* cached = image_cached(&fs->img, disk_block);
+            if (cached) {
+                n = BS - in_block < end - pos ? BS - in_block : end - pos;
+                memcpy(out, cached + in_block, n);
+            } else {
+                uint64_t last = file_block + 1;
+                while (last < run_end && last * BS < end &&
+                       !image_cached(&fs->img, runs[r].start + (last - run_first))) {
+                    last++;
+                }
+                n = (last * BS < end ? last * BS : end) - pos;
+                if (pread_full(fs->img.in_fd, out, n, disk_block * BS + in_block) != 0) {
+                    fprintf(stderr, "Error: Cannot read data of inode %u: %s\n", inode_no, strerror(errno));
+                    return -1;
+                }
+            }
+            out += n;
+            pos += n;
+        }
+        run_first = run_end;
+    }
+
+    if (pos < end) {
+        fprintf(stderr, "Error: Inode %u maps fewer blocks than its size needs\n", inode_no);
+        return -1;
+    }
+    return 0;
+}
+
+typedef struct {
+    vsfs_t* fs;
+    uint32_t inode_no;
+    const bitmap_extent_t* runs;
+    int n_runs;
+} stream_ctx_t;
+
+static int fetch_stream(void* arg, uint64_t stream_offset, void* buf, size_t len) {
+    stream_ctx_t* ctx = arg;
+    return read_runs(ctx->fs, ctx->inode_no, ctx->runs, ctx->n_runs, stream_offset, stream_offset + len, buf);
+}
+
+int64_t vsfs_read(vsfs_t* fs, uint32_t inode_no, uint64_t offset, void* buf, size_t len) {
+    fs_enter(fs);
+    inode_t* inode = live_inode(fs, inode_no);
+    if (!inode) return fail(fs, errno);
+    if ((inode->mode & 0170000) == MODE_DIR) return fail(fs, EISDIR);
+    uint64_t size = inode->size_bytes;
+    if (offset >= size || len == 0) {
+        fs_leave(fs);
+        return 0;
+    }
+    uint64_t end = size - offset < len ? size : offset + len;
+    if (inode->flags & INODE_FL_INLINE) {
+        if (size > INLINE_DATA_MAX) {
+            fprintf(stderr, "Error: Inline inode %u claims %lu bytes\n", inode_no, size);
+            return fail(fs, EIO);
+        }
+        memcpy(buf, inode_inline_data(inode) + offset, end - offset);
+        fs_leave(fs);
+        return (int64_t)(end - offset);
+    }
+    int compressed = (inode->flags & INODE_FL_COMPRESSED) != 0;
+    uint64_t stream_len = inode_stored_bytes(inode);
+
+    bitmap_extent_t* runs;
+    int n_runs;
+    if (file_map(&fs->img, inode_no, &runs, &n_runs) != 0) return fail(fs, EIO);
+
+    int rc;
+    if (compressed) {
+        // Only the chunks overlapping the range are fetched and decompressed
+        stream_ctx_t ctx = { fs, inode_no, runs, n_runs };
+        compress_reader_t reader;
+        rc = compress_reader_init(&reader, fetch_stream, &ctx, size, stream_len);
+        if (rc == 0) {
+            rc = compress_reader_read(&reader, offset, buf, end - offset) == (int64_t)(end - offset) ? 0 : -1;
+            compress_reader_free(&reader);
+        }
+    } else {
+        rc = read_runs(fs, inode_no, runs, n_runs, offset, end, buf);
+    }
+    free(runs);
+    if (rc != 0) return fail(fs, EIO);
+    fs_leave(fs);
+    return (int64_t)(end - offset);
+}
+
+typedef struct {
+    int (*fn)(const vsfs_dirent_t*, void*);
+    void* arg;
+    int rc;
+} list_ctx_t;
+
+static int list_entry(const dirent64_t* de, void* arg) {
+    list_ctx_t* ctx = arg;
+    vsfs_dirent_t entry;
+    entry.inode_no = de->inode_no;
+    entry.type = de->type;
+    memcpy(entry.name, de->name, sizeof(entry.name));
+    entry.name[sizeof(entry.name) - 1] = '\0';
+    ctx->rc = ctx->fn(&entry, ctx->arg);
+    return ctx->rc != 0;
+}
+
+int vsfs_list(vsfs_t* fs, uint32_t dir_ino, int (*fn)(const vsfs_dirent_t* entry, void* arg), void* arg) {
+    fs_enter(fs);
+    inode_t* dir = live_inode(fs, dir_ino);
+    if (!dir) return fail(fs, errno);
+    if ((dir->mode & 0170000) != MODE_DIR) return fail(fs, ENOTDIR);
+
+    list_ctx_t ctx = { fn, arg, 0 };
+    if (dir_iterate(&fs->img, dir_ino, list_entry, &ctx) < 0) return fail(fs, EIO);
+    fs_leave(fs);
+    return ctx.rc;
+}
+
+static int fill_from_memory(void* arg, void* buf, size_t len) {
+    const uint8_t** src = arg;
+    memcpy(buf, *src, len);
+    *src += len;
+    return 0;
+}
+
+// With VSFS_COMPRESS, stores the file as a compressed stream when that saves
+// blocks. Returns 1 when it tried (*inode_no is -1 if file_create_compressed
+// failed and undid itself), 0 when the file should be stored raw, -1 when
+// compression itself failed.
+static int add_compressed(image_t* img, const char* path, const void* data, uint64_t size, int flags,
+                          int64_t* inode_no) {
+    if (!(flags & VSFS_COMPRESS) || size <= BS || img->sb.version < VSFS_VERSION_EXTENTS) return 0;
+    const uint8_t* src = data;
+    uint8_t* stream;
+    uint64_t stream_len;
+    int rc = compress_stream(size, fill_from_memory, &src, &stream, &stream_len);
+    if (rc != 0) return rc < 0 ? -1 : 0;
+    *inode_no = file_create_compressed(img, path, size, stream, stream_len);
+    free(stream);
+    return 1;
+}
+
+int64_t vsfs_add(vsfs_t* fs, const char* path, const void* data, uint64_t size, int flags) {
+    fs_enter(fs);
+    if (!fs->writable) return fail(fs, EROFS);
+    if (fs->poisoned) return fail(fs, EIO);
+    image_t* img = &fs->img;
+
+    int mkdir_p = (flags & VSFS_MKDIR_P) != 0;
+    if (!names_file(path)) return fail(fs, EINVAL);
+    if (!mkdir_p && parent_dir(fs, path) == 0) return fail(fs, errno);
+    if (img->sb.version < VSFS_VERSION_EXTENTS && (size + BS - 1) / BS > DIRECT_MAX) return fail(fs, EFBIG);
+    if ((flags & VSFS_DEDUP) && !(img->sb.flags & SB_FLAG_DEDUP)) return fail(fs, EINVAL);
+    int small_file = img->sb.version >= VSFS_VERSION_EXTENTS && size <= INLINE_DATA_MAX;
+    uint64_t blocks = small_file ? 0 : (size + BS - 1) / BS;
+    // The summary makes a raw copy that cannot fit fail before anything changes
+    if ((img->sb.flags & SB_FLAG_SUMMARY) && !(flags & (VSFS_COMPRESS | VSFS_DEDUP)) &&
+        (blocks > img->summary.free_blocks || img->summary.free_inodes == 0)) {
+        return fail(fs, ENOSPC);
+    }
+
+    // Only a failure after this point can leave half a change behind
+    uint32_t parent_ino;
+    const char* leaf;
+    if (dir_resolve_parent(img, &fs->dcache, path, mkdir_p, &parent_ino, &leaf) != 0) {
+        if (mkdir_p) fs->poisoned = 1;
+        return fail(fs, EIO);
+    }
+    int64_t existing = dir_lookup(img, parent_ino, leaf);
+    if (existing != 0) return fail(fs, existing > 0 ? EEXIST : EIO);
+    image_set_goal(img, parent_ino, blocks, 0);
+
+    int64_t inode_no;
+    int stored = add_compressed(img, path, data, size, flags, &inode_no);
+    if (stored < 0) return fail(fs, EIO);
+    if (stored > 0 && inode_no < 0) return fail(fs, ENOSPC);
+    if (!stored && (flags & VSFS_DEDUP) && size > INLINE_DATA_MAX) {
+        const uint8_t* src = data;
+        uint64_t shared;
+        inode_no = dedup_create_file(img, path, size, fill_from_memory, &src, &shared);
+        if (inode_no < 0) return fail(fs, ENOSPC);
+        stored = 1;
+    }
+    if (!stored) {
+        bitmap_extent_t* runs;
+        int n_runs;
+        inode_no = file_create(img, path, size, data, &runs, &n_runs);
+        if (inode_no < 0) return fail(fs, ENOSPC);
+
+        const uint8_t* src = data;
+        uint64_t remaining = size;
+        for (int r = 0; r < n_runs; r++) {
+            for (uint64_t b = 0; b < runs[r].length; b++) {
+                uint8_t* block = image_block_zeroed(img, runs[r].start + b);
+                if (!block) {
+                    free(runs);
+                    fs->poisoned = 1;
+                    return fail(fs, EIO);
+                }
+                size_t n = remaining < BS ? remaining : BS;
+                memcpy(block, src, n);
+                src += n;
+                remaining -= n;
+            }
+        }
+        free(runs);
+    }
+
+    // A writer sharing the image may have taken the name meanwhile
+    if (image_lock_dir(img, parent_ino) != 0) {
+        fs->poisoned = 1;
+        return fail(fs, EIO);
+    }
+    int err = 0;
+    existing = img->shared ? dir_lookup(img, parent_ino, leaf) : 0;
+    inode_t* parent = existing == 0 ? image_inode(img, parent_ino) : NULL;
+    if (existing != 0) {
+        err = existing > 0 ? EEXIST : EIO;
+    } else if (!parent) {
+        err = EIO;
+    } else {
+        if (parent->links < UINT16_MAX) parent->links++;
+        if (dir_add(img, parent_ino, leaf, (uint32_t)inode_no, TYPE_FILE) != 0) err = ENOSPC;
+    }
+    if (image_unlock_dir(img, parent_ino) != 0 && !err) err = EIO;
+    if (err == EEXIST && file_release(img, (uint32_t)inode_no) == 0) return fail(fs, EEXIST);
+    if (err) {
+        fs->poisoned = 1;
+        return fail(fs, err);
+    }
+    fs_leave(fs);
+    return inode_no;
+}
+
+int vsfs_remove(vsfs_t* fs, const char* path) {
+    fs_enter(fs);
+    if (!fs->writable) return fail(fs, EROFS);
+    if (fs->poisoned) return fail(fs, EIO);
+    image_t* img = &fs->img;
+
+    // Only adds can run alongside other writers
+    if (!names_file(path) || img->shared) return fail(fs, EINVAL);
+    uint32_t parent_ino = parent_dir(fs, path);
+    if (parent_ino == 0) return fail(fs, errno);
+    uint32_t ignored;
+    const char* leaf;
+    if (dir_resolve_parent(img, &fs->dcache, path, 0, &ignored, &leaf) != 0) return fail(fs, EIO);
+
+    int64_t inode_no = dir_lookup(img, parent_ino, leaf);
+    if (inode_no <= 0) return fail(fs, inode_no == 0 ? ENOENT : EIO);
+    inode_t* inode = live_inode(fs, (uint32_t)inode_no);
+    if (!inode) return fail(fs, EIO);
+    if ((inode->mode & 0170000) == MODE_DIR) return fail(fs, EISDIR);
+
+    if (dir_remove(img, parent_ino, leaf) <= 0 || file_release(img, (uint32_t)inode_no) != 0) {
+        fs->poisoned = 1;
+        return fail(fs, EIO);
+    }
+    // Undo the link mkfs_adder counts for each file in a directory
+    inode_t* parent = image_inode(img, parent_ino);
+    if (!parent) {
+        fs->poisoned = 1;
+        return fail(fs, EIO);
+    }
+    if (parent->links > 2) parent->links--;
+    inode_crc_finalize(parent);
+    fs_leave(fs);
+    return 0;
+}
+
+int vsfs_flush(vsfs_t* fs) {
+    fs_enter(fs);
+    if (!fs->writable) return fail(fs, EROFS);
+    if (fs->poisoned) return fail(fs, EIO);
+
+    if (image_write_super(&fs->img) != 0) return fail(fs, EIO);
+    if (image_flush(&fs->img) != 0) {
+        fs->poisoned = 1;
+        return fail(fs, EIO);
+    }
+    fs_leave(fs);
+    return 0;
+}
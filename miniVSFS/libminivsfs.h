@@ -0,0 +1,106 @@
+#ifndef LIBMINIVSFS_H
+#define LIBMINIVSFS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// C API for reading and updating MiniVSFS images in-process.
+//
+// A handle keeps the image open with a bounded LRU cache of metadata blocks
+// (inode table, directory and index blocks) filled by pread, plus a cache of
+// resolved directory paths, so repeated lookups and reads do not re-parse the
+// image. File data is read straight into the caller's buffer.
+//
+// Changes made by vsfs_add() and vsfs_remove() form a batch that lives only
+// in memory, and is visible to reads on the same handle, until vsfs_flush()
+// writes it in one pass of coalesced writes (one journal transaction with a
+// single fdatasync on an image built with --journal). vsfs_close() discards an
+// unflushed batch. If an add or remove fails after it started changing the
+// image, the batch is poisoned: vsfs_flush() refuses to write it and the
+// handle must be closed.
+//
+// Every call returns -1 (or NULL) on failure and sets errno: ENOENT for a
+// missing path, EEXIST, EISDIR, ENOTDIR, EROFS for writes to a read-only
+// handle, ENOSPC, EINVAL for a path that cannot name a file, EIO for corrupt
+// images, I/O and allocation failures. Failures the caller can predict or
+// test for (ENOENT, EEXIST, EISDIR, ENOTDIR, EROFS, EINVAL) are silent; the
+// rest also print an "Error: ..." line to stderr.
+//
+// A handle may be shared between threads; its calls are serialized. Open one
+// handle per thread to read in parallel.
+//
+// Handles opened with VSFS_SHARED, in this process or others, can add files
+// to one image at the same time; each allocates from its own allocation group
+// (see mkfs_builder --groups). An added file is visible to the other writers
+// as soon as vsfs_add() returns, and vsfs_flush() publishes the bitmaps and
+// free counts, so flush before closing. Adding a name another writer has just
+// taken fails with EEXIST. vsfs_remove() fails with EINVAL, and images built
+// with --journal or --dedup cannot be opened shared (EINVAL).
+
+typedef struct vsfs vsfs_t;
+
+// vsfs_open() flags
+#define VSFS_RDONLY 0
+#define VSFS_RDWR   1
+#define VSFS_SHARED 2   // read-write alongside other VSFS_SHARED handles and mkfs_adder --shared (see below)
+
+// vsfs_add() flags
+#define VSFS_MKDIR_P  0x1   // create missing parent directories
+#define VSFS_COMPRESS 0x2   // store the file compressed when that saves blocks (version 2 images)
+#define VSFS_DEDUP    0x4   // share blocks already in the image (images built with --dedup; EINVAL otherwise)
+
+// Entry types reported by vsfs_list(), as stored in dirents
+#define VSFS_TYPE_FILE 1
+#define VSFS_TYPE_DIR  2
+
+typedef struct {
+    uint32_t inode_no;
+    uint16_t mode;          // 0100000 for files, 0040000 for directories
+    uint16_t links;
+    uint64_t size;
+    uint64_t blocks;        // data blocks: ceil(size / 4096), fewer for compressed files, 0 for data kept in the inode
+    uint64_t atime;
+    uint64_t mtime;
+    uint64_t ctime;
+} vsfs_stat_t;
+
+typedef struct {
+    uint32_t inode_no;
+    uint8_t type;           // VSFS_TYPE_*
+    char name[58];          // NUL-terminated, at most 57 characters
+} vsfs_dirent_t;
+
+// Opens an image. cache_blocks bounds the clean 4 KiB blocks kept in memory
+// (0 keeps every block read); the bitmaps and a pending batch come on top.
+vsfs_t* vsfs_open(const char* image_name, int flags, size_t cache_blocks);
+
+// Closes the handle, discarding changes not yet flushed
+int vsfs_close(vsfs_t* fs);
+
+// Returns the inode number of `path` ("/" is the root directory)
+int64_t vsfs_lookup(vsfs_t* fs, const char* path);
+
+int vsfs_stat(vsfs_t* fs, uint32_t inode_no, vsfs_stat_t* st);
+
+// Reads up to len bytes of a regular file at offset; returns the number of
+// bytes read, 0 at or past the end of the file
+int64_t vsfs_read(vsfs_t* fs, uint32_t inode_no, uint64_t offset, void* buf, size_t len);
+
+// Calls fn for each entry of a directory except "." and ".."; stops early and
+// returns fn's value when it is nonzero
+int vsfs_list(vsfs_t* fs, uint32_t dir_ino, int (*fn)(const vsfs_dirent_t* entry, void* arg), void* arg);
+
+// Adds a regular file holding size bytes of data at path; returns its inode.
+// Files of up to 56 bytes are stored inside the inode on version 2 images.
+// Compressed files read back transparently through vsfs_read().
+int64_t vsfs_add(vsfs_t* fs, const char* path, const void* data, uint64_t size, int flags);
+
+// Removes the regular file at path, freeing its blocks (shared ones only lose
+// a reference) and its inode
+int vsfs_remove(vsfs_t* fs, const char* path);
+
+// Writes the pending batch to the image, then punches the data blocks its
+// removes freed out of the image file so it stays sparse
+int vsfs_flush(vsfs_t* fs);
+
+#endif
@@ -0,0 +1,145 @@
+#include <string.h>
+#include "lz4.h"
+
+#define MIN_MATCH     4
+#define LAST_LITERALS 5    // the block always ends in at least this many literals
+#define MF_LIMIT      12   // no match may start within this many bytes of the end
+#define MAX_OFFSET    65535
+#define HASH_LOG      12
+
+static inline uint32_t read32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t hash4(uint32_t v) {
+    return (v * 2654435761u) >> (32 - HASH_LOG);
+}
+
+// Writes the 255-byte continuation of a length whose 4-bit field was full
+static uint8_t* put_length(uint8_t* op, size_t len) {
+    for (; len >= 255; len -= 255) *op++ = 255;
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+// Emits literals [anchor, anchor + n_lit) followed by a match of match_len
+// bytes at distance offset, or no match when match_len is 0 (last sequence).
+// Returns NULL when it would run past out_end.
+static uint8_t* put_sequence(uint8_t* op, uint8_t* out_end, const uint8_t* anchor, size_t n_lit,
+                             size_t offset, size_t match_len) {
+    size_t worst = 1 + n_lit / 255 + 1 + n_lit + 2 + match_len / 255 + 1;
+    if (worst > (size_t)(out_end - op)) return NULL;
+
+    uint8_t* token = op++;
+    *token = (uint8_t)((n_lit >= 15 ? 15 : n_lit) << 4);
+    if (n_lit >= 15) op = put_length(op, n_lit - 15);
+    memcpy(op, anchor, n_lit);
+    op += n_lit;
+    if (match_len == 0) return op;
+
+    *op++ = (uint8_t)offset;
+    *op++ = (uint8_t)(offset >> 8);
+    size_t ml = match_len - MIN_MATCH;
+    *token |= (uint8_t)(ml >= 15 ? 15 : ml);
+    if (ml >= 15) op = put_length(op, ml - 15);
+    return op;
+}
+
+size_t lz4_compress(const uint8_t* src, size_t n, uint8_t* dst, size_t dst_cap) {
+    // Positions of the last 4-byte sequence seen per hash; zero-initialized
+    // slots point at src[0], which the equality check below tolerates
+    uint32_t table[1u << HASH_LOG];
+    memset(table, 0, sizeof(table));
+
+    const uint8_t* ip = src;
+    const uint8_t* anchor = src;
+    const uint8_t* end = src + n;
+    uint8_t* op = dst;
+    uint8_t* out_end = dst + dst_cap;
+
+    if (n > MF_LIMIT) {
+        const uint8_t* match_start_limit = end - MF_LIMIT;
+        const uint8_t* match_end_limit = end - LAST_LITERALS;
+        while (ip < match_start_limit) {
+            uint32_t seq = read32(ip);
+            uint32_t h = hash4(seq);
+            const uint8_t* ref = src + table[h];
+            table[h] = (uint32_t)(ip - src);
+            if (ref >= ip || ip - ref > MAX_OFFSET || read32(ref) != seq) {
+                ip++;
+                continue;
+            }
+
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const uint8_t* m = ip + MIN_MATCH;
+            const uint8_t* r = ref + MIN_MATCH;
+            while (m < match_end_limit && *m == *r) {
+                m++;
+                r++;
+            }
+
+            op = put_sequence(op, out_end, anchor, (size_t)(ip - anchor), (size_t)(ip - ref), (size_t)(m - ip));
+            if (!op) return 0;
+            ip = m;
+            anchor = ip;
+            // Seed the table inside the match so runs of repeats chain
+            table[hash4(read32(ip - 2))] = (uint32_t)(ip - 2 - src);
+        }
+    }
+
+    op = put_sequence(op, out_end, anchor, (size_t)(end - anchor), 0, 0);
+    return op ? (size_t)(op - dst) : 0;
+}
+
+// Reads the 255-byte continuation of a length; returns -1 past the input
+static int get_length(const uint8_t** ip, const uint8_t* in_end, size_t* len) {
+    uint8_t b;
+    do {
+        if (*ip >= in_end) return -1;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+int64_t lz4_decompress(const uint8_t* src, size_t n, uint8_t* dst, size_t dst_cap) {
+    const uint8_t* ip = src;
+    const uint8_t* in_end = src + n;
+    uint8_t* op = dst;
+    uint8_t* out_end = dst + dst_cap;
+
+    while (ip < in_end) {
+        uint8_t token = *ip++;
+        size_t n_lit = token >> 4;
+        if (n_lit == 15 && get_length(&ip, in_end, &n_lit) != 0) return -1;
+        if (n_lit > (size_t)(in_end - ip) || n_lit > (size_t)(out_end - op)) return -1;
+        memcpy(op, ip, n_lit);
+        op += n_lit;
+        ip += n_lit;
+        if (ip == in_end) break;   // the last sequence has no match
+
+        if (in_end - ip < 2) return -1;
+        size_t offset = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dst)) return -1;
+        size_t match_len = token & 15;
+        if (match_len == 15 && get_length(&ip, in_end, &match_len) != 0) return -1;
+        match_len += MIN_MATCH;
+        if (match_len > (size_t)(out_end - op)) return -1;
+
+        const uint8_t* m = op - offset;
+        if (offset >= match_len) {
+            memcpy(op, m, match_len);
+        } else {
+            // Overlapping copy repeats the last `offset` bytes
+            for (size_t i = 0; i < match_len; i++) op[i] = m[i];
+        }
+        op += match_len;
+    }
+    return op - dst;
+}
@@ -0,0 +1,20 @@
+#ifndef MINIVSFS_LZ4_H
+#define MINIVSFS_LZ4_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Compressor and decompressor for the LZ4 block format: sequences of a token,
+// literals and a 16-bit back reference, with the last 5 bytes always literal.
+// Output decodes with any LZ4 block decoder. The compressor is the greedy
+// single-probe hash search, tuned for speed over ratio.
+
+// Compresses n bytes of src into dst; returns the compressed size, or 0 when
+// it would not fit in dst_cap bytes
+size_t lz4_compress(const uint8_t* src, size_t n, uint8_t* dst, size_t dst_cap);
+
+// Decompresses a whole block; returns the decompressed size, or -1 when the
+// input is malformed or decompresses to more than dst_cap bytes
+int64_t lz4_decompress(const uint8_t* src, size_t n, uint8_t* dst, size_t dst_cap);
+
+#endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #define _FILE_OFFSET_BITS 64
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,144 +10,578 @@
 #include <assert.h>
 #include <getopt.h>
 #include <unistd.h>
-
-#define BS 4096u
-#define INODE_SIZE 128u
-#define ROOT_INO 1u
+#include <fcntl.h>
+#include <limits.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "crc32.h"
+#include "vsfs_format.h"
+#include "vsfs_image.h"
+#include "vsfs_dir.h"
+#include "vsfs_file.h"
+#include "vsfs_stats.h"
 
 uint64_t g_random_seed = 0;
 
-#pragma pack(push, 1)
-typedef struct {
-    uint32_t magic;
-    uint32_t version;
-    uint32_t block_size;
-    uint64_t total_blocks;
-    uint64_t inode_count;
-    uint64_t inode_bitmap_start;
-    uint64_t inode_bitmap_blocks;
-    uint64_t data_bitmap_start;
-    uint64_t data_bitmap_blocks;
-    uint64_t inode_table_start;
-    uint64_t inode_table_blocks;
-    uint64_t data_region_start;
-    uint64_t data_region_blocks;
-    uint64_t root_inode;
-    uint64_t mtime_epoch;
-    uint32_t flags;
-    
-    // THIS FIELD SHOULD STAY AT THE END
-    // ALL OTHER FIELDS SHOULD BE ABOVE THIS
-    uint32_t checksum;
-} superblock_t;
-#pragma pack(pop)
-_Static_assert(sizeof(superblock_t) == 116, "superblock must fit in one block");
-
-#pragma pack(push,1)
+// Block numbers are stored in 32 bits (direct[], extents) and so are inode
+// numbers (dirents), which bounds the image size and the inode count
+#define MIN_SIZE_KIB 180ull
+#define MAX_SIZE_KIB ((1ull << 32) * (BS / 1024))
+#define MIN_INODES 128ull
+#define MAX_INODES 0xFFFFFFFFull
+
+// Size of the shared zero buffer used for each zero-run iovec in fast mode
+#define FAST_ZERO_BLOCKS 256
+
+enum { FAST_NONE, FAST_SPARSE, FAST_PREALLOC };
+
+// --from-dir copies file data in jobs of at most COPY_CHUNK bytes, so one
+// large file is spread over several threads
+#define COPY_CHUNK  (8u << 20)
+#define COPY_BUFFER (1u << 20)
+
+// --journal without a size takes 1/32 of the image, at most this many blocks
+#define JOURNAL_DEFAULT_MAX 1024ull
+
+// --groups without a size gives each group the blocks of one data bitmap block
+#define GROUP_DEFAULT_BLOCKS (BS * 8ull)
+
+void print_usage(const char* program_name) {
+    printf("Usage: %s --image <output.img> --size-kib <180..%llu> --inodes <128..%llu> [--fast[=sparse|prealloc]] [--lazy-itable] [--journal[=<blocks>]] [--dedup] [--groups[=<blocks>]] [--from-dir <path> [--jobs <n>]] [--stats[=json]]\n",
+           program_name, MAX_SIZE_KIB, MAX_INODES);
+    printf("  --image: Output image file name\n");
+    printf("  --size-kib: Total size in kilobytes (multiple of 4, range 180-%llu)\n", MAX_SIZE_KIB);
+    printf("  --inodes: Number of inodes (range 128-%llu)\n", MAX_INODES);
+    printf("  --fast[=sparse|prealloc]: Write only metadata; size the file with ftruncate (sparse, default)\n");
+    printf("                            or reserve its space with fallocate (prealloc)\n");
+    printf("  --lazy-itable: Do not zero inode table blocks beyond the first\n");
+    printf("  --journal[=blocks]: Reserve a metadata journal at the end of the image for crash-safe\n");
+    printf("                      in-place updates (default: 1/32 of the image, at most %llu blocks)\n", JOURNAL_DEFAULT_MAX);
+    printf("  --dedup: Reserve block reference counts and a hash index after the data region, so\n");
+    printf("           mkfs_adder --dedup can share identical blocks between files\n");
+    printf("  --groups[=blocks]: Split inodes and data blocks into allocation groups that keep each\n");
+    printf("                     directory's files together (default: %llu blocks per group)\n", GROUP_DEFAULT_BLOCKS);
+    printf("  --from-dir: Populate the new image with the contents of a host directory (implies --fast)\n");
+    printf("  --jobs: Threads copying file data for --from-dir (default: online CPUs)\n");
+    printf("  --stats[=json]: Print per-phase times and I/O, allocation and checksum counters to stderr\n");
+}
+
+// Parses a decimal count; returns 0 (never a valid value here) on malformed input
+uint64_t parse_count(const char* text) {
+    char* end;
+    errno = 0;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (errno != 0 || end == text || *end != '\0' || text[0] == '-') return 0;
+    return value;
+}
+
+// Blocks needed for a bitmap with one bit per item
+uint64_t bitmap_blocks_for(uint64_t items) {
+    return (items + BS * 8 - 1) / (BS * 8);
+}
+
+int write_block(FILE* img_file, const uint8_t* block_buffer) {
+    stats_io(0, BS);
+    return fwrite(block_buffer, 1, BS, img_file) == BS ? 0 : -1;
+}
+
+// Writes every block of the image in order, zero-filling the data region
+int stream_format(const char* image_name, const superblock_t* sb, const uint8_t* super_block,
+                  const uint8_t* first_inode_block, const uint8_t* root_dir_block, const uint8_t* journal_block,
+                  int lazy_itable) {
+    FILE* img_file = fopen(image_name, "wb");
+    if (!img_file) {
+        fprintf(stderr, "Error: Cannot create image file '%s': %s\n", image_name, strerror(errno));
+        return -1;
+    }
+    
+    uint8_t* block_buffer = calloc(1, BS);
+    if (!block_buffer) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        fclose(img_file);
+        return -1;
+    }
+    
+    int write_failed = write_block(img_file, super_block);
+    
+    // Bit 0 of each bitmap covers the root inode and the root directory block
+    for (uint64_t block = 0; block < sb->inode_bitmap_blocks + sb->data_bitmap_blocks; block++) {
+        memset(block_buffer, 0, BS);
+        if (block == 0 || block == sb->inode_bitmap_blocks) block_buffer[0] = 0x01;
+        write_failed |= write_block(img_file, block_buffer);
+    }
+    
+    memset(block_buffer, 0, BS);
+    write_failed |= write_block(img_file, first_inode_block);
+    if (lazy_itable) {
+        stats_io(0, 0);
+        if (fseeko(img_file, (off_t)(sb->data_region_start * BS), SEEK_SET) != 0) write_failed = 1;
+    } else {
+        for (uint64_t block = 1; block < sb->inode_table_blocks && !write_failed; block++) {
+            write_failed |= write_block(img_file, block_buffer);
+        }
+    }
+    
+    write_failed |= write_block(img_file, root_dir_block);
+    for (uint64_t block = 1; block < sb->data_region_blocks && !write_failed; block++) {
+        write_failed |= write_block(img_file, block_buffer);
+    }
+    for (uint64_t block = 0; block < dedup_blocks(sb) && !write_failed; block++) {
+        write_failed |= write_block(img_file, block_buffer);
+    }
+    if (journal_block) {
+        write_failed |= write_block(img_file, journal_block);
+        for (uint64_t block = 1; block < journal_blocks(sb) && !write_failed; block++) {
+            write_failed |= write_block(img_file, block_buffer);
+        }
+    }
+    
+    free(block_buffer);
+    if (fclose(img_file) != 0) write_failed = 1;
+    if (write_failed) {
+        fprintf(stderr, "Error: Cannot write image file '%s': %s\n", image_name, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// Writes an iovec list starting at `offset`, IOV_MAX entries per call
+static int pwritev_all(int fd, struct iovec* iov, size_t count, off_t offset) {
+    while (count > 0) {
+        int batch = count > IOV_MAX ? IOV_MAX : (int)count;
+        ssize_t n = pwritev(fd, iov, batch, offset);
+        stats_io(0, n > 0 ? (uint64_t)n : 0);
+        if (n < 0) return -1;
+        offset += n;
+        // Skip fully written entries and trim a partially written one
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (uint8_t*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+// Sizes the image with ftruncate (sparse) or fallocate (reserved, still
+// unwritten) and writes only the metadata, all of it in one pwritev from
+// block 0 through the root directory block. The data region is never
+// written; it reads back as zeros, and so does the journal past its header.
+// With lazy_itable the inode table past its first block is skipped too,
+// splitting the write in two.
+int fast_format(const char* image_name, const superblock_t* sb, const uint8_t* super_block,
+                const uint8_t* first_inode_block, const uint8_t* root_dir_block, const uint8_t* journal_block,
+                int lazy_itable, int preallocate) {
+    int fd = open(image_name, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Cannot create image file '%s': %s\n", image_name, strerror(errno));
+        return -1;
+    }
+    
+    off_t image_bytes = (off_t)(sb->total_blocks * BS);
+    int sized = -1;
+    if (preallocate) {
+        stats_io(0, 0);
+        sized = fallocate(fd, 0, 0, image_bytes);
+    }
+    if (sized != 0) {
+        stats_io(0, 0);
+        sized = ftruncate(fd, image_bytes);
+    }
+    if (sized != 0) {
+        fprintf(stderr, "Error: Cannot size image file '%s': %s\n", image_name, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    
+    // Zero runs share one buffer, FAST_ZERO_BLOCKS blocks per iovec
+    uint8_t* zeros = calloc(FAST_ZERO_BLOCKS, BS);
+    uint8_t* first_bitmap_block = calloc(1, BS);
+    uint64_t max_iov = 8 + (sb->inode_bitmap_blocks + sb->data_bitmap_blocks + sb->inode_table_blocks) / FAST_ZERO_BLOCKS;
+    struct iovec* iov = calloc(max_iov, sizeof(struct iovec));
+    if (!zeros || !first_bitmap_block || !iov) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        free(zeros);
+        free(first_bitmap_block);
+        free(iov);
+        close(fd);
+        return -1;
+    }
+    first_bitmap_block[0] = 0x01;
+    
+    size_t n = 0;
+    #define ADD_IOV(buf, blocks) do { iov[n].iov_base = (void*)(buf); iov[n].iov_len = (size_t)(blocks) * BS; n++; } while (0)
+    #define ADD_ZEROS(blocks) do { \
+        for (uint64_t left = (blocks); left > 0; ) { \
+            uint64_t run = left < FAST_ZERO_BLOCKS ? left : FAST_ZERO_BLOCKS; \
+            ADD_IOV(zeros, run); \
+            left -= run; \
+        } \
+    } while (0)
+    
+    ADD_IOV(super_block, 1);
+    ADD_IOV(first_bitmap_block, 1);
+    ADD_ZEROS(sb->inode_bitmap_blocks - 1);
+    ADD_IOV(first_bitmap_block, 1);
+    ADD_ZEROS(sb->data_bitmap_blocks - 1);
+    ADD_IOV(first_inode_block, 1);
+    
+    int failed;
+    if (lazy_itable) {
+        stats_io(0, BS);
+        failed = pwritev_all(fd, iov, n, 0) != 0 ||
+                 pwrite(fd, root_dir_block, BS, (off_t)(sb->data_region_start * BS)) != (ssize_t)BS;
+    } else {
+        ADD_ZEROS(sb->inode_table_blocks - 1);
+        ADD_IOV(root_dir_block, 1);
+        failed = pwritev_all(fd, iov, n, 0) != 0;
+    }
+    if (journal_block && !failed) {
+        stats_io(0, BS);
+        failed = pwrite(fd, journal_block, BS, (off_t)(journal_start(sb) * BS)) != (ssize_t)BS;
+    }
+    #undef ADD_ZEROS
+    #undef ADD_IOV
+    
+    if (close(fd) != 0) failed = 1;
+    if (failed) fprintf(stderr, "Error: Cannot write image file '%s': %s\n", image_name, strerror(errno));
+    free(zeros);
+    free(first_bitmap_block);
+    free(iov);
+    return failed ? -1 : 0;
+}
+
+// ================================FROM DIRECTORY===============================
+// --from-dir fills a freshly formatted image in three steps. A serial walk of
+// the host tree creates every directory and inode and allocates each file's
+// blocks through the same code mkfs_adder uses, all in the image block cache.
+// A pool of threads then reads the source files and pwrite()s their data
+// straight to the planned offsets; data blocks never pass through the cache.
+// Finally the cached metadata is written out in one flush.
+
 typedef struct {
-    uint16_t mode;
-    uint16_t links;
-    uint32_t uid;
-    uint32_t gid;
-    uint64_t size_bytes;
-    uint64_t atime;
-    uint64_t mtime;
-    uint64_t ctime;
-    uint32_t direct[12];
-    uint32_t reserved_0;
-    uint32_t reserved_1;
-    uint32_t reserved_2;
-    uint32_t proj_id;
-    uint32_t uid16_gid16;
-    uint64_t xattr_ptr;
-
-    // THIS FIELD SHOULD STAY AT THE END
-    // ALL OTHER FIELDS SHOULD BE ABOVE THIS
-    uint64_t inode_crc;
-
-} inode_t;
-#pragma pack(pop)
-_Static_assert(sizeof(inode_t)==INODE_SIZE, "inode size mismatch");
-
-#pragma pack(push,1)
+    const char* source;     // owned by build_plan_t.sources
+    uint64_t file_offset;
+    uint64_t image_offset;
+    uint64_t length;
+} copy_job_t;
+
 typedef struct {
-    uint32_t inode_no;
-    uint8_t type;
-    char name[58];
+    copy_job_t* jobs;
+    size_t job_count;
+    size_t job_capacity;
+    char** sources;
+    size_t source_count;
+    size_t source_capacity;
+    uint64_t files;
+    uint64_t dirs;
+    uint64_t bytes;
+} build_plan_t;
 
-    uint8_t  checksum;
-} dirent64_t;
-#pragma pack(pop)
-_Static_assert(sizeof(dirent64_t)==64, "dirent size mismatch");
+static int plan_push_job(build_plan_t* plan, const char* source, uint64_t file_offset,
+                         uint64_t image_offset, uint64_t length) {
+    if (plan->job_count == plan->job_capacity) {
+        size_t new_capacity = plan->job_capacity ? plan->job_capacity * 2 : 256;
+        copy_job_t* grown = realloc(plan->jobs, new_capacity * sizeof(copy_job_t));
+        if (!grown) return -1;
+        plan->jobs = grown;
+        plan->job_capacity = new_capacity;
+    }
+    copy_job_t* job = &plan->jobs[plan->job_count++];
+    job->source = source;
+    job->file_offset = file_offset;
+    job->image_offset = image_offset;
+    job->length = length;
+    return 0;
+}
 
-#define MODE_FILE 0100000
-#define MODE_DIR  0040000
+static char* plan_push_source(build_plan_t* plan, const char* path) {
+    if (plan->source_count == plan->source_capacity) {
+        size_t new_capacity = plan->source_capacity ? plan->source_capacity * 2 : 256;
+        char** grown = realloc(plan->sources, new_capacity * sizeof(char*));
+        if (!grown) return NULL;
+        plan->sources = grown;
+        plan->source_capacity = new_capacity;
+    }
+    char* copy = strdup(path);
+    if (copy) plan->sources[plan->source_count++] = copy;
+    return copy;
+}
 
-#define TYPE_FILE 1
-#define TYPE_DIR  2
+static void plan_free(build_plan_t* plan) {
+    for (size_t i = 0; i < plan->source_count; i++) free(plan->sources[i]);
+    free(plan->sources);
+    free(plan->jobs);
+}
 
-uint32_t calculate_crc32(const void* data, size_t length);
-static uint32_t superblock_crc_finalize(superblock_t* sb);
-void inode_crc_finalize(inode_t* inode);
-void dirent_checksum_finalize(dirent64_t* dirent);
+// Creates the inode and directory entry for one host file and queues the
+// copy of its data, split at run and COPY_CHUNK boundaries. Files small
+// enough to be stored inline are copied into their inode right away.
+static int plan_file(image_t* img, build_plan_t* plan, const char* path, const char* name,
+                     uint64_t size, uint32_t dir_ino) {
+    const char* source = plan_push_source(plan, path);
+    if (!source) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return -1;
+    }
+    // Files that fit in their inode are read here instead of queued
+    uint8_t small[INLINE_DATA_MAX];
+    if (size <= INLINE_DATA_MAX) {
+        int fd = open(path, O_RDONLY);
+        ssize_t got = fd >= 0 ? read(fd, small, size) : -1;
+        stats_io(got > 0 ? (uint64_t)got : 0, 0);
+        if (fd >= 0) close(fd);
+        if (got != (ssize_t)size) {
+            fprintf(stderr, "Error: Cannot read '%s'\n", path);
+            return -1;
+        }
+    }
+    bitmap_extent_t* runs;
+    int n_runs;
+    image_set_goal(img, dir_ino, size <= INLINE_DATA_MAX ? 0 : (size + BS - 1) / BS, 0);
+    int64_t inode_no = file_create(img, path, size, size <= INLINE_DATA_MAX ? small : NULL, &runs, &n_runs);
+    if (inode_no < 0) return -1;
 
-uint32_t CRC32_TAB[256];
-void crc32_init(void){
-    for (uint32_t i=0;i<256;i++){
-        uint32_t c=i;
-        for(int j=0;j<8;j++) c = (c&1)?(0xEDB88320u^(c>>1)):(c>>1);
-        CRC32_TAB[i]=c;
+    uint64_t file_offset = 0;
+    for (int r = 0; r < n_runs && file_offset < size; r++) {
+        uint64_t run_bytes = runs[r].length * BS;
+        for (uint64_t done = 0; done < run_bytes && file_offset < size; ) {
+            uint64_t length = run_bytes - done < COPY_CHUNK ? run_bytes - done : COPY_CHUNK;
+            if (length > size - file_offset) length = size - file_offset;
+            if (plan_push_job(plan, source, file_offset, runs[r].start * BS + done, length) != 0) {
+                fprintf(stderr, "Error: Memory allocation failed\n");
+                free(runs);
+                return -1;
+            }
+            done += length;
+            file_offset += length;
+        }
     }
+    free(runs);
+
+    inode_t* dir = image_inode(img, dir_ino);
+    if (!dir) return -1;
+    if (dir->links < UINT16_MAX) dir->links++;
+    if (dir_add(img, dir_ino, name, (uint32_t)inode_no, TYPE_FILE) != 0) return -1;
+    plan->files++;
+    plan->bytes += size;
+    return 0;
 }
-uint32_t crc32(const void* data, size_t n){
-    const uint8_t* p=(const uint8_t*)data; uint32_t c=0xFFFFFFFFu;
-    for(size_t i=0;i<n;i++) c = CRC32_TAB[(c^p[i])&0xFF] ^ (c>>8);
-    return c ^ 0xFFFFFFFFu;
-}
 
-// WARNING: CALL THIS ONLY AFTER ALL OTHER SUPERBLOCK ELEMENTS HAVE BEEN FINALIZED
-static uint32_t superblock_crc_finalize(superblock_t *sb) {
-    sb->checksum = 0;
-    uint32_t s = crc32((void *) sb, BS - 4);
-    sb->checksum = s;
-    return s;
+// Mirrors the host directory `path` into image directory dir_ino. Entries are
+// visited in sorted order so the same tree always gives the same image.
+static int plan_dir(image_t* img, build_plan_t* plan, const char* path, uint32_t dir_ino) {
+    struct dirent** entries;
+    int n = scandir(path, &entries, NULL, alphasort);
+    if (n < 0) {
+        fprintf(stderr, "Error: Cannot read directory '%s': %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    int rc = 0;
+    for (int i = 0; i < n; i++) {
+        const char* name = entries[i]->d_name;
+        if (rc != 0 || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+
+        size_t child_len = strlen(path) + strlen(name) + 2;
+        char* child = malloc(child_len);
+        if (!child) {
+            fprintf(stderr, "Error: Memory allocation failed\n");
+            rc = -1;
+            continue;
+        }
+        snprintf(child, child_len, "%s/%s", path, name);
+
+        struct stat st;
+        if (lstat(child, &st) != 0) {
+            fprintf(stderr, "Error: Cannot stat '%s': %s\n", child, strerror(errno));
+            rc = -1;
+        } else if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) {
+            fprintf(stderr, "Warning: Skipping '%s' (not a regular file or directory)\n", child);
+        } else {
+            // Names are cut to DIRENT_NAME_MAX characters, which can make two
+            // host names collide
+            int64_t existing = dir_lookup(img, dir_ino, name);
+            if (existing != 0) {
+                if (existing > 0) {
+                    fprintf(stderr, "Error: '%s' collides with another entry once cut to %d characters\n",
+                            child, DIRENT_NAME_MAX);
+                }
+                rc = -1;
+            } else if (S_ISDIR(st.st_mode)) {
+                int64_t sub_ino = dir_mkdir(img, dir_ino, name);
+                if (sub_ino < 0) {
+                    rc = -1;
+                } else {
+                    plan->dirs++;
+                    rc = plan_dir(img, plan, child, (uint32_t)sub_ino);
+                }
+            } else {
+                rc = plan_file(img, plan, child, name, (uint64_t)st.st_size, dir_ino);
+            }
+        }
+        free(child);
+    }
+
+    for (int i = 0; i < n; i++) free(entries[i]);
+    free(entries);
+    return rc;
 }
 
-// WARNING: CALL THIS ONLY AFTER ALL OTHER INODE ELEMENTS HAVE BEEN FINALIZED
-void inode_crc_finalize(inode_t* ino){
-    uint8_t tmp[INODE_SIZE]; 
-    memcpy(tmp, ino, INODE_SIZE);
-    memset(&tmp[120], 0, 8);
-    uint32_t c = crc32(tmp, 120);
-    ino->inode_crc = (uint64_t)c;
+typedef struct {
+    const build_plan_t* plan;
+    int image_fd;
+    atomic_size_t next;
+    atomic_int failed;
+} copy_pool_t;
+
+static void* copy_worker(void* arg) {
+    copy_pool_t* pool = arg;
+    uint8_t* buffer = malloc(COPY_BUFFER);
+    if (!buffer) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        atomic_store(&pool->failed, 1);
+        return NULL;
+    }
+
+    while (!atomic_load(&pool->failed)) {
+        size_t i = atomic_fetch_add(&pool->next, 1);
+        if (i >= pool->plan->job_count) break;
+        const copy_job_t* job = &pool->plan->jobs[i];
+
+        int fd = open(job->source, O_RDONLY);
+        if (fd < 0) {
+            fprintf(stderr, "Error: Cannot open file '%s': %s\n", job->source, strerror(errno));
+            atomic_store(&pool->failed, 1);
+            break;
+        }
+        for (uint64_t done = 0; done < job->length; ) {
+            size_t want = job->length - done < COPY_BUFFER ? job->length - done : COPY_BUFFER;
+            ssize_t got = pread(fd, buffer, want, (off_t)(job->file_offset + done));
+            stats_io(got > 0 ? (uint64_t)got : 0, 0);
+            if (got <= 0) {
+                fprintf(stderr, "Error: Cannot read '%s' (did it shrink while being copied?)\n", job->source);
+                atomic_store(&pool->failed, 1);
+                break;
+            }
+            for (ssize_t put = 0; put < got; ) {
+                ssize_t n = pwrite(pool->image_fd, buffer + put, got - put, (off_t)(job->image_offset + done + put));
+                stats_io(0, n > 0 ? (uint64_t)n : 0);
+                if (n <= 0) {
+                    fprintf(stderr, "Error: Cannot write image data: %s\n", strerror(errno));
+                    atomic_store(&pool->failed, 1);
+                    break;
+                }
+                put += n;
+            }
+            if (atomic_load(&pool->failed)) break;
+            done += (uint64_t)got;
+        }
+        close(fd);
+    }
+    free(buffer);
+    return NULL;
 }
 
-// WARNING: CALL THIS ONLY AFTER ALL OTHER DIRENT ELEMENTS HAVE BEEN FINALIZED
-void dirent_checksum_finalize(dirent64_t* de) {
-    const uint8_t* p = (const uint8_t*)de;
-    uint8_t x = 0;
-    for (int i = 0; i < 63; i++) x ^= p[i];
-    de->checksum = x;
+static int run_copy_pool(const build_plan_t* plan, int image_fd, unsigned threads) {
+    copy_pool_t pool;
+    pool.plan = plan;
+    pool.image_fd = image_fd;
+    atomic_init(&pool.next, 0);
+    atomic_init(&pool.failed, 0);
+
+    pthread_t* tids = calloc(threads, sizeof(pthread_t));
+    if (!tids) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return -1;
+    }
+    unsigned started = 0;
+    for (; started < threads; started++) {
+        if (pthread_create(&tids[started], NULL, copy_worker, &pool) != 0) break;
+    }
+    // With no extra threads at all, copy on this one
+    if (started == 0) copy_worker(&pool);
+    for (unsigned t = 0; t < started; t++) pthread_join(tids[t], NULL);
+    free(tids);
+    return atomic_load(&pool.failed) ? -1 : 0;
 }
 
-void print_usage(const char* program_name) {
-    printf("Usage: %s --image <output.img> --size-kib <180..4096> --inodes <128..512>\n", program_name);
-    printf("  --image: Output image file name\n");
-    printf("  --size-kib: Total size in kilobytes (multiple of 4, range 180-4096)\n");
-    printf("  --inodes: Number of inodes (range 128-512)\n");
+// Fills the image created by the formatter from source_dir
+int populate_image(const char* image_name, const char* source_dir, unsigned threads) {
+    struct stat st;
+    if (stat(source_dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "Error: '%s' is not a directory\n", source_dir);
+        return -1;
+    }
+
+    image_t img;
+    build_plan_t plan;
+    memset(&plan, 0, sizeof(plan));
+    stats_phase(STATS_LOAD);
+    int rc = image_open(&img, image_name, image_name, 1);
+    // Nothing on a freshly formatted image needs protecting from a crash
+    img.bypass_journal = 1;
+    stats_phase(STATS_ALLOC);
+    if (rc == 0) rc = plan_dir(&img, &plan, source_dir, ROOT_INO);
+    if (threads > plan.job_count) threads = plan.job_count ? (unsigned)plan.job_count : 1;
+    stats_phase(STATS_COPY);
+    if (rc == 0) rc = run_copy_pool(&plan, img.out_fd, threads);
+
+    // The single metadata commit: superblock, bitmaps, inodes and directories
+    stats_phase(STATS_WRITEBACK);
+    if (rc == 0) rc = image_write_super(&img);
+    if (rc == 0) rc = image_flush(&img);
+    if (image_close(&img) != 0 && rc == 0) {
+        fprintf(stderr, "Error: Cannot write image file '%s': %s\n", image_name, strerror(errno));
+        rc = -1;
+    }
+
+    if (rc == 0) {
+        printf("Copied %" PRIu64 " files (%" PRIu64 " bytes) and %" PRIu64 " directories from '%s' (copy threads: %u)\n",
+               plan.files, plan.bytes, plan.dirs, source_dir, threads);
+    }
+    plan_free(&plan);
+    return rc;
 }
+// ================================FROM DIRECTORY===============================
 
 int main(int argc, char* argv[]) {
+    stats_begin();
     crc32_init();
     
     char* image_name = NULL;
     uint64_t size_kib = 0;
     uint64_t inode_count = 0;
+    int fast_mode = FAST_NONE;
+    int lazy_itable = 0;
+    int journal = 0;
+    uint64_t journal_size = 0;
+    int dedup = 0;
+    int groups = 0;
+    uint64_t blocks_per_group = 0;
+    char* from_dir = NULL;
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    uint64_t jobs = online > 0 ? (uint64_t)online : 1;
     
     static struct option long_options[] = {
         {"image", required_argument, 0, 'i'},
         {"size-kib", required_argument, 0, 's'},
         {"inodes", required_argument, 0, 'n'},
+        {"fast", optional_argument, 0, 'f'},
+        {"lazy-itable", no_argument, 0, 'l'},
+        {"journal", optional_argument, 0, 'J'},
+        {"dedup", no_argument, 0, 'D'},
+        {"groups", optional_argument, 0, 'g'},
+        {"from-dir", required_argument, 0, 'd'},
+        {"jobs", required_argument, 0, 'j'},
+        {"stats", optional_argument, 0, 'S'},
         {0, 0, 0, 0}
     };
     
@@ -157,11 +592,71 @@ int main(int argc, char* argv[]) {
                 image_name = optarg;
                 break;
             case 's':
-                size_kib = atoi(optarg);
+                size_kib = parse_count(optarg);
+                if (size_kib == 0) {
+                    fprintf(stderr, "Error: Invalid --size-kib value '%s'\n", optarg);
+                    return 1;
+                }
                 break;
             case 'n':
-                inode_count = atoi(optarg);
+                inode_count = parse_count(optarg);
+                if (inode_count == 0) {
+                    fprintf(stderr, "Error: Invalid --inodes value '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'f':
+                if (!optarg || strcmp(optarg, "sparse") == 0) {
+                    fast_mode = FAST_SPARSE;
+                } else if (strcmp(optarg, "prealloc") == 0) {
+                    fast_mode = FAST_PREALLOC;
+                } else {
+                    fprintf(stderr, "Error: Invalid --fast mode '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'l':
+                lazy_itable = 1;
+                break;
+            case 'J':
+                journal = 1;
+                if (optarg) {
+                    journal_size = parse_count(optarg);
+                    if (journal_size < JOURNAL_MIN_BLOCKS) {
+                        fprintf(stderr, "Error: Invalid --journal value '%s' (at least %u blocks)\n", optarg, JOURNAL_MIN_BLOCKS);
+                        return 1;
+                    }
+                }
                 break;
+            case 'D':
+                dedup = 1;
+                break;
+            case 'g':
+                groups = 1;
+                if (optarg) {
+                    blocks_per_group = parse_count(optarg);
+                    if (blocks_per_group == 0 || blocks_per_group % 64 != 0 || blocks_per_group > (1ull << 31)) {
+                        fprintf(stderr, "Error: Invalid --groups value '%s' (a multiple of 64 blocks)\n", optarg);
+                        return 1;
+                    }
+                }
+                break;
+            case 'd':
+                from_dir = optarg;
+                break;
+            case 'j':
+                jobs = parse_count(optarg);
+                if (jobs == 0 || jobs > 1024) {
+                    fprintf(stderr, "Error: Invalid --jobs value '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'S': {
+                int mode = stats_parse_mode(optarg);
+                if (mode < 0) return 1;
+                stats_enable(mode);
+                break;
+            }
             default:
                 print_usage(argv[0]);
                 return 1;
@@ -174,70 +669,133 @@ int main(int argc, char* argv[]) {
         return 1;
     }
     
-    if (size_kib < 180 || size_kib > 4096 || size_kib % 4 != 0) {
-        fprintf(stderr, "Error: size-kib must be between 180-4096 and multiple of 4\n");
+    if (size_kib < MIN_SIZE_KIB || size_kib > MAX_SIZE_KIB || size_kib % 4 != 0) {
+        fprintf(stderr, "Error: size-kib must be between %llu-%llu and multiple of 4\n", MIN_SIZE_KIB, MAX_SIZE_KIB);
         return 1;
     }
     
-    if (inode_count < 128 || inode_count > 512) {
-        fprintf(stderr, "Error: inodes must be between 128-512\n");
+    if (inode_count < MIN_INODES || inode_count > MAX_INODES) {
+        fprintf(stderr, "Error: inodes must be between %llu-%llu\n", MIN_INODES, MAX_INODES);
         return 1;
     }
     
+    // Data written by --from-dir would only overwrite a zero-filled region
+    if (from_dir && fast_mode == FAST_NONE) fast_mode = FAST_SPARSE;
+    
     uint64_t total_blocks = (size_kib * 1024) / BS;
     uint64_t inode_table_blocks = (inode_count * INODE_SIZE + BS - 1) / BS;
+    uint64_t inode_bitmap_blocks = bitmap_blocks_for(inode_count);
+    // Sized for every block in the image, which always covers the data region
+    uint64_t data_bitmap_blocks = bitmap_blocks_for(total_blocks);
+    
+    if (journal && journal_size == 0) {
+        journal_size = total_blocks / 32;
+        if (journal_size > JOURNAL_DEFAULT_MAX) journal_size = JOURNAL_DEFAULT_MAX;
+        if (journal_size < JOURNAL_MIN_BLOCKS) journal_size = JOURNAL_MIN_BLOCKS;
+    }
     
-    uint64_t metadata_blocks = 1 + 1 + 1 + inode_table_blocks;
-    if (metadata_blocks >= total_blocks) {
+    uint64_t metadata_blocks = 1 + inode_bitmap_blocks + data_bitmap_blocks + inode_table_blocks;
+    if (metadata_blocks + journal_size >= total_blocks) {
         fprintf(stderr, "Error: Not enough space for metadata with given parameters\n");
         return 1;
     }
     
-    uint64_t data_region_blocks = total_blocks - metadata_blocks;
+    // The dedup tables and then the journal take the blocks after the data
+    // region; the tables are sized by the data region they describe
+    uint64_t data_region_blocks = total_blocks - metadata_blocks - journal_size;
+    uint64_t dedup_size = 0;
+    if (dedup) {
+        uint64_t available = data_region_blocks;
+        uint64_t tables = dedup_refcount_blocks_for(available) + dedup_index_blocks_for(available);
+        if (tables >= available) {
+            fprintf(stderr, "Error: Not enough space for metadata with given parameters\n");
+            return 1;
+        }
+        // Shrinking the data region shrinks the tables; hand what that frees back
+        data_region_blocks = available - tables;
+        while (data_region_blocks + 1 + dedup_refcount_blocks_for(data_region_blocks + 1) +
+               dedup_index_blocks_for(data_region_blocks + 1) <= available) {
+            data_region_blocks++;
+        }
+        dedup_size = dedup_refcount_blocks_for(data_region_blocks) + dedup_index_blocks_for(data_region_blocks);
+    }
     
+    // Every new image carries the free-space summary; the root directory
+    // takes the first inode and data block
+    summary_t summary = {0};
+    group_desc_t group_descs[GROUPS_MAX] = {{0}};
+    summary.magic = SUMMARY_MAGIC;
+    summary.free_blocks = data_region_blocks - 1;
+    summary.free_inodes = inode_count - 1;
+    if (groups) {
+        // Block 0 holds at most GROUPS_MAX descriptors; larger images get wider groups
+        uint64_t min_per_group = (data_region_blocks + GROUPS_MAX - 1) / GROUPS_MAX;
+        min_per_group = (min_per_group + 63) / 64 * 64;
+        if (blocks_per_group == 0) blocks_per_group = GROUP_DEFAULT_BLOCKS;
+        if (blocks_per_group < min_per_group) blocks_per_group = min_per_group;
+        summary.groups = (uint32_t)((data_region_blocks + blocks_per_group - 1) / blocks_per_group);
+        summary.blocks_per_group = (uint32_t)blocks_per_group;
+        // Inode slices end on inode table block boundaries
+        uint64_t per_block = BS / INODE_SIZE;
+        uint64_t inodes_per_group = (inode_count + summary.groups - 1) / summary.groups;
+        inodes_per_group = (inodes_per_group + per_block - 1) / per_block * per_block;
+        if (inodes_per_group > UINT32_MAX) {
+            fprintf(stderr, "Error: Too many inodes per allocation group; use smaller --groups\n");
+            return 1;
+        }
+        summary.inodes_per_group = (uint32_t)inodes_per_group;
+    }
     superblock_t superblock = {0};
-    superblock.magic = 0x4D565346;
-    superblock.version = 1;
+    superblock.magic = VSFS_MAGIC;
+    superblock.version = VSFS_VERSION;
     superblock.block_size = BS;
     superblock.total_blocks = total_blocks;
     superblock.inode_count = inode_count;
     superblock.inode_bitmap_start = 1;
-    superblock.inode_bitmap_blocks = 1;
-    superblock.data_bitmap_start = 2;
-    superblock.data_bitmap_blocks = 1;
-    superblock.inode_table_start = 3;
+    superblock.inode_bitmap_blocks = inode_bitmap_blocks;
+    superblock.data_bitmap_start = superblock.inode_bitmap_start + inode_bitmap_blocks;
+    superblock.data_bitmap_blocks = data_bitmap_blocks;
+    superblock.inode_table_start = superblock.data_bitmap_start + data_bitmap_blocks;
     superblock.inode_table_blocks = inode_table_blocks;
-    superblock.data_region_start = 3 + inode_table_blocks;
+    superblock.data_region_start = superblock.inode_table_start + inode_table_blocks;
     superblock.data_region_blocks = data_region_blocks;
     superblock.root_inode = 1;
     superblock.mtime_epoch = time(NULL);
-    superblock.flags = 0;
-    
-    FILE* img_file = fopen(image_name, "wb");
-    if (!img_file) {
-        fprintf(stderr, "Error: Cannot create image file '%s': %s\n", image_name, strerror(errno));
-        return 1;
+    superblock.flags = (lazy_itable ? SB_FLAG_LAZY_ITABLE : 0) | (journal ? SB_FLAG_JOURNAL : 0) |
+                       (dedup ? SB_FLAG_DEDUP : 0) | SB_FLAG_SUMMARY;
+    for (uint32_t g = 0; g < summary.groups; g++) {
+        group_descs[g].free_blocks = (uint32_t)group_data_blocks(&superblock, &summary, g);
+        group_descs[g].free_inodes = (uint32_t)group_inodes(&superblock, &summary, g);
+    }
+    if (summary.groups) {
+        group_descs[0].free_blocks--;
+        group_descs[0].free_inodes--;
     }
     
-    uint8_t* block_buffer = calloc(1, BS);
-    if (!block_buffer) {
+    uint8_t* super_block = calloc(1, BS);
+    uint8_t* first_inode_block = calloc(1, BS);
+    uint8_t* root_dir_block = calloc(1, BS);
+    uint8_t* journal_block = journal ? calloc(1, BS) : NULL;
+    if (!super_block || !first_inode_block || !root_dir_block || (journal && !journal_block)) {
         fprintf(stderr, "Error: Memory allocation failed\n");
-        fclose(img_file);
+        free(super_block);
+        free(first_inode_block);
+        free(root_dir_block);
+        free(journal_block);
         return 1;
     }
     
-    superblock_crc_finalize(&superblock);
-    memcpy(block_buffer, &superblock, sizeof(superblock));
-    fwrite(block_buffer, 1, BS, img_file);
-    memset(block_buffer, 0, BS);
-    
-    block_buffer[0] = 0x01;
-    fwrite(block_buffer, 1, BS, img_file);
-    memset(block_buffer, 0, BS);
+    if (journal_block) {
+        journal_header_t* header = (journal_header_t*)journal_block;
+        header->magic = JOURNAL_MAGIC;
+        header->blocks = journal_size;
+        journal_block_crc_finalize(journal_block);
+    }
     
-    block_buffer[0] = 0x01;
-    fwrite(block_buffer, 1, BS, img_file);
-    memset(block_buffer, 0, BS);
+    memcpy(super_block, &superblock, sizeof(superblock));
+    memcpy(super_block + SUMMARY_OFFSET, &summary, sizeof(summary));
+    memcpy(super_block + SUMMARY_OFFSET + sizeof(summary), group_descs, summary.groups * sizeof(group_desc_t));
+    superblock_crc_finalize((superblock_t*)super_block);
     
     inode_t root_inode = {0};
     root_inode.mode = MODE_DIR;
@@ -254,16 +812,7 @@ int main(int argc, char* argv[]) {
     }
     root_inode.proj_id = 0;
     inode_crc_finalize(&root_inode);
-    
-    for (uint64_t block = 0; block < inode_table_blocks; block++) {
-        memset(block_buffer, 0, BS);
-        
-        if (block == 0) {
-            memcpy(block_buffer, &root_inode, sizeof(inode_t));
-        }
-        
-        fwrite(block_buffer, 1, BS, img_file);
-    }
+    memcpy(first_inode_block, &root_inode, sizeof(inode_t));
     
     dirent64_t dot_entry = {0};
     dot_entry.inode_no = 1;
@@ -277,23 +826,34 @@ int main(int argc, char* argv[]) {
     strcpy(dotdot_entry.name, "..");
     dirent_checksum_finalize(&dotdot_entry);
     
-    for (uint64_t block = 0; block < data_region_blocks; block++) {
-        memset(block_buffer, 0, BS);
-        
-        if (block == 0) {
-            memcpy(block_buffer, &dot_entry, sizeof(dirent64_t));
-            memcpy(block_buffer + sizeof(dirent64_t), &dotdot_entry, sizeof(dirent64_t));
-        }
-        
-        fwrite(block_buffer, 1, BS, img_file);
-    }
+    memcpy(root_dir_block, &dot_entry, sizeof(dirent64_t));
+    memcpy(root_dir_block + sizeof(dirent64_t), &dotdot_entry, sizeof(dirent64_t));
     
-    free(block_buffer);
-    fclose(img_file);
+    stats_phase(STATS_WRITEBACK);
+    int rc = fast_mode == FAST_NONE
+        ? stream_format(image_name, &superblock, super_block, first_inode_block, root_dir_block, journal_block,
+                        lazy_itable)
+        : fast_format(image_name, &superblock, super_block, first_inode_block, root_dir_block, journal_block,
+                      lazy_itable, fast_mode == FAST_PREALLOC);
     
-    printf("Successfully created MiniVSFS image '%s'\n", image_name);
-    printf("Size: %lu KiB (%lu blocks)\n", size_kib, total_blocks);
-    printf("Inodes: %lu\n", inode_count);
+    free(super_block);
+    free(first_inode_block);
+    free(root_dir_block);
+    free(journal_block);
+    if (rc == 0 && from_dir) rc = populate_image(image_name, from_dir, (unsigned)jobs);
     
-    return 0;
+    if (rc == 0) {
+        printf("Successfully created MiniVSFS image '%s'\n", image_name);
+        printf("Size: %" PRIu64 " KiB (%" PRIu64 " blocks)\n", size_kib, total_blocks);
+        printf("Inodes: %" PRIu64 "\n", inode_count);
+        if (journal) printf("Journal: %" PRIu64 " blocks\n", journal_size);
+        if (dedup) printf("Dedup tables: %" PRIu64 " blocks\n", dedup_size);
+        if (groups) {
+            printf("Allocation groups: %u of %u blocks and %u inodes\n", summary.groups, summary.blocks_per_group,
+                   summary.inodes_per_group);
+        }
+    }
+    stats_report("mkfs_builder");
+    
+    return rc == 0 ? 0 : 1;
 }
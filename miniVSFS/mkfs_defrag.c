@@ -0,0 +1,456 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <getopt.h>
+#include "crc32.h"
+#include "bitmap.h"
+#include "vsfs_format.h"
+#include "vsfs_image.h"
+#include "vsfs_dir.h"
+#include "vsfs_file.h"
+#include "vsfs_stats.h"
+
+// Blocks copied between flushes, bounding the dirty data held in memory
+#define DEFRAG_BATCH_BLOCKS 8192
+// Most passes over the image; each one refills the holes the previous one
+// left, and it stops early once a pass moves nothing
+#define DEFRAG_PASSES 32
+// Clean blocks kept cached while copying
+#define DEFRAG_CACHE_BLOCKS 1024
+
+void print_usage(const char* program_name) {
+    printf("Usage: %s --image <image.img> [--truncate] [--stats[=json]]\n", program_name);
+    printf("  --image: Image to defragment, updated in place\n");
+    printf("  --truncate: Shrink the image to end after its last used block\n");
+    printf("  --stats[=json]: Print per-phase times and I/O, allocation and checksum counters to stderr\n");
+}
+
+// A file with data blocks, ordered by where its data starts
+typedef struct {
+    uint32_t inode_no;
+    uint64_t first;          // first data block
+    uint64_t blocks;
+    int fragmented;          // more than one run, or an overflow extent block
+} item_t;
+
+typedef struct {
+    image_t* img;
+    bitmap_extent_t* pending;   // old runs, freed at the next flush so the batch never reuses them
+    size_t n_pending;
+    size_t pending_capacity;
+    uint64_t floor;             // no free data block below this bit until the next flush
+    uint64_t batch_blocks;      // blocks copied since the last flush
+    uint64_t batch_runs;        // runs copied since the last flush
+    uint64_t batch_meta;        // metadata blocks the batch may have changed, bounded by the journal
+    uint64_t meta_limit;
+    uint64_t moved_blocks;
+    uint64_t moved_runs;
+} defrag_t;
+
+static int compare_items(const void* a, const void* b) {
+    uint64_t x = ((const item_t*)a)->first, y = ((const item_t*)b)->first;
+    return (x > y) - (x < y);
+}
+
+static int defer_free(defrag_t* d, uint64_t start, uint64_t length) {
+    if (d->n_pending == d->pending_capacity) {
+        size_t capacity = d->pending_capacity ? d->pending_capacity * 2 : 64;
+        bitmap_extent_t* pending = realloc(d->pending, capacity * sizeof(bitmap_extent_t));
+        if (!pending) {
+            fprintf(stderr, "Error: Memory allocation failed\n");
+            return -1;
+        }
+        d->pending = pending;
+        d->pending_capacity = capacity;
+    }
+    d->pending[d->n_pending++] = (bitmap_extent_t){ start, length };
+    return 0;
+}
+
+// Frees the runs moved away from and writes the batch out: one journal
+// transaction on a journaled image
+static int flush_batch(defrag_t* d) {
+    for (size_t i = 0; i < d->n_pending; i++) image_free_run(d->img, d->pending[i].start, d->pending[i].length);
+    d->n_pending = 0;
+    stats_phase_t previous = stats_phase(STATS_WRITEBACK);
+    int rc = image_write_super(d->img) == 0 && image_flush(d->img) == 0 ? 0 : -1;
+    stats_phase(previous);
+    image_trim(d->img);
+    d->floor = 0;
+    d->batch_blocks = 0;
+    d->batch_runs = 0;
+    d->batch_meta = 0;
+    return rc;
+}
+
+// Returns the lowest free run of `count` blocks as an absolute block number,
+// or 0 when there is none
+static uint64_t lowest_run(defrag_t* d, uint64_t count) {
+    bitmap_t* bm = &d->img->data_bm;
+    d->floor = bitmap_next_free(bm, d->floor);
+    int64_t run = bitmap_find_run(bm, d->floor, count);
+    return run < 0 ? 0 : d->img->sb.data_region_start + (uint64_t)run;
+}
+
+// Copies `count` blocks from `from` into a new run at `to`
+static int copy_run(defrag_t* d, uint64_t from, uint64_t to, uint64_t count) {
+    image_t* img = d->img;
+    img->data_bm.cursor = to - img->sb.data_region_start;
+    if (image_alloc_run(img, count) != to) {
+        fprintf(stderr, "Error: Cannot allocate blocks %lu-%lu\n", to, to + count - 1);
+        return -1;
+    }
+    stats_phase_t previous = stats_phase(STATS_COPY);
+    for (uint64_t b = 0; b < count; b++) {
+        uint8_t* dst = image_block_zeroed(img, to + b);
+        const uint8_t* src = dst ? image_block(img, from + b) : NULL;
+        if (!src) return -1;
+        memcpy(dst, src, BS);
+    }
+    stats_phase(previous);
+    d->batch_blocks += count;
+    d->batch_runs++;
+    d->moved_blocks += count;
+    d->moved_runs++;
+    return 0;
+}
+
+// Charges a move against the batch, flushing first when it would not fit.
+// Each move changes an inode table block, bitmap blocks for both runs and,
+// for directories, index blocks; every new run also takes a journal
+// descriptor entry.
+static int reserve(defrag_t* d, uint64_t count) {
+    uint64_t meta = 4 + 2 * (count / (BS * 8) + 1);
+    uint64_t descriptors = (d->batch_runs + count) / JOURNAL_DESC_ENTRIES + 2;
+    if (d->batch_blocks > 0 && (d->batch_blocks + count > DEFRAG_BATCH_BLOCKS ||
+                                d->batch_meta + meta + descriptors > d->meta_limit)) {
+        if (flush_batch(d) != 0) return -1;
+    }
+    d->batch_meta += meta;
+    return 0;
+}
+
+// dir_relocate() callback: moves a directory block run into the lowest hole
+// below it
+static uint64_t move_dir_run(void* arg, uint64_t block_no, uint64_t count) {
+    defrag_t* d = arg;
+    uint64_t to = lowest_run(d, count);
+    if (!to || to >= block_no) return block_no;
+    if (copy_run(d, block_no, to, count) != 0 || defer_free(d, block_no, count) != 0) return 0;
+    return to;
+}
+
+// Moves a file into one run: the lowest hole below it, or for a fragmented
+// file the lowest run that holds it anywhere. Returns 1 if it moved.
+static int move_file(defrag_t* d, item_t* item) {
+    uint64_t to = lowest_run(d, item->blocks);
+    if (!to || (!item->fragmented && to >= item->first)) return 0;
+    if (reserve(d, item->blocks) != 0) return -1;
+    // A flush may have opened a lower hole
+    to = lowest_run(d, item->blocks);
+    if (!to || (!item->fragmented && to >= item->first)) return 0;
+
+    bitmap_extent_t* runs;
+    int n_runs;
+    if (file_map(d->img, item->inode_no, &runs, &n_runs) != 0) return -1;
+    uint64_t done = 0;
+    int rc = 0;
+    for (int r = 0; rc == 0 && r < n_runs; r++) {
+        rc = copy_run(d, runs[r].start, to + done, runs[r].length);
+        if (rc == 0) rc = defer_free(d, runs[r].start, runs[r].length);
+        done += runs[r].length;
+    }
+    free(runs);
+    uint64_t extent_block;
+    if (rc == 0) rc = file_remap(d->img, item->inode_no, to, item->blocks, &extent_block);
+    if (rc == 0 && extent_block) rc = defer_free(d, extent_block, 1);
+    if (rc != 0) return -1;
+
+    // copy_run() counted the blocks run by run; the file is one move
+    d->moved_runs -= (uint64_t)n_runs - 1;
+    item->first = to;
+    item->fragmented = 0;
+    image_trim(d->img);
+    return 1;
+}
+
+// Collects every directory and every file with data blocks
+static int scan(image_t* img, item_t** items_out, size_t* n_items, uint32_t** dirs_out, size_t* n_dirs,
+                uint64_t* fragmented) {
+    size_t capacity = 1024, dir_capacity = 64;
+    item_t* items = malloc(capacity * sizeof(item_t));
+    uint32_t* dirs = malloc(dir_capacity * sizeof(uint32_t));
+    *n_items = *n_dirs = 0;
+    *fragmented = 0;
+    int rc = items && dirs ? 0 : -1;
+    if (rc != 0) fprintf(stderr, "Error: Memory allocation failed\n");
+
+    for (uint64_t bit = bitmap_next_used(&img->inode_bm, 0); rc == 0 && bit < img->inode_bm.nbits;
+         bit = bitmap_next_used(&img->inode_bm, bit + 1)) {
+        uint32_t inode_no = (uint32_t)bit + 1;
+        inode_t* inode = image_inode_peek(img, inode_no);
+        if (!inode) {
+            rc = -1;
+            break;
+        }
+        if ((inode->mode & 0170000) == MODE_DIR) {
+            if (*n_dirs == dir_capacity) {
+                uint32_t* grown = realloc(dirs, (dir_capacity *= 2) * sizeof(uint32_t));
+                if (!grown) {
+                    fprintf(stderr, "Error: Memory allocation failed\n");
+                    rc = -1;
+                    break;
+                }
+                dirs = grown;
+            }
+            dirs[(*n_dirs)++] = inode_no;
+            continue;
+        }
+        if ((inode->mode & 0170000) != MODE_FILE || (inode->flags & INODE_FL_INLINE)) continue;
+        int extent_block = (inode->flags & INODE_FL_EXTENTS) && inode->xattr_ptr;
+
+        bitmap_extent_t* runs;
+        int n_runs;
+        if (file_map(img, inode_no, &runs, &n_runs) != 0) {
+            rc = -1;
+            break;
+        }
+        uint64_t blocks = 0;
+        for (int r = 0; r < n_runs; r++) blocks += runs[r].length;
+        uint64_t first = n_runs ? runs[0].start : 0;
+        free(runs);
+        image_trim(img);
+        if (n_runs == 0) continue;
+
+        if (*n_items == capacity) {
+            item_t* grown = realloc(items, (capacity *= 2) * sizeof(item_t));
+            if (!grown) {
+                fprintf(stderr, "Error: Memory allocation failed\n");
+                rc = -1;
+                break;
+            }
+            items = grown;
+        }
+        int fragmented_file = n_runs > 1 || extent_block;
+        items[(*n_items)++] = (item_t){ inode_no, first, blocks, fragmented_file };
+        *fragmented += (uint64_t)fragmented_file;
+    }
+    *items_out = items;
+    *dirs_out = dirs;
+    return rc;
+}
+
+// Last used data block plus one, as a count of data region blocks
+static uint64_t used_end(const image_t* img) {
+    const bitmap_t* bm = &img->data_bm;
+    for (uint64_t byte = (bm->nbits + 7) / 8; byte > 0; byte--) {
+        uint8_t bits = bm->bits[byte - 1];
+        if (byte * 8 > bm->nbits) bits &= (uint8_t)((1u << (bm->nbits % 8)) - 1);
+        if (bits) return (byte - 1) * 8 + (uint64_t)(31 - __builtin_clz(bits)) + 1;
+    }
+    return 0;
+}
+
+// Ends the data region after its last used block and cuts the image file
+// there. The journal, which follows the data region, is started afresh at its
+// new place before the superblock points at it, so a crash leaves either the
+// old layout or the new one. Returns the new total_blocks, or 0 on error.
+static uint64_t truncate_image(image_t* img) {
+    superblock_t sb = img->sb;
+    summary_t summary = img->summary;
+    uint64_t keep = used_end(img);
+    if (keep == 0) keep = 1;
+
+    // Groups keep their count and inode share; their block share narrows,
+    // staying a multiple of 64 and leaving the last group at least one block
+    if ((sb.flags & SB_FLAG_SUMMARY) && summary.groups) {
+        uint64_t per_group = (keep + summary.groups - 1) / summary.groups;
+        per_group = (per_group + 63) / 64 * 64;
+        if ((uint64_t)(summary.groups - 1) * per_group >= keep) keep = (uint64_t)(summary.groups - 1) * per_group + 1;
+        summary.blocks_per_group = (uint32_t)per_group;
+    }
+    if (keep >= sb.data_region_blocks) return sb.total_blocks;
+
+    uint64_t journal = journal_blocks(&sb);
+    uint64_t old_journal = journal_start(&sb);
+    sb.data_region_blocks = keep;
+    sb.total_blocks = journal_start(&sb) + journal;
+    if (journal && sb.total_blocks > old_journal) {
+        // The new journal would overlap the live one: not worth the risk
+        return img->sb.total_blocks;
+    }
+
+    if (journal) {
+        uint8_t* block = calloc(1, BS);
+        if (!block) {
+            fprintf(stderr, "Error: Memory allocation failed\n");
+            return 0;
+        }
+        // Old file data must not parse as transactions in the new journal
+        off_t start = (off_t)(journal_start(&sb) * BS);
+        int rc = 0;
+        stats_io(0, 0);
+        if (fallocate(img->out_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start + BS,
+                      (off_t)((journal - 1) * BS)) != 0) {
+            for (uint64_t b = 1; rc == 0 && b < journal; b++) {
+                stats_io(0, BS);
+                if (pwrite(img->out_fd, block, BS, start + (off_t)(b * BS)) != BS) rc = -1;
+            }
+        }
+        journal_header_t* header = (journal_header_t*)block;
+        header->magic = JOURNAL_MAGIC;
+        header->blocks = journal;
+        journal_block_crc_finalize(block);
+        stats_io(0, BS);
+        if (rc != 0 || pwrite(img->out_fd, block, BS, start) != BS || fdatasync(img->out_fd) != 0) {
+            fprintf(stderr, "Error: Cannot write journal: %s\n", strerror(errno));
+            free(block);
+            return 0;
+        }
+        free(block);
+    }
+
+    // The counters are recounted over the narrower region and groups
+    img->sb = sb;
+    if (sb.flags & SB_FLAG_SUMMARY) {
+        bitmap_t view;
+        bitmap_init(&view, img->data_bm.bits, keep);
+        summary.free_blocks = bitmap_count_free(&view);
+        for (uint32_t g = 0; g < summary.groups; g++) {
+            uint64_t first = (uint64_t)g * summary.blocks_per_group;
+            bitmap_init(&view, img->data_bm.bits + first / 8, group_data_blocks(&sb, &summary, g));
+            img->groups[g].free_blocks = (uint32_t)bitmap_count_free(&view);
+        }
+        img->summary = summary;
+    }
+    uint8_t* super = image_block(img, 0);
+    if (!super || image_write_super(img) != 0) return 0;
+    stats_io(0, BS);
+    if (pwrite(img->out_fd, super, BS, 0) != BS || fdatasync(img->out_fd) != 0 ||
+        ftruncate(img->out_fd, (off_t)(sb.total_blocks * BS)) != 0) {
+        fprintf(stderr, "Error: Cannot shrink image: %s\n", strerror(errno));
+        return 0;
+    }
+    return sb.total_blocks;
+}
+
+int main(int argc, char* argv[]) {
+    stats_begin();
+    crc32_init();
+
+    char* image_name = NULL;
+    int truncate_image_file = 0;
+
+    static struct option long_options[] = {
+        {"image", required_argument, 0, 'i'},
+        {"truncate", no_argument, 0, 't'},
+        {"stats", optional_argument, 0, 'S'},
+        {0, 0, 0, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'i':
+                image_name = optarg;
+                break;
+            case 't':
+                truncate_image_file = 1;
+                break;
+            case 'S': {
+                int mode = stats_parse_mode(optarg);
+                if (mode < 0) return 1;
+                stats_enable(mode);
+                break;
+            }
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (!image_name) {
+        fprintf(stderr, "Error: All arguments are required\n");
+        print_usage("mkfs_defrag");
+        return 1;
+    }
+
+    image_t img;
+    stats_phase(STATS_LOAD);
+    if (image_open(&img, image_name, image_name, 1) != 0) {
+        image_close(&img);
+        return 1;
+    }
+    if (img.sb.flags & SB_FLAG_DEDUP) {
+        fprintf(stderr, "Error: Cannot defragment an image built with --dedup (its blocks may be shared)\n");
+        image_close(&img);
+        return 1;
+    }
+    image_set_cache_limit(&img, DEFRAG_CACHE_BLOCKS);
+    img.punch_freed = 1;
+
+    defrag_t d = { .img = &img, .meta_limit = UINT64_MAX };
+    // A batch is one transaction, which must fit in the journal
+    if (img.sb.flags & SB_FLAG_JOURNAL) d.meta_limit = journal_blocks(&img.sb) / 2;
+
+    stats_phase(STATS_ALLOC);
+    item_t* items;
+    uint32_t* dirs;
+    size_t n_items, n_dirs;
+    uint64_t fragmented_before;
+    uint64_t end_before = img.sb.data_region_start + used_end(&img);
+    uint64_t total_before = img.sb.total_blocks;
+    int status = scan(&img, &items, &n_items, &dirs, &n_dirs, &fragmented_before) == 0 ? 0 : 1;
+
+    // Directories go first so the small blocks fill the lowest holes
+    int passes = 0;
+    for (int moved = 1; status == 0 && moved && passes < DEFRAG_PASSES; passes++) {
+        uint64_t runs_before = d.moved_runs;
+        for (size_t i = 0; status == 0 && i < n_dirs; i++) {
+            if (reserve(&d, 1) != 0 || dir_relocate(&img, dirs[i], move_dir_run, &d) != 0) status = 1;
+            image_trim(&img);
+        }
+        qsort(items, n_items, sizeof(item_t), compare_items);
+        for (size_t i = 0; status == 0 && i < n_items; i++) {
+            if (move_file(&d, &items[i]) < 0) status = 1;
+        }
+        if (status == 0 && flush_batch(&d) != 0) status = 1;
+        moved = d.moved_runs != runs_before;
+    }
+
+    uint64_t fragmented_after = 0;
+    for (size_t i = 0; i < n_items; i++) fragmented_after += (uint64_t)items[i].fragmented;
+    uint64_t end_after = img.sb.data_region_start + used_end(&img);
+    uint64_t total_after = total_before;
+    if (status == 0 && truncate_image_file) {
+        stats_phase(STATS_WRITEBACK);
+        total_after = truncate_image(&img);
+        if (total_after == 0) status = 1;
+    }
+
+    if (image_close(&img) != 0 && status == 0) {
+        fprintf(stderr, "Error: Cannot write image: %s\n", strerror(errno));
+        status = 1;
+    }
+
+    if (status == 0) {
+        printf("Defragmented filesystem image '%s' in %d pass%s\n", image_name, passes, passes == 1 ? "" : "es");
+        printf("Moved %lu data and directory runs (%lu blocks)\n", d.moved_runs, d.moved_blocks);
+        printf("Fragmented files: %lu before, %lu after (of %zu with data blocks)\n", fragmented_before,
+               fragmented_after, n_items);
+        printf("Used blocks end at block %lu (was %lu)\n", end_after, end_before);
+        if (truncate_image_file) printf("Image size: %lu blocks (was %lu)\n", total_after, total_before);
+    }
+
+    stats_report("mkfs_defrag");
+    free(items);
+    free(dirs);
+    free(d.pending);
+    return status;
+}
@@ -0,0 +1,821 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "crc32.h"
+#include "vsfs_format.h"
+#include "vsfs_image.h"
+#include "vsfs_journal.h"
+
+// Checks an image in four parallel passes over the mapped file:
+//   1. every allocated inode: checksum, mode, block map (extents, overflow
+//      extent block, directory index); each referenced block is claimed in
+//      an atomic bitset, so a block claimed twice is caught as it happens.
+//      An inode that fails its checksum is not trusted: its blocks go to a
+//      separate bitset that pass 4 leaves alone, nothing is repaired for it,
+//      and while there is one no block is freed, since a corrupt block map
+//      may hide blocks the file really owns
+//   2. every directory: dirent checksums, ".", "..", targets, index routing;
+//      each entry bumps an atomic reference count. An entry that fails its
+//      checksum is not trusted either: its inode number or name may be the
+//      corrupt field, so it is reported, left as it is and not counted
+//   3. every allocated inode again: link counts against the references, and
+//      directory sizes and links against their entries; none of them is
+//      repaired while an entry failing its checksum is left, since the
+//      counts may be missing the references it really holds
+//   4. the data bitmap, word by word against the claims, and on a
+//      deduplicated image each block's reference count against its owners
+// The free-space summary is then checked against the bitmaps as pass 4 left
+// them. Workers take fixed-size chunks from a shared atomic cursor. Repairs only
+// ever touch the chunk a worker owns, so no locking is needed.
+//
+// On a journaled image --repair first replays the journal through the image
+// layer, the way any tool opening the image would, and closes it with an
+// empty transaction so the journal is not replayed over the repairs.
+//
+// Exit status follows e2fsck: 0 clean, 1 problems repaired, 4 problems left,
+// 8 operational error.
+
+#define INODES_PER_CHUNK 1024
+#define WORDS_PER_CHUNK  4096
+#define MAX_REPORTED     1000
+
+#define EXIT_CLEAN      0
+#define EXIT_REPAIRED   1
+#define EXIT_UNREPAIRED 4
+#define EXIT_FAILED     8
+
+typedef struct fsck_s {
+    uint8_t* base;                // whole image, mapped
+    superblock_t* sb;
+    int repair;
+    int lazy;                     // SB_FLAG_LAZY_ITABLE: free inodes hold garbage
+    _Atomic uint64_t* claimed;    // data-region blocks referenced by an inode
+    _Atomic uint64_t* suspect;    // data-region blocks referenced by an inode failing its checksum
+    _Atomic uint32_t* owners;     // SB_FLAG_DEDUP: file data references per data-region block
+    _Atomic uint32_t* refcount;   // directory entries per inode ("." and ".." excluded)
+    uint64_t* dir_entries;        // regular entries per directory checked in pass 2, plus 1
+    atomic_uint_fast64_t suspects;    // allocated inodes failing their checksum
+    atomic_uint_fast64_t bad_entries; // directory entries failing their checksum
+    atomic_uint_fast64_t problems;
+    atomic_uint_fast64_t repaired;
+    atomic_uint_fast64_t directories;
+    atomic_uint_fast64_t entries;
+    atomic_size_t next;           // chunk cursor of the running pass
+    size_t chunks;
+    void (*pass)(struct fsck_s*, size_t chunk);
+} fsck_t;
+
+static void report(fsck_t* f, int repaired, const char* fmt, ...) {
+    uint64_t n = atomic_fetch_add(&f->problems, 1);
+    if (repaired) atomic_fetch_add(&f->repaired, 1);
+    if (n > MAX_REPORTED) return;
+
+    flockfile(stdout);
+    if (n == MAX_REPORTED) {
+        printf("... further problems not listed\n");
+    } else {
+        va_list ap;
+        va_start(ap, fmt);
+        vprintf(fmt, ap);
+        va_end(ap);
+        printf(repaired ? " (repaired)\n" : "\n");
+    }
+    funlockfile(stdout);
+}
+
+static uint8_t* block_at(const fsck_t* f, uint64_t block_no) {
+    return f->base + block_no * BS;
+}
+
+static inode_t* inode_at(const fsck_t* f, uint64_t inode_no) {
+    return (inode_t*)(block_at(f, f->sb->inode_table_start) + (inode_no - 1) * INODE_SIZE);
+}
+
+static int bit_is_set(const uint8_t* bits, uint64_t bit) {
+    return (bits[bit / 8] >> (bit % 8)) & 1;
+}
+
+static int inode_marked(const fsck_t* f, uint64_t inode_no) {
+    return bit_is_set(block_at(f, f->sb->inode_bitmap_start), inode_no - 1);
+}
+
+static int in_data_region(const fsck_t* f, uint64_t block_no, uint64_t count) {
+    return block_no >= f->sb->data_region_start && count <= f->sb->data_region_blocks &&
+           block_no - f->sb->data_region_start <= f->sb->data_region_blocks - count;
+}
+
+static int inode_crc_ok(const inode_t* inode) {
+    return (uint32_t)inode->inode_crc == crc32(inode, 120) && (inode->inode_crc >> 32) == 0;
+}
+
+static int dirent_checksum_ok(const dirent64_t* de) {
+    const uint8_t* p = (const uint8_t*)de;
+    uint8_t x = 0;
+    for (int i = 0; i < 63; i++) x ^= p[i];
+    return x == de->checksum;
+}
+
+// crc32 of an extent block or index header + table as it would be with its
+// checksum field (bytes 12..15 in both) zeroed, without writing to the image
+static uint32_t crc32_zeroed_field(const void* p, size_t n) {
+    static const uint8_t zero[4];
+    uint32_t c = crc32(p, 12);
+    c = crc32_update(c, zero, sizeof(zero));
+    return crc32_update(c, (const uint8_t*)p + 16, n - 16);
+}
+
+// Claims `count` blocks from block_no for inode_no. Each 64-bit word of the
+// ownership map is updated with one fetch_or, and any bit that was already
+// set is a block with two owners. Claims of a suspect inode only mark the
+// blocks in the suspect map.
+static int claim(fsck_t* f, uint64_t block_no, uint64_t count, uint32_t inode_no, const char* what, int suspect) {
+    if (count == 0) return 0;
+    if (!in_data_region(f, block_no, count)) {
+        report(f, 0, "inode %u: %s blocks %" PRIu64 "-%" PRIu64 " lie outside the data region",
+               inode_no, what, block_no, block_no + count - 1);
+        return -1;
+    }
+    uint64_t bit = block_no - f->sb->data_region_start;
+    uint64_t end = bit + count;
+    int rc = 0;
+    while (bit < end) {
+        uint64_t w = bit / 64;
+        uint64_t lo = bit % 64;
+        uint64_t n = end - bit < 64 - lo ? end - bit : 64 - lo;
+        uint64_t mask = (n == 64 ? ~0ull : ((1ull << n) - 1)) << lo;
+        if (suspect) {
+            atomic_fetch_or(&f->suspect[w], mask);
+            bit += n;
+            continue;
+        }
+        uint64_t old = atomic_fetch_or(&f->claimed[w], mask);
+        if (old & mask) {
+            uint64_t dup = w * 64 + __builtin_ctzll(old & mask) + f->sb->data_region_start;
+            report(f, 0, "inode %u: %s block %" PRIu64 " is also used by another inode", inode_no, what, dup);
+            rc = -1;
+        }
+        bit += n;
+    }
+    return rc;
+}
+
+// Claims file data blocks. On a deduplicated image a data block may have
+// several file owners, so those are counted per block and only the first one
+// claims the block; a block that is also metadata still shows up as a double
+// claim.
+static void claim_data(fsck_t* f, uint64_t block_no, uint64_t count, uint32_t inode_no, int suspect) {
+    if (!f->owners || suspect || count == 0 || !in_data_region(f, block_no, count)) {
+        claim(f, block_no, count, inode_no, "data", suspect);
+        return;
+    }
+    for (uint64_t b = block_no; b < block_no + count; b++) {
+        if (atomic_fetch_add(&f->owners[b - f->sb->data_region_start], 1) == 0) claim(f, b, 1, inode_no, "data", 0);
+    }
+}
+
+// ================================PASS 1: INODES================================
+
+// The stream header in the first block of a compressed file must describe
+// the chunks of a file of its size
+static void check_compressed(fsck_t* f, uint32_t ino, const inode_t* inode) {
+    uint64_t chunks = (inode->size_bytes + COMPRESS_CHUNK - 1) / COMPRESS_CHUNK;
+    uint64_t stored = inode_stored_bytes(inode);
+    if (f->sb->version < VSFS_VERSION_EXTENTS || !(inode->flags & INODE_FL_EXTENTS) ||
+        stored < sizeof(compress_header_t) + (chunks + 1) * sizeof(uint64_t)) {
+        report(f, 0, "inode %u: compressed file with flags %#x and a %" PRIu64 "-byte stream",
+               ino, inode->flags, stored);
+        return;
+    }
+    if (!inode->extents[0].length || !in_data_region(f, inode->extents[0].start, 1)) return;
+    const compress_header_t* hdr = (const compress_header_t*)block_at(f, inode->extents[0].start);
+    if (hdr->magic != COMPRESS_MAGIC || hdr->chunk_size != COMPRESS_CHUNK || hdr->chunks != chunks) {
+        report(f, 0, "inode %u: compressed stream header is corrupt", ino);
+    }
+}
+
+static void check_file_blocks(fsck_t* f, uint32_t ino, inode_t* inode, int suspect) {
+    uint64_t needed = (inode_stored_bytes(inode) + BS - 1) / BS;
+    uint64_t mapped = 0;
+
+    if (inode->flags & INODE_FL_COMPRESSED) check_compressed(f, ino, inode);
+    if (inode->flags & INODE_FL_INLINE) {
+        if (f->sb->version < VSFS_VERSION_EXTENTS ||
+            (inode->flags & (INODE_FL_EXTENTS | INODE_FL_INDEX | INODE_FL_COMPRESSED)) ||
+            inode->size_bytes > INLINE_DATA_MAX || inode->xattr_ptr) {
+            report(f, 0, "inode %u: inline file with flags %#x, size %" PRIu64 " and extent block %" PRIu64,
+                   ino, inode->flags, inode->size_bytes, inode->xattr_ptr);
+        }
+        return;
+    }
+    if (inode->flags & INODE_FL_EXTENTS) {
+        int i = 0;
+        for (; i < INLINE_EXTENTS && inode->extents[i].length; i++) {
+            claim_data(f, inode->extents[i].start, inode->extents[i].length, ino, suspect);
+            mapped += inode->extents[i].length;
+        }
+        if (inode->xattr_ptr) {
+            if (!in_data_region(f, inode->xattr_ptr, 1)) {
+                report(f, 0, "inode %u: extent block %" PRIu64 " lies outside the data region", ino, inode->xattr_ptr);
+                return;
+            }
+            claim(f, inode->xattr_ptr, 1, ino, "extent", suspect);
+            extent_block_t* eb = (extent_block_t*)block_at(f, inode->xattr_ptr);
+            if (eb->magic != EXTENT_BLOCK_MAGIC || eb->owner != ino || eb->count > EXTENT_BLOCK_MAX) {
+                report(f, 0, "inode %u: extent block %" PRIu64 " is corrupt", ino, inode->xattr_ptr);
+                return;
+            }
+            uint32_t actual = crc32_zeroed_field(eb, BS);
+            if (eb->checksum != actual) {
+                if (f->repair && !suspect) eb->checksum = actual;
+                report(f, f->repair && !suspect, "inode %u: extent block %" PRIu64 " checksum mismatch", ino, inode->xattr_ptr);
+            }
+            for (uint32_t e = 0; e < eb->count; e++) {
+                claim_data(f, eb->extents[e].start, eb->extents[e].length, ino, suspect);
+                mapped += eb->extents[e].length;
+            }
+        }
+    } else {
+        for (uint64_t i = 0; i < DIRECT_MAX && inode->direct[i]; i++) {
+            claim_data(f, inode->direct[i], 1, ino, suspect);
+            mapped++;
+        }
+    }
+
+    if (mapped != needed) {
+        report(f, 0, "inode %u: maps %" PRIu64 " blocks but its size (%" PRIu64 " bytes) needs %" PRIu64,
+               ino, mapped, inode_stored_bytes(inode), needed);
+    }
+}
+
+// Validates a directory's index and claims its table and leaves. Returns the
+// table when it can be trusted, NULL otherwise.
+static dx_header_t* check_dx(fsck_t* f, uint32_t ino, const inode_t* dir, int claim_blocks, int suspect) {
+    if (!in_data_region(f, dir->xattr_ptr, 1)) {
+        if (claim_blocks) report(f, 0, "directory %u: index block %" PRIu64 " lies outside the data region", ino, dir->xattr_ptr);
+        return NULL;
+    }
+    dx_header_t* hdr = (dx_header_t*)block_at(f, dir->xattr_ptr);
+    if (hdr->magic != DX_MAGIC || hdr->owner != ino || hdr->depth > DX_MAX_DEPTH ||
+        !in_data_region(f, dir->xattr_ptr, dx_table_blocks(hdr->depth))) {
+        if (claim_blocks) report(f, 0, "directory %u: index at block %" PRIu64 " is corrupt", ino, dir->xattr_ptr);
+        return NULL;
+    }
+    if (!claim_blocks) return hdr;
+
+    claim(f, dir->xattr_ptr, dx_table_blocks(hdr->depth), ino, "index", suspect);
+    uint64_t bytes = sizeof(dx_header_t) + ((uint64_t)sizeof(uint32_t) << hdr->depth);
+    uint32_t actual = crc32_zeroed_field(hdr, bytes);
+    if (hdr->checksum != actual) {
+        if (f->repair && !suspect) hdr->checksum = actual;
+        report(f, f->repair && !suspect, "directory %u: index checksum mismatch", ino);
+    }
+
+    // A leaf shared by several slots is claimed at its lowest slot only
+    const uint32_t* table = (const uint32_t*)(hdr + 1);
+    for (uint64_t i = 0; i < (1ull << hdr->depth); i++) {
+        uint64_t lower = i ? i & ~(1ull << (63 - __builtin_clzll(i))) : 0;
+        if (i == 0 || table[i] != table[lower]) claim(f, table[i], 1, ino, "directory leaf", suspect);
+    }
+    return hdr;
+}
+
+static void pass_inodes(fsck_t* f, size_t chunk) {
+    uint64_t first = (uint64_t)chunk * INODES_PER_CHUNK + 1;
+    uint64_t last = first + INODES_PER_CHUNK - 1;
+    if (last > f->sb->inode_count) last = f->sb->inode_count;
+
+    for (uint64_t ino = first; ino <= last; ino++) {
+        inode_t* inode = inode_at(f, ino);
+        if (!inode_marked(f, ino)) {
+            if (!f->lazy && inode->mode != 0 && inode_crc_ok(inode)) {
+                report(f, 0, "inode %" PRIu64 ": in use (mode %o) but free in the inode bitmap", ino, inode->mode);
+            }
+            continue;
+        }
+
+        // Any field may be the corrupt one, so a checksum is never rewritten
+        int suspect = !inode_crc_ok(inode);
+        if (suspect) {
+            atomic_fetch_add(&f->suspects, 1);
+            report(f, 0, "inode %" PRIu64 ": checksum mismatch, its blocks are left as they are", ino);
+        }
+
+        if ((inode->mode & 0170000) == MODE_FILE) {
+            check_file_blocks(f, (uint32_t)ino, inode, suspect);
+        } else if ((inode->mode & 0170000) == MODE_DIR) {
+            if (inode->flags & (INODE_FL_INLINE | INODE_FL_COMPRESSED)) {
+                report(f, 0, "inode %" PRIu64 ": directory marked as inline or compressed file", ino);
+            }
+            claim(f, inode->direct[0], 1, (uint32_t)ino, "directory", suspect);
+            if (inode->flags & INODE_FL_INDEX) check_dx(f, (uint32_t)ino, inode, 1, suspect);
+        } else {
+            report(f, 0, "inode %" PRIu64 ": unknown mode %o", ino, inode->mode);
+        }
+    }
+}
+
+// =============================PASS 2: DIRECTORIES==============================
+
+static int entry_target_ok(fsck_t* f, uint32_t dir_ino, const dirent64_t* de) {
+    if (de->inode_no > f->sb->inode_count || !inode_marked(f, de->inode_no)) {
+        report(f, 0, "directory %u: entry '%.57s' points at free inode %u", dir_ino, de->name, de->inode_no);
+        return 0;
+    }
+    return 1;
+}
+
+// Checks one block of entries; returns the number of regular entries in it
+static uint64_t check_entries(fsck_t* f, uint32_t dir_ino, uint64_t block_no, int first_block,
+                              const dx_header_t* hdr) {
+    dirent64_t* entries = (dirent64_t*)block_at(f, block_no);
+    uint64_t count = 0;
+
+    for (int i = 0; i < (int)(BS / sizeof(dirent64_t)); i++) {
+        dirent64_t* de = &entries[i];
+        if (de->inode_no == 0) continue;
+
+        int is_dot = first_block && i == 0;
+        int is_dotdot = first_block && i == 1;
+        if (!dirent_checksum_ok(de)) {
+            atomic_fetch_add(&f->bad_entries, 1);
+            report(f, 0, "directory %u: entry '%.57s' checksum mismatch, it is left as it is", dir_ino, de->name);
+            // It still takes a slot of the directory's size
+            if (!is_dot && !is_dotdot) count++;
+            continue;
+        }
+
+        if (is_dot) {
+            if (strcmp(de->name, ".") != 0 || de->inode_no != dir_ino) {
+                report(f, 0, "directory %u: first entry is not '.' for itself", dir_ino);
+            }
+            continue;
+        }
+        if (is_dotdot) {
+            if (strcmp(de->name, "..") != 0) {
+                report(f, 0, "directory %u: second entry is not '..'", dir_ino);
+            } else if (entry_target_ok(f, dir_ino, de) &&
+                       (inode_at(f, de->inode_no)->mode & 0170000) != MODE_DIR) {
+                report(f, 0, "directory %u: '..' points at non-directory inode %u", dir_ino, de->inode_no);
+            }
+            continue;
+        }
+
+        count++;
+        if (hdr) {
+            const uint32_t* table = (const uint32_t*)(hdr + 1);
+            if (table[dirent_name_hash(de->name) & ((1ull << hdr->depth) - 1)] != block_no) {
+                report(f, 0, "directory %u: entry '%.57s' is in the wrong index leaf", dir_ino, de->name);
+            }
+        }
+        if (!entry_target_ok(f, dir_ino, de)) continue;
+
+        atomic_fetch_add(&f->refcount[de->inode_no], 1);
+        if (!inode_crc_ok(inode_at(f, de->inode_no))) continue;  // its mode may be the corrupt field
+
+        uint8_t type = (inode_at(f, de->inode_no)->mode & 0170000) == MODE_DIR ? TYPE_DIR : TYPE_FILE;
+        if (de->type != type) {
+            if (f->repair) {
+                de->type = type;
+                dirent_checksum_finalize(de);
+            }
+            report(f, f->repair, "directory %u: entry '%.57s' has the wrong type", dir_ino, de->name);
+        }
+    }
+    return count;
+}
+
+static void pass_directories(fsck_t* f, size_t chunk) {
+    uint64_t first = (uint64_t)chunk * INODES_PER_CHUNK + 1;
+    uint64_t last = first + INODES_PER_CHUNK - 1;
+    if (last > f->sb->inode_count) last = f->sb->inode_count;
+
+    for (uint64_t ino = first; ino <= last; ino++) {
+        inode_t* dir = inode_at(f, ino);
+        if (!inode_marked(f, ino) || (dir->mode & 0170000) != MODE_DIR) continue;
+        if (!in_data_region(f, dir->direct[0], 1) || !inode_crc_ok(dir)) continue;  // reported in pass 1
+        atomic_fetch_add(&f->directories, 1);
+
+        const dx_header_t* hdr = NULL;
+        uint64_t count = check_entries(f, (uint32_t)ino, dir->direct[0], 1, NULL);
+        if (dir->flags & INODE_FL_INDEX) {
+            hdr = check_dx(f, (uint32_t)ino, dir, 0, 0);
+            if (hdr) {
+                const uint32_t* table = (const uint32_t*)(hdr + 1);
+                for (uint64_t i = 0; i < (1ull << hdr->depth); i++) {
+                    uint64_t lower = i ? i & ~(1ull << (63 - __builtin_clzll(i))) : 0;
+                    if ((i == 0 || table[i] != table[lower]) && in_data_region(f, table[i], 1)) {
+                        count += check_entries(f, (uint32_t)ino, table[i], 0, hdr);
+                    }
+                }
+            }
+        }
+        atomic_fetch_add(&f->entries, count);
+        // Compared in pass 3, once every entry's checksum is known
+        f->dir_entries[ino] = count + 1;
+    }
+}
+
+// ==============================PASS 3: LINK COUNTS=============================
+
+static void pass_links(fsck_t* f, size_t chunk) {
+    uint64_t first = (uint64_t)chunk * INODES_PER_CHUNK + 1;
+    uint64_t last = first + INODES_PER_CHUNK - 1;
+    if (last > f->sb->inode_count) last = f->sb->inode_count;
+
+    for (uint64_t ino = first; ino <= last; ino++) {
+        inode_t* inode = inode_at(f, ino);
+        if (!inode_marked(f, ino) || !inode_crc_ok(inode)) continue;  // reported in pass 1
+        uint32_t refs = atomic_load(&f->refcount[ino]);
+        int fix = f->repair && atomic_load(&f->bad_entries) == 0;
+
+        if ((inode->mode & 0170000) == MODE_DIR) {
+            if (ino == ROOT_INO ? refs != 0 : refs != 1) {
+                report(f, 0, "directory %" PRIu64 ": named by %u entries", ino, refs);
+            }
+            if (f->dir_entries[ino] == 0) continue;  // not checked in pass 2
+
+            // mkfs_adder counts one link per entry on top of "." and ".."
+            uint64_t count = f->dir_entries[ino] - 1;
+            uint64_t size = (count + 2) * sizeof(dirent64_t);
+            uint16_t links = count + 2 < UINT16_MAX ? (uint16_t)(count + 2) : UINT16_MAX;
+            if (inode->size_bytes != size || inode->links != links) {
+                report(f, fix, "directory %" PRIu64 ": size/links are %" PRIu64 "/%u, entries say %" PRIu64 "/%u",
+                       ino, inode->size_bytes, inode->links, size, links);
+                if (fix) {
+                    inode->size_bytes = size;
+                    inode->links = links;
+                    inode_crc_finalize(inode);
+                }
+            }
+        } else if ((inode->mode & 0170000) == MODE_FILE) {
+            if (refs == 0) {
+                report(f, 0, "inode %" PRIu64 ": allocated but not in any directory", ino);
+            } else if (inode->links != refs) {
+                report(f, fix, "inode %" PRIu64 ": link count %u, directory entries %u", ino, inode->links, refs);
+                if (fix) {
+                    inode->links = (uint16_t)refs;
+                    inode_crc_finalize(inode);
+                }
+            }
+        }
+    }
+}
+
+// ================================PASS 4: BITMAPS===============================
+
+// Word w of an on-disk bitmap, bit j standing for bit w * 64 + j
+static uint64_t load_bitmap_word(const uint8_t* bits, uint64_t w) {
+    uint64_t word;
+    memcpy(&word, bits + w * 8, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    return word;
+}
+
+static void store_bitmap_word(uint8_t* bits, uint64_t w, uint64_t word) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    memcpy(bits + w * 8, &word, sizeof(word));
+}
+
+// A block with several owners must count all of them; one with a single
+// owner may or may not be counted, and a free block must not be. Owners
+// failing their checksum are not counted, so their blocks are skipped.
+static void check_refcounts(fsck_t* f, uint64_t w, uint64_t valid) {
+    uint16_t* refs = (uint16_t*)block_at(f, dedup_start(f->sb));
+    for (uint64_t m = valid & ~atomic_load(&f->suspect[w]); m; m &= m - 1) {
+        uint64_t b = w * 64 + __builtin_ctzll(m);
+        uint32_t owners = atomic_load(&f->owners[b]);
+        if (owners >= 2 ? refs[b] == owners : refs[b] <= owners) continue;
+        int fixable = owners <= UINT16_MAX;
+        report(f, f->repair && fixable, "block %" PRIu64 ": reference count %u but %u owners",
+               f->sb->data_region_start + b, refs[b], owners);
+        if (f->repair && fixable) refs[b] = (uint16_t)owners;
+    }
+}
+
+static void pass_bitmaps(fsck_t* f, size_t chunk) {
+    uint64_t words = (f->sb->data_region_blocks + 63) / 64;
+    uint64_t nbits = f->sb->data_region_blocks;
+    uint8_t* bits = block_at(f, f->sb->data_bitmap_start);
+    uint64_t first = (uint64_t)chunk * WORDS_PER_CHUNK;
+    uint64_t end = first + WORDS_PER_CHUNK;
+    if (end > words) end = words;
+
+    for (uint64_t w = first; w < end; w++) {
+        // Bits past the end of the data region are left as they are
+        uint64_t valid = nbits - w * 64 >= 64 ? ~0ull : (1ull << (nbits - w * 64)) - 1;
+        uint64_t on_disk = load_bitmap_word(bits, w);
+        uint64_t used = atomic_load(&f->claimed[w]);
+        if (f->owners) check_refcounts(f, w, valid);
+        // Blocks only a suspect inode claims keep their bit, whatever it is
+        uint64_t leaked = on_disk & ~used & ~atomic_load(&f->suspect[w]) & valid;
+        uint64_t missing = used & ~on_disk & valid;
+        if (!(leaked | missing)) continue;
+
+        int free_leaked = f->repair && atomic_load(&f->suspects) == 0;
+        for (uint64_t m = leaked; m; m &= m - 1) {
+            report(f, free_leaked, "block %" PRIu64 ": marked used but owned by no inode",
+                   f->sb->data_region_start + w * 64 + __builtin_ctzll(m));
+        }
+        for (uint64_t m = missing; m; m &= m - 1) {
+            report(f, f->repair, "block %" PRIu64 ": in use but free in the data bitmap",
+                   f->sb->data_region_start + w * 64 + __builtin_ctzll(m));
+        }
+        if (f->repair) store_bitmap_word(bits, w, (on_disk | missing) & ~(free_leaked ? leaked : 0));
+    }
+}
+
+// ==============================FREE-SPACE SUMMARY=============================
+
+// Clear bits in [start, end) of an on-disk bitmap
+static uint64_t count_free(const uint8_t* bits, uint64_t start, uint64_t end) {
+    uint64_t used = 0;
+    for (uint64_t w = start / 64; w * 64 < end; w++) {
+        uint64_t lo = w * 64 < start ? start - w * 64 : 0;
+        uint64_t hi = end - w * 64 >= 64 ? 64 : end - w * 64;
+        uint64_t mask = (hi == 64 ? ~0ull : (1ull << hi) - 1) & ~((1ull << lo) - 1);
+        used += (uint64_t)__builtin_popcountll(load_bitmap_word(bits, w) & mask);
+    }
+    return end - start - used;
+}
+
+// A summary whose group layout does not fit the image is rebuilt as plain
+// counters, which every tool can use
+static void check_summary(fsck_t* f) {
+    summary_t* s = (summary_t*)(f->base + SUMMARY_OFFSET);
+    group_desc_t* groups = (group_desc_t*)(f->base + SUMMARY_OFFSET + sizeof(summary_t));
+    const uint8_t* inode_bits = block_at(f, f->sb->inode_bitmap_start);
+    const uint8_t* data_bits = block_at(f, f->sb->data_bitmap_start);
+
+    summary_t layout = *s;
+    layout.free_blocks = layout.free_inodes = 0;
+    if (!summary_valid(f->sb, &layout)) {
+        report(f, f->repair, "summary: corrupt header");
+        if (!f->repair) return;
+        memset(s, 0, sizeof(summary_t));
+        s->magic = SUMMARY_MAGIC;
+    }
+
+    uint64_t free_blocks = count_free(data_bits, 0, f->sb->data_region_blocks);
+    uint64_t free_inodes = count_free(inode_bits, 0, f->sb->inode_count);
+    if (s->free_blocks != free_blocks || s->free_inodes != free_inodes) {
+        report(f, f->repair, "summary: %" PRIu64 " free blocks and %" PRIu64 " free inodes, bitmaps have %"
+               PRIu64 " and %" PRIu64, s->free_blocks, s->free_inodes, free_blocks, free_inodes);
+        if (f->repair) {
+            s->free_blocks = free_blocks;
+            s->free_inodes = free_inodes;
+        }
+    }
+    for (uint32_t g = 0; g < s->groups; g++) {
+        uint64_t first_block = (uint64_t)g * s->blocks_per_group;
+        uint64_t first_inode = (uint64_t)g * s->inodes_per_group;
+        uint32_t blocks = (uint32_t)count_free(data_bits, first_block, first_block + group_data_blocks(f->sb, s, g));
+        uint32_t inodes = (uint32_t)count_free(inode_bits, first_inode, first_inode + group_inodes(f->sb, s, g));
+        if (groups[g].free_blocks == blocks && groups[g].free_inodes == inodes) continue;
+        report(f, f->repair, "group %u: %u free blocks and %u free inodes, bitmaps have %u and %u",
+               g, groups[g].free_blocks, groups[g].free_inodes, blocks, inodes);
+        if (f->repair) {
+            groups[g].free_blocks = blocks;
+            groups[g].free_inodes = inodes;
+        }
+    }
+}
+
+// ==================================WORKERS====================================
+
+static void* worker(void* arg) {
+    fsck_t* f = arg;
+    for (;;) {
+        size_t chunk = atomic_fetch_add(&f->next, 1);
+        if (chunk >= f->chunks) break;
+        f->pass(f, chunk);
+    }
+    return NULL;
+}
+
+static void run_pass(fsck_t* f, void (*pass)(fsck_t*, size_t), size_t chunks, unsigned threads) {
+    f->pass = pass;
+    f->chunks = chunks;
+    atomic_store(&f->next, 0);
+    if (threads > chunks) threads = chunks ? (unsigned)chunks : 1;
+
+    pthread_t tids[threads];
+    unsigned started = 0;
+    for (; started < threads; started++) {
+        if (pthread_create(&tids[started], NULL, worker, f) != 0) break;
+    }
+    if (started == 0) worker(f);
+    for (unsigned t = 0; t < started; t++) pthread_join(tids[t], NULL);
+}
+
+static int layout_valid(const superblock_t* sb, uint64_t file_size) {
+    return sb->block_size == BS &&
+           (!(sb->flags & SB_FLAG_JOURNAL) || journal_blocks(sb) >= JOURNAL_MIN_BLOCKS) &&
+           sb->inode_bitmap_start == 1 &&
+           sb->inode_bitmap_blocks * BS * 8 >= sb->inode_count &&
+           sb->data_bitmap_blocks * BS * 8 >= sb->data_region_blocks &&
+           sb->inode_table_blocks * (BS / INODE_SIZE) >= sb->inode_count &&
+           sb->data_bitmap_start == sb->inode_bitmap_start + sb->inode_bitmap_blocks &&
+           sb->inode_table_start == sb->data_bitmap_start + sb->data_bitmap_blocks &&
+           sb->data_region_start == sb->inode_table_start + sb->inode_table_blocks &&
+           sb->data_region_start + sb->data_region_blocks <= sb->total_blocks &&
+           journal_start(sb) <= sb->total_blocks &&
+           sb->total_blocks <= file_size / BS;
+}
+
+static int replay_journal(const char* image_name) {
+    image_t img;
+    int rc = image_open(&img, image_name, image_name, 1);
+    if (rc == 0) rc = journal_barrier(&img);
+    if (image_close(&img) != 0) rc = -1;
+    return rc;
+}
+
+// A corrupt journal header makes every tool refuse the image; the repair
+// starts an empty journal
+static void check_journal(fsck_t* f) {
+    uint8_t* journal = f->base + journal_start(f->sb) * BS;
+    uint64_t blocks = journal_blocks(f->sb);
+    const journal_header_t* header = (const journal_header_t*)journal;
+    uint8_t copy[BS];
+    memcpy(copy, journal, BS);
+    if (header->magic == JOURNAL_MAGIC && header->blocks == blocks &&
+        journal_block_crc_finalize(copy) == header->checksum) {
+        return;
+    }
+    report(f, f->repair, "journal: corrupt header");
+    if (f->repair) {
+        memset(journal, 0, blocks * BS);
+        journal_header_t* fresh = (journal_header_t*)journal;
+        fresh->magic = JOURNAL_MAGIC;
+        fresh->blocks = blocks;
+        journal_block_crc_finalize(journal);
+    }
+}
+
+void print_usage(const char* program_name) {
+    printf("Usage: %s --image <image.img> [--repair] [--jobs <n>]\n", program_name);
+    printf("  --image: Image file to check\n");
+    printf("  --repair: Fix checksums, bitmaps, free-space counters, directory sizes and link counts in place\n");
+    printf("  --jobs: Worker threads (default: online CPUs)\n");
+}
+
+int main(int argc, char* argv[]) {
+    crc32_init();
+
+    char* image_name = NULL;
+    int repair = 0;
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned threads = online > 0 ? (unsigned)online : 1;
+
+    static struct option long_options[] = {
+        {"image", required_argument, 0, 'i'},
+        {"repair", no_argument, 0, 'r'},
+        {"jobs", required_argument, 0, 'j'},
+        {0, 0, 0, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'i':
+                image_name = optarg;
+                break;
+            case 'r':
+                repair = 1;
+                break;
+            case 'j': {
+                char* end;
+                unsigned long n = strtoul(optarg, &end, 10);
+                if (*end != '\0' || n == 0 || n > 1024) {
+                    fprintf(stderr, "Error: Invalid --jobs value '%s'\n", optarg);
+                    return EXIT_FAILED;
+                }
+                threads = (unsigned)n;
+                break;
+            }
+            default:
+                print_usage(argv[0]);
+                return EXIT_FAILED;
+        }
+    }
+
+    if (!image_name) {
+        fprintf(stderr, "Error: --image is required\n");
+        print_usage(argv[0]);
+        return EXIT_FAILED;
+    }
+
+    int fd = open(image_name, repair ? O_RDWR : O_RDONLY);
+    superblock_t peek;
+    if (repair && fd >= 0 && pread(fd, &peek, sizeof(peek), 0) == (ssize_t)sizeof(peek) &&
+        peek.magic == VSFS_MAGIC && (peek.flags & SB_FLAG_JOURNAL) && replay_journal(image_name) != 0) {
+        fprintf(stderr, "Warning: Journal not replayed; checking the image as it is on disk\n");
+    }
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Error: Cannot open image '%s': %s\n", image_name, strerror(errno));
+        return EXIT_FAILED;
+    }
+    if ((uint64_t)st.st_size < BS) {
+        fprintf(stderr, "Error: '%s' is too small to be an image\n", image_name);
+        close(fd);
+        return EXIT_FAILED;
+    }
+    uint8_t* base = mmap(NULL, st.st_size, repair ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "Error: Cannot map image '%s': %s\n", image_name, strerror(errno));
+        close(fd);
+        return EXIT_FAILED;
+    }
+
+    static fsck_t fsck;
+    fsck_t* f = &fsck;
+    f->base = base;
+    f->sb = (superblock_t*)base;
+    f->repair = repair;
+
+    if (f->sb->magic != VSFS_MAGIC) {
+        fprintf(stderr, "Error: Invalid filesystem magic number\n");
+        return EXIT_FAILED;
+    }
+    if (f->sb->version != VSFS_VERSION_DIRECT && f->sb->version != VSFS_VERSION_EXTENTS) {
+        fprintf(stderr, "Error: Unsupported filesystem version %u\n", f->sb->version);
+        return EXIT_FAILED;
+    }
+    if (!layout_valid(f->sb, (uint64_t)st.st_size)) {
+        fprintf(stderr, "Error: Corrupt superblock layout\n");
+        return EXIT_FAILED;
+    }
+    f->lazy = (f->sb->flags & SB_FLAG_LAZY_ITABLE) != 0;
+    if (f->sb->flags & SB_FLAG_JOURNAL) check_journal(f);
+
+    uint8_t sb_block[BS];
+    memcpy(sb_block, base, BS);
+    if (superblock_crc_finalize((superblock_t*)sb_block) != f->sb->checksum) {
+        // Rewritten below once every other repair is in
+        report(f, repair, "superblock: checksum mismatch");
+    }
+
+    uint64_t data_words = (f->sb->data_region_blocks + 63) / 64;
+    f->claimed = calloc(data_words ? data_words : 1, sizeof(uint64_t));
+    f->suspect = calloc(data_words ? data_words : 1, sizeof(uint64_t));
+    f->refcount = calloc(f->sb->inode_count + 1, sizeof(uint32_t));
+    f->dir_entries = calloc(f->sb->inode_count + 1, sizeof(uint64_t));
+    if (f->sb->flags & SB_FLAG_DEDUP) f->owners = calloc(f->sb->data_region_blocks + 1, sizeof(uint32_t));
+    if (!f->claimed || !f->suspect || !f->refcount || !f->dir_entries || ((f->sb->flags & SB_FLAG_DEDUP) && !f->owners)) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return EXIT_FAILED;
+    }
+
+    size_t inode_chunks = (f->sb->inode_count + INODES_PER_CHUNK - 1) / INODES_PER_CHUNK;
+    size_t bitmap_chunks = (data_words + WORDS_PER_CHUNK - 1) / WORDS_PER_CHUNK;
+    run_pass(f, pass_inodes, inode_chunks, threads);
+    run_pass(f, pass_directories, inode_chunks, threads);
+    run_pass(f, pass_links, inode_chunks, threads);
+    run_pass(f, pass_bitmaps, bitmap_chunks, threads);
+    if (f->sb->flags & SB_FLAG_SUMMARY) check_summary(f);
+
+    int status = EXIT_CLEAN;
+    if (repair && atomic_load(&f->repaired) > 0) {
+        superblock_crc_finalize(f->sb);
+        if (msync(base, st.st_size, MS_SYNC) != 0) {
+            fprintf(stderr, "Error: Cannot write repairs to '%s': %s\n", image_name, strerror(errno));
+            status = EXIT_FAILED;
+        }
+    }
+
+    uint64_t problems = atomic_load(&f->problems);
+    uint64_t repaired = atomic_load(&f->repaired);
+    printf("%s: %" PRIu64 " directories, %" PRIu64 " entries, %" PRIu64 " problems",
+           image_name, (uint64_t)atomic_load(&f->directories), (uint64_t)atomic_load(&f->entries), problems);
+    if (repair) printf(", %" PRIu64 " repaired", repaired);
+    printf("\n");
+
+    if (status == EXIT_CLEAN && problems > 0) status = repaired == problems ? EXIT_REPAIRED : EXIT_UNREPAIRED;
+
+    munmap(base, st.st_size);
+    close(fd);
+    free(f->claimed);
+    free(f->suspect);
+    free(f->owners);
+    free(f->refcount);
+    free(f->dir_entries);
+    return status;
+}
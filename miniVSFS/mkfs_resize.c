@@ -0,0 +1,608 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include "crc32.h"
+#include "bitmap.h"
+#include "vsfs_format.h"
+#include "vsfs_image.h"
+#include "vsfs_journal.h"
+#include "vsfs_dir.h"
+#include "vsfs_file.h"
+#include "vsfs_stats.h"
+
+// Same bounds as mkfs_builder: block and inode numbers are stored in 32 bits
+#define MAX_SIZE_KIB ((1ull << 32) * (BS / 1024))
+#define MAX_INODES 0xFFFFFFFFull
+
+// Clean blocks kept cached while moving data out of the way
+#define RESIZE_CACHE_BLOCKS 1024
+
+void print_usage(const char* program_name) {
+    printf("Usage: %s --image <image.img> [--size-kib <n>] [--inodes <n>] [--stats[=json]]\n", program_name);
+    printf("  --image: Image to grow, updated in place\n");
+    printf("  --size-kib: New total size in kilobytes (multiple of 4, at least the current size)\n");
+    printf("  --inodes: New number of inodes (at least the current count)\n");
+    printf("  --stats[=json]: Print per-phase times and I/O, allocation and checksum counters to stderr\n");
+}
+
+// Parses a decimal count; returns 0 (never a valid value here) on malformed input
+uint64_t parse_count(const char* text) {
+    char* end;
+    errno = 0;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (errno != 0 || end == text || *end != '\0' || text[0] == '-') return 0;
+    return value;
+}
+
+// Blocks needed for a bitmap with one bit per item
+uint64_t bitmap_blocks_for(uint64_t items) {
+    return (items + BS * 8 - 1) / (BS * 8);
+}
+
+// Places the bitmaps, inode table and data region one after another, as
+// mkfs_builder does, with `journal` blocks left at the end of the image
+static void lay_out(superblock_t* sb, uint64_t journal) {
+    sb->inode_bitmap_start = 1;
+    sb->data_bitmap_start = sb->inode_bitmap_start + sb->inode_bitmap_blocks;
+    sb->inode_table_start = sb->data_bitmap_start + sb->data_bitmap_blocks;
+    sb->data_region_start = sb->inode_table_start + sb->inode_table_blocks;
+    sb->data_region_blocks = sb->total_blocks - sb->data_region_start - journal;
+}
+
+static int write_block(int fd, const uint8_t* block, uint64_t block_no) {
+    stats_io(0, BS);
+    if (pwrite(fd, block, BS, (off_t)(block_no * BS)) != BS) {
+        fprintf(stderr, "Error: Cannot write image: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int sync_image(int fd) {
+    stats_io(0, 0);
+    if (fdatasync(fd) != 0) {
+        fprintf(stderr, "Error: Cannot sync image: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// Zeroes `count` blocks from `first`: a hole where the host filesystem
+// supports punching, zero writes otherwise
+static int zero_blocks(int fd, uint64_t first, uint64_t count) {
+    if (count == 0) return 0;
+    stats_io(0, 0);
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)(first * BS), (off_t)(count * BS)) == 0) {
+        return 0;
+    }
+    uint8_t* zero = calloc(1, BS);
+    if (!zero) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return -1;
+    }
+    int rc = 0;
+    for (uint64_t b = 0; rc == 0 && b < count; b++) rc = write_block(fd, zero, first + b);
+    free(zero);
+    return rc;
+}
+
+static int push_run(bitmap_extent_t** runs, size_t* n_runs, size_t* capacity, uint64_t start, uint64_t length) {
+    if (*n_runs == *capacity) {
+        size_t grown_capacity = *capacity ? *capacity * 2 : 64;
+        bitmap_extent_t* grown = realloc(*runs, grown_capacity * sizeof(bitmap_extent_t));
+        if (!grown) {
+            fprintf(stderr, "Error: Memory allocation failed\n");
+            return -1;
+        }
+        *runs = grown;
+        *capacity = grown_capacity;
+    }
+    (*runs)[(*n_runs)++] = (bitmap_extent_t){ start, length };
+    return 0;
+}
+
+// Recounts the free-space summary over the given bitmaps for the layout in
+// sb. Groups keep their size while block 0 has room for their descriptors
+// and their inode share while it covers every inode; otherwise they widen.
+static int regroup(const superblock_t* sb, summary_t* summary, group_desc_t* groups, uint8_t* inode_bits,
+                   uint8_t* data_bits) {
+    bitmap_t view;
+    bitmap_init(&view, data_bits, sb->data_region_blocks);
+    summary->free_blocks = bitmap_count_free(&view);
+    bitmap_init(&view, inode_bits, sb->inode_count);
+    summary->free_inodes = bitmap_count_free(&view);
+    if (summary->groups == 0) return 0;
+
+    uint64_t per_group = (sb->data_region_blocks + GROUPS_MAX - 1) / GROUPS_MAX;
+    per_group = (per_group + 63) / 64 * 64;
+    if (per_group < summary->blocks_per_group) per_group = summary->blocks_per_group;
+    uint64_t n_groups = (sb->data_region_blocks + per_group - 1) / per_group;
+    uint64_t inodes_per_group = summary->inodes_per_group;
+    if (n_groups * inodes_per_group < sb->inode_count) {
+        uint64_t per_block = BS / INODE_SIZE;
+        inodes_per_group = (sb->inode_count + n_groups - 1) / n_groups;
+        inodes_per_group = (inodes_per_group + per_block - 1) / per_block * per_block;
+        if (inodes_per_group > UINT32_MAX) {
+            fprintf(stderr, "Error: Too many inodes per allocation group\n");
+            return -1;
+        }
+    }
+    summary->groups = (uint32_t)n_groups;
+    summary->blocks_per_group = (uint32_t)per_group;
+    summary->inodes_per_group = (uint32_t)inodes_per_group;
+    for (uint32_t g = 0; g < summary->groups; g++) {
+        uint64_t first = (uint64_t)g * summary->blocks_per_group;
+        bitmap_init(&view, data_bits + first / 8, group_data_blocks(sb, summary, g));
+        groups[g].free_blocks = (uint32_t)bitmap_count_free(&view);
+        first = (uint64_t)g * summary->inodes_per_group;
+        bitmap_init(&view, inode_bits + first / 8, group_inodes(sb, summary, g));
+        groups[g].free_inodes = (uint32_t)bitmap_count_free(&view);
+    }
+    return 0;
+}
+
+// Moves the journal from old_start to new_start, both `blocks` long. Once the
+// current journal is restarted only its first three blocks can be replayed,
+// so the rest is cleared first and those three last; a crash in between
+// leaves a journal that replays nothing.
+static int move_journal(image_t* img, uint64_t old_start, uint64_t new_start, uint64_t blocks) {
+    if (journal_restart(img) != 0) return -1;
+    uint64_t kept = old_start + 3;
+    uint64_t first = new_start + 1 > kept ? new_start + 1 : kept;
+    if (zero_blocks(img->out_fd, first, new_start + blocks - first) != 0 || sync_image(img->out_fd) != 0) return -1;
+    if (new_start + 1 < kept && zero_blocks(img->out_fd, new_start + 1, kept - new_start - 1) != 0) return -1;
+
+    uint8_t* block = calloc(1, BS);
+    if (!block) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return -1;
+    }
+    journal_header_t* header = (journal_header_t*)block;
+    header->magic = JOURNAL_MAGIC;
+    header->blocks = blocks;
+    journal_block_crc_finalize(block);
+    int rc = write_block(img->out_fd, block, new_start) == 0 && sync_image(img->out_fd) == 0 ? 0 : -1;
+    free(block);
+    return rc;
+}
+
+// Grows the image to total_blocks without moving any metadata: the data
+// region takes the new blocks and the journal moves to the new end. Nothing
+// the current superblock relies on changes before the new superblock is
+// written, so a crash leaves one layout or the other.
+static int grow_region(const char* image_name, uint64_t total_blocks) {
+    image_t img;
+    stats_phase(STATS_LOAD);
+    if (image_open(&img, image_name, image_name, 1) != 0) {
+        image_close(&img);
+        return -1;
+    }
+    superblock_t sb = img.sb;
+    uint64_t grow = total_blocks - sb.total_blocks;
+    uint64_t journal = journal_blocks(&sb);
+    uint64_t old_journal = journal_start(&sb);
+    sb.total_blocks = total_blocks;
+    sb.data_region_blocks += grow;
+
+    stats_phase(STATS_WRITEBACK);
+    struct stat st;
+    int rc = fstat(img.out_fd, &st);
+    if (rc == 0 && (uint64_t)st.st_size < total_blocks * BS) rc = ftruncate(img.out_fd, (off_t)(total_blocks * BS));
+    if (rc != 0) fprintf(stderr, "Error: Cannot extend image: %s\n", strerror(errno));
+
+    // The new bits lie past the end of the current data region
+    bitmap_t view;
+    bitmap_init(&view, img.data_bm.bits, sb.data_region_blocks);
+    bitmap_clear_range(&view, img.sb.data_region_blocks, grow);
+    for (uint64_t b = img.sb.data_region_blocks / (BS * 8); rc == 0 && b <= (sb.data_region_blocks - 1) / (BS * 8);
+         b++) {
+        rc = write_block(img.out_fd, img.data_bm.bits + b * BS, sb.data_bitmap_start + b);
+    }
+    if (rc == 0 && journal) rc = move_journal(&img, old_journal, journal_start(&sb), journal);
+
+    if (rc == 0) {
+        img.sb = sb;
+        if (sb.flags & SB_FLAG_SUMMARY) {
+            rc = regroup(&sb, &img.summary, img.groups, img.inode_bm.bits, img.data_bm.bits);
+        }
+    }
+    uint8_t* super = rc == 0 && image_write_super(&img) == 0 ? image_block(&img, 0) : NULL;
+    if (!super || sync_image(img.out_fd) != 0 || write_block(img.out_fd, super, 0) != 0 ||
+        sync_image(img.out_fd) != 0) {
+        rc = -1;
+    }
+    if (image_close(&img) != 0) rc = -1;
+    return rc;
+}
+
+typedef struct {
+    image_t* img;
+    uint64_t zone_end;          // first block past what the grown metadata takes
+    bitmap_extent_t* pending;   // runs moved away from, freed once every move is made
+    size_t n_pending;
+    size_t pending_capacity;
+    uint64_t moved_runs;
+    uint64_t moved_blocks;
+} resize_t;
+
+// Allocates `count` blocks past the zone and copies `count` blocks from
+// `from` there; returns the new start, or 0
+static uint64_t move_run(resize_t* r, uint64_t from, uint64_t to, uint64_t count) {
+    image_t* img = r->img;
+    stats_phase_t previous = stats_phase(STATS_COPY);
+    for (uint64_t b = 0; b < count; b++) {
+        uint8_t* dst = image_block_zeroed(img, to + b);
+        const uint8_t* src = dst ? image_block(img, from + b) : NULL;
+        if (!src) return 0;
+        memcpy(dst, src, BS);
+    }
+    stats_phase(previous);
+    r->moved_runs++;
+    r->moved_blocks += count;
+    if (push_run(&r->pending, &r->n_pending, &r->pending_capacity, from, count) != 0) return 0;
+    return to;
+}
+
+static uint64_t alloc_past_zone(resize_t* r, uint64_t count) {
+    image_t* img = r->img;
+    img->data_bm.cursor = r->zone_end - img->sb.data_region_start;
+    uint64_t to = image_alloc_run(img, count);
+    if (!to) fprintf(stderr, "Error: No free run of %lu blocks to move data out of the way of the metadata\n", count);
+    return to;
+}
+
+// dir_relocate() callback: moves a directory block run out of the zone
+static uint64_t move_dir_run(void* arg, uint64_t block_no, uint64_t count) {
+    resize_t* r = arg;
+    if (block_no >= r->zone_end) return block_no;
+    uint64_t to = alloc_past_zone(r, count);
+    return to ? move_run(r, block_no, to, count) : 0;
+}
+
+// Moves a file with a data or extent block in the zone into one run past it
+static int move_file(resize_t* r, uint32_t inode_no, const inode_t* inode) {
+    uint64_t extent_block = (inode->flags & INODE_FL_EXTENTS) ? inode->xattr_ptr : 0;
+    bitmap_extent_t* runs;
+    int n_runs;
+    if (file_map(r->img, inode_no, &runs, &n_runs) != 0) return -1;
+    uint64_t blocks = 0;
+    int hit = extent_block && extent_block < r->zone_end;
+    for (int i = 0; i < n_runs; i++) {
+        blocks += runs[i].length;
+        if (runs[i].start < r->zone_end) hit = 1;
+    }
+
+    int rc = 0;
+    if (hit) {
+        uint64_t to = alloc_past_zone(r, blocks);
+        rc = to ? 0 : -1;
+        for (uint64_t done = 0, i = 0; rc == 0 && i < (uint64_t)n_runs; done += runs[i].length, i++) {
+            if (!move_run(r, runs[i].start, to + done, runs[i].length)) rc = -1;
+        }
+        if (rc == 0) rc = file_remap(r->img, inode_no, to, blocks, &extent_block);
+        if (rc == 0 && extent_block) rc = push_run(&r->pending, &r->n_pending, &r->pending_capacity, extent_block, 1);
+        // move_run() counted the blocks run by run; the file is one move
+        if (rc == 0) r->moved_runs -= (uint64_t)n_runs - 1;
+    }
+    free(runs);
+    return rc;
+}
+
+// Empties the first data blocks, which the grown metadata is about to take:
+// every directory block, file and extent block there moves past them, in one
+// in-place flush. The blocks still free there are held for the duration so
+// no move lands in them.
+static int clear_zone(resize_t* r) {
+    image_t* img = r->img;
+    bitmap_t* bm = &img->data_bm;
+    uint64_t zone_bits = r->zone_end - img->sb.data_region_start;
+    bitmap_extent_t* held = NULL;
+    size_t n_held = 0, held_capacity = 0;
+    int rc = 0;
+    for (uint64_t bit = bitmap_next_free(bm, 0); rc == 0 && bit < zone_bits; bit = bitmap_next_free(bm, bit)) {
+        uint64_t end = bitmap_next_used(bm, bit);
+        if (end > zone_bits) end = zone_bits;
+        bitmap_set_range(bm, bit, end - bit);
+        rc = push_run(&held, &n_held, &held_capacity, bit, end - bit);
+        bit = end;
+    }
+
+    for (uint64_t bit = bitmap_next_used(&img->inode_bm, 0); rc == 0 && bit < img->inode_bm.nbits;
+         bit = bitmap_next_used(&img->inode_bm, bit + 1)) {
+        uint32_t inode_no = (uint32_t)bit + 1;
+        inode_t* inode = image_inode_peek(img, inode_no);
+        if (!inode) {
+            rc = -1;
+        } else if ((inode->mode & 0170000) == MODE_DIR) {
+            rc = dir_relocate(img, inode_no, move_dir_run, r);
+        } else if ((inode->mode & 0170000) == MODE_FILE && !(inode->flags & INODE_FL_INLINE)) {
+            rc = move_file(r, inode_no, inode);
+        }
+        image_trim(img);
+    }
+
+    for (size_t i = 0; i < n_held; i++) bitmap_clear_range(bm, held[i].start, held[i].length);
+    free(held);
+    if (rc != 0) return -1;
+    for (size_t i = 0; i < r->n_pending; i++) image_free_run(img, r->pending[i].start, r->pending[i].length);
+    if (r->n_pending > 0) {
+        stats_phase(STATS_WRITEBACK);
+        if (image_write_super(img) != 0 || image_flush(img) != 0) return -1;
+    }
+    uint64_t used = bitmap_next_used(bm, 0);
+    if (used < zone_bits) {
+        fprintf(stderr, "Error: Block %lu is still in use after moving data out of the way\n",
+                img->sb.data_region_start + used);
+        return -1;
+    }
+    return 0;
+}
+
+// Moves to the bitmap and inode table sizes and inode count in `want`,
+// keeping total_blocks. When they grow, the first data blocks are emptied
+// and taken over and every later block keeps its number. The new metadata is
+// written as one journal transaction (on a --journal image) together with the
+// superblock, except for the blocks taken from the data region, which
+// nothing refers to by then and which go straight to their place first.
+static int switch_layout(const char* image_name, const superblock_t* want, resize_t* r) {
+    image_t img;
+    stats_phase(STATS_LOAD);
+    if (image_open(&img, image_name, image_name, 1) != 0) {
+        image_close(&img);
+        return -1;
+    }
+    image_set_cache_limit(&img, RESIZE_CACHE_BLOCKS);
+    superblock_t sb = img.sb;
+    superblock_t next = sb;
+    next.inode_count = want->inode_count;
+    next.inode_bitmap_blocks = want->inode_bitmap_blocks;
+    next.data_bitmap_blocks = want->data_bitmap_blocks;
+    next.inode_table_blocks = want->inode_table_blocks;
+    lay_out(&next, journal_blocks(&sb));
+    uint64_t zone = next.data_region_start - sb.data_region_start;
+
+    stats_phase(STATS_ALLOC);
+    r->img = &img;
+    r->zone_end = next.data_region_start;
+    int rc = zone > 0 ? clear_zone(r) : 0;
+
+    // Block 0, the bitmaps, then the inode table: every inode table block
+    // when the bitmaps grew and the table moved, else only the new ones and
+    // the one whose free slots become inodes
+    uint64_t per_block = BS / INODE_SIZE;
+    uint64_t table_shift = next.inode_table_start - sb.inode_table_start;
+    uint64_t max_blocks = 1 + next.inode_bitmap_blocks + next.data_bitmap_blocks +
+                          (table_shift ? next.inode_table_blocks : next.inode_table_blocks - sb.inode_table_blocks + 1);
+    uint8_t* data = rc == 0 ? calloc(max_blocks, BS) : NULL;
+    cached_block_t* blocks = rc == 0 ? calloc(max_blocks, sizeof(cached_block_t)) : NULL;
+    cached_block_t** logged = rc == 0 ? calloc(max_blocks, sizeof(cached_block_t*)) : NULL;
+    cached_block_t** taken = rc == 0 ? calloc(max_blocks, sizeof(cached_block_t*)) : NULL;
+    if (rc == 0 && (!data || !blocks || !logged || !taken)) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        rc = -1;
+    }
+    size_t n_blocks = 0;
+    if (rc == 0) {
+        for (uint64_t b = 0; b < 1 + next.inode_bitmap_blocks + next.data_bitmap_blocks; b++) {
+            blocks[n_blocks].block_no = b;
+            blocks[n_blocks].data = data + n_blocks * BS;
+            n_blocks++;
+        }
+        uint8_t* inode_bits = blocks[1].data;
+        uint8_t* data_bits = blocks[1 + next.inode_bitmap_blocks].data;
+
+        // Inode bits keep their place; data bits move down by the blocks taken
+        bitmap_t view;
+        memcpy(inode_bits, img.inode_bm.bits, sb.inode_bitmap_blocks * BS);
+        bitmap_init(&view, inode_bits, next.inode_bitmap_blocks * BS * 8);
+        bitmap_clear_range(&view, sb.inode_count, view.nbits - sb.inode_count);
+        bitmap_init(&view, data_bits, next.data_region_blocks);
+        for (uint64_t bit = bitmap_next_used(&img.data_bm, zone); bit < img.data_bm.nbits; ) {
+            uint64_t end = bitmap_next_free(&img.data_bm, bit);
+            bitmap_set_range(&view, bit - zone, end - bit);
+            bit = bitmap_next_used(&img.data_bm, end);
+        }
+
+        for (uint64_t i = 0; rc == 0 && i < next.inode_table_blocks; i++) {
+            int old = i < sb.inode_table_blocks;
+            int opens = next.inode_count > sb.inode_count && (i + 1) * per_block > sb.inode_count;
+            if (old && !table_shift && !opens) continue;
+            blocks[n_blocks].block_no = next.inode_table_start + i;
+            blocks[n_blocks].data = data + n_blocks * BS;
+            if (old) {
+                const uint8_t* table = image_block(&img, sb.inode_table_start + i);
+                if (!table) rc = -1;
+                else memcpy(blocks[n_blocks].data, table, BS);
+                for (uint64_t slot = 0; rc == 0 && slot < per_block; slot++) {
+                    if (i * per_block + slot >= sb.inode_count) memset(blocks[n_blocks].data + slot * INODE_SIZE, 0, INODE_SIZE);
+                }
+                image_trim(&img);
+            }
+            n_blocks++;
+        }
+
+        if (rc == 0) {
+            img.sb = next;
+            if (next.flags & SB_FLAG_SUMMARY) rc = regroup(&next, &img.summary, img.groups, inode_bits, data_bits);
+        }
+        const uint8_t* super = rc == 0 && image_write_super(&img) == 0 ? image_block(&img, 0) : NULL;
+        if (super) memcpy(blocks[0].data, super, BS);
+        else rc = -1;
+    }
+
+    // Blocks taken from the data region are free on disk by now
+    size_t n_logged = 0, n_taken = 0;
+    for (size_t i = 0; i < n_blocks; i++) {
+        if (blocks[i].block_no < sb.data_region_start) logged[n_logged++] = &blocks[i];
+        else taken[n_taken++] = &blocks[i];
+    }
+    stats_phase(STATS_WRITEBACK);
+    if (rc == 0) rc = image_write_blocks(&img, taken, n_taken);
+    if (rc == 0 && (sb.flags & SB_FLAG_JOURNAL)) {
+        rc = journal_commit(&img, logged, n_logged) == 0 && sync_image(img.out_fd) == 0 ? 0 : -1;
+    } else if (rc == 0) {
+        // Without a journal the superblock goes last, after everything it points at
+        rc = image_write_blocks(&img, logged + 1, n_logged - 1) == 0 && sync_image(img.out_fd) == 0 &&
+             image_write_blocks(&img, logged, 1) == 0 && sync_image(img.out_fd) == 0 ? 0 : -1;
+    }
+
+    free(data);
+    free(blocks);
+    free(logged);
+    free(taken);
+    free(r->pending);
+    r->pending = NULL;
+    r->n_pending = r->pending_capacity = 0;
+    r->img = NULL;
+    if (image_close(&img) != 0) rc = -1;
+    return rc;
+}
+
+int main(int argc, char* argv[]) {
+    stats_begin();
+    crc32_init();
+
+    char* image_name = NULL;
+    uint64_t size_kib = 0;
+    uint64_t inode_count = 0;
+
+    static struct option long_options[] = {
+        {"image", required_argument, 0, 'i'},
+        {"size-kib", required_argument, 0, 's'},
+        {"inodes", required_argument, 0, 'n'},
+        {"stats", optional_argument, 0, 'S'},
+        {0, 0, 0, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'i':
+                image_name = optarg;
+                break;
+            case 's':
+                size_kib = parse_count(optarg);
+                if (size_kib == 0 || size_kib % 4 != 0 || size_kib > MAX_SIZE_KIB) {
+                    fprintf(stderr, "Error: Invalid --size-kib value '%s' (multiple of 4, at most %llu)\n", optarg,
+                            MAX_SIZE_KIB);
+                    return 1;
+                }
+                break;
+            case 'n':
+                inode_count = parse_count(optarg);
+                if (inode_count == 0 || inode_count > MAX_INODES) {
+                    fprintf(stderr, "Error: Invalid --inodes value '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'S': {
+                int mode = stats_parse_mode(optarg);
+                if (mode < 0) return 1;
+                stats_enable(mode);
+                break;
+            }
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (!image_name || (size_kib == 0 && inode_count == 0)) {
+        fprintf(stderr, "Error: --image and at least one of --size-kib and --inodes are required\n");
+        print_usage("mkfs_resize");
+        return 1;
+    }
+
+    image_t img;
+    stats_phase(STATS_LOAD);
+    if (image_open(&img, image_name, image_name, 1) != 0) {
+        image_close(&img);
+        return 1;
+    }
+    superblock_t sb = img.sb;
+    uint64_t used_blocks = sb.data_region_blocks - image_free_blocks(&img);
+    image_close(&img);
+    if (sb.flags & SB_FLAG_DEDUP) {
+        fprintf(stderr, "Error: Cannot resize an image built with --dedup (its tables are sized by the data region)\n");
+        return 1;
+    }
+
+    superblock_t want = sb;
+    want.total_blocks = size_kib ? size_kib * 1024 / BS : sb.total_blocks;
+    want.inode_count = inode_count ? inode_count : sb.inode_count;
+    if (want.total_blocks < sb.total_blocks) {
+        fprintf(stderr, "Error: Image has %lu KiB already; it can only grow (mkfs_defrag --truncate shrinks it)\n",
+                sb.total_blocks * (BS / 1024));
+        return 1;
+    }
+    if (want.inode_count < sb.inode_count) {
+        fprintf(stderr, "Error: Image has %lu inodes already; the count can only grow\n", sb.inode_count);
+        return 1;
+    }
+    if (want.total_blocks == sb.total_blocks && want.inode_count == sb.inode_count) {
+        printf("Filesystem image '%s' already has %lu blocks and %lu inodes\n", image_name, sb.total_blocks,
+               sb.inode_count);
+        return 0;
+    }
+
+    // The bitmaps and inode table only ever grow, sized as mkfs_builder sizes them
+    uint64_t journal = journal_blocks(&sb);
+    uint64_t wanted;
+    wanted = bitmap_blocks_for(want.inode_count);
+    if (wanted > want.inode_bitmap_blocks) want.inode_bitmap_blocks = wanted;
+    wanted = bitmap_blocks_for(want.total_blocks);
+    if (wanted > want.data_bitmap_blocks) want.data_bitmap_blocks = wanted;
+    wanted = (want.inode_count * INODE_SIZE + BS - 1) / BS;
+    if (wanted > want.inode_table_blocks) want.inode_table_blocks = wanted;
+    uint64_t metadata_blocks = 1 + want.inode_bitmap_blocks + want.data_bitmap_blocks + want.inode_table_blocks;
+    if (metadata_blocks + journal >= want.total_blocks) {
+        fprintf(stderr, "Error: Not enough space for metadata with given parameters\n");
+        return 1;
+    }
+    lay_out(&want, journal);
+    if (used_blocks > want.data_region_blocks) {
+        fprintf(stderr, "Error: %lu data blocks are in use but the new data region holds %lu\n", used_blocks,
+                want.data_region_blocks);
+        return 1;
+    }
+
+    // Growing metadata first lets the data region grow as far as the current
+    // data bitmap reaches, so what has to move out of its way finds room
+    resize_t r = {0};
+    int status = 0;
+    uint64_t total = sb.total_blocks;
+    if (want.data_region_start != sb.data_region_start || want.inode_count != sb.inode_count) {
+        uint64_t reach = sb.data_region_start + sb.data_bitmap_blocks * BS * 8 + journal;
+        uint64_t step = want.total_blocks < reach ? want.total_blocks : reach;
+        if (step > total) {
+            status = grow_region(image_name, step) == 0 ? 0 : 1;
+            total = step;
+        }
+        superblock_t at = want;
+        at.total_blocks = total;
+        lay_out(&at, journal);
+        if (status == 0 && switch_layout(image_name, &at, &r) != 0) status = 1;
+    }
+    if (status == 0 && want.total_blocks > total && grow_region(image_name, want.total_blocks) != 0) status = 1;
+
+    if (status == 0) {
+        printf("Resized filesystem image '%s' to %lu blocks and %lu inodes (was %lu and %lu)\n", image_name,
+               want.total_blocks, want.inode_count, sb.total_blocks, sb.inode_count);
+        printf("Data region: %lu blocks from block %lu (was %lu from block %lu)\n", want.data_region_blocks,
+               want.data_region_start, sb.data_region_blocks, sb.data_region_start);
+        if (r.moved_runs) {
+            printf("Moved %lu runs (%lu blocks) out of the way of the metadata\n", r.moved_runs, r.moved_blocks);
+        }
+    }
+
+    stats_report("mkfs_resize");
+    return status;
+}
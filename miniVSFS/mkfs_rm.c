@@ -0,0 +1,151 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <getopt.h>
+#include "crc32.h"
+#include "vsfs_format.h"
+#include "vsfs_image.h"
+#include "vsfs_dir.h"
+#include "vsfs_file.h"
+#include "vsfs_stats.h"
+
+void print_usage(const char* program_name) {
+    printf("Usage: %s --image <image.img> --file <path> [--file <path> ...] [--keep-blocks] [--stats[=json]]\n", program_name);
+    printf("  --image: Image to remove files from, updated in place\n");
+    printf("  --file: Path of a file inside the image to remove (may be repeated)\n");
+    printf("  --keep-blocks: Leave the freed data blocks allocated in the host file instead of punching holes\n");
+    printf("  --stats[=json]: Print per-phase times and I/O, allocation and checksum counters to stderr\n");
+}
+
+// Removes one file: its directory entry, its inode and the data blocks no
+// other file shares. Changes stay in the block cache until the batch is
+// flushed.
+int remove_file(image_t* img, dcache_t* dcache, const char* path) {
+    uint32_t parent_ino;
+    const char* leaf_name;
+    if (dir_resolve_parent(img, dcache, path, 0, &parent_ino, &leaf_name) != 0) return -1;
+    int64_t inode_no = dir_lookup(img, parent_ino, leaf_name);
+    if (inode_no < 0) return -1;
+    if (inode_no == 0) {
+        fprintf(stderr, "Error: File '%s' not found in filesystem\n", path);
+        return -1;
+    }
+    inode_t* inode = image_inode_peek(img, (uint64_t)inode_no);
+    if (!inode) return -1;
+    if ((inode->mode & 0170000) != MODE_FILE) {
+        fprintf(stderr, "Error: '%s' is not a regular file\n", path);
+        return -1;
+    }
+
+    if (dir_remove(img, parent_ino, leaf_name) <= 0) return -1;
+    if (file_release(img, (uint32_t)inode_no) != 0) return -1;
+
+    // Undo the link mkfs_adder counts for each file in a directory
+    inode_t* parent = image_inode(img, parent_ino);
+    if (!parent) return -1;
+    if (parent->links > 2) parent->links--;
+    parent->ctime = time(NULL);
+    inode_crc_finalize(parent);
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    stats_begin();
+    crc32_init();
+
+    char* image_name = NULL;
+    char** paths = NULL;
+    size_t n_paths = 0;
+    int keep_blocks = 0;
+
+    static struct option long_options[] = {
+        {"image", required_argument, 0, 'i'},
+        {"file", required_argument, 0, 'f'},
+        {"keep-blocks", no_argument, 0, 'k'},
+        {"stats", optional_argument, 0, 'S'},
+        {0, 0, 0, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'i':
+                image_name = optarg;
+                break;
+            case 'f': {
+                char** grown = realloc(paths, (n_paths + 1) * sizeof(char*));
+                if (!grown) {
+                    fprintf(stderr, "Error: Memory allocation failed\n");
+                    free(paths);
+                    return 1;
+                }
+                paths = grown;
+                paths[n_paths++] = optarg;
+                break;
+            }
+            case 'k':
+                keep_blocks = 1;
+                break;
+            case 'S': {
+                int mode = stats_parse_mode(optarg);
+                if (mode < 0) return 1;
+                stats_enable(mode);
+                break;
+            }
+            default:
+                print_usage(argv[0]);
+                free(paths);
+                return 1;
+        }
+    }
+
+    if (!image_name || n_paths == 0) {
+        fprintf(stderr, "Error: All arguments are required\n");
+        print_usage("mkfs_rm");
+        free(paths);
+        return 1;
+    }
+
+    image_t img;
+    dcache_t dcache;
+    dcache_init(&dcache);
+    stats_phase(STATS_LOAD);
+    int status = image_open(&img, image_name, image_name, 1) == 0 ? 0 : 1;
+    img.punch_freed = !keep_blocks;
+    uint64_t free_before = status == 0 ? image_free_blocks(&img) : 0;
+
+    // Any failure aborts the whole batch before any block is written back
+    stats_phase(STATS_ALLOC);
+    for (size_t i = 0; status == 0 && i < n_paths; i++) {
+        if (remove_file(&img, &dcache, paths[i]) != 0) status = 1;
+    }
+    uint64_t freed = status == 0 ? image_free_blocks(&img) - free_before : 0;
+
+    stats_phase(STATS_WRITEBACK);
+    if (status == 0) {
+        if (image_write_super(&img) != 0 || image_flush(&img) != 0) status = 1;
+    }
+    uint64_t punched = img.punched;
+
+    dcache_free(&dcache);
+    if (image_close(&img) != 0 && status == 0) {
+        fprintf(stderr, "Error: Cannot write image: %s\n", strerror(errno));
+        status = 1;
+    }
+
+    if (status == 0) {
+        for (size_t i = 0; i < n_paths; i++) {
+            printf("Removed file '%s' from filesystem image '%s'\n", paths[i], image_name);
+        }
+        printf("Freed %lu data blocks (%lu punched out of the image file)\n", freed, punched);
+    }
+
+    stats_report("mkfs_rm");
+    free(paths);
+    return status;
+}
@@ -0,0 +1,619 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include "vsfs_format.h"
+#include "libminivsfs.h"
+
+// End-to-end benchmark of the MiniVSFS tools. A synthetic tree of files is
+// generated from a seed and a size distribution, then the built binaries are
+// timed on it: formatting, batch and one-file-per-process adds, extraction
+// and fsck verification, plus path lookups through libminivsfs in-process.
+// Each benchmark reports throughput, latency percentiles, CPU time and the
+// peak RSS of the measured process, as a table or as JSON for tracking
+// regressions between commits. Every tool run must exit 0, so the benchmark
+// also fails loudly when a change breaks one.
+
+#define FILES_PER_DIR 100
+#define WRITE_BUFFER (1u << 20)
+#define LOOKUP_CACHE_BLOCKS 4096
+
+typedef struct {
+    const char* name;
+    int min_bits;           // sizes are drawn from [2^min_bits, 2^max_bits)
+    int max_bits;           // with every power of two equally likely
+} distribution_t;
+
+static const distribution_t DISTRIBUTIONS[] = {
+    { "small", 4, 13 },     // 16 B - 8 KiB: inline files and single blocks
+    { "mixed", 4, 22 },     // 16 B - 4 MiB
+    { "large", 18, 24 },    // 256 KiB - 16 MiB
+};
+#define DISTRIBUTION_COUNT (sizeof(DISTRIBUTIONS) / sizeof(DISTRIBUTIONS[0]))
+
+typedef struct {
+    char path[64];          // relative to the source directory and the image root
+    uint64_t size;
+} bench_file_t;
+
+typedef struct {
+    const char* name;
+    double* samples;        // seconds per operation
+    size_t count;
+    size_t capacity;
+    uint64_t bytes;         // payload moved by all operations
+    double seconds;         // wall time of all operations
+    double cpu_seconds;     // user + system time of the measured processes
+    long peak_rss_kib;
+} result_t;
+
+typedef struct {
+    char bin_dir[PATH_MAX];
+    char work_dir[PATH_MAX];
+    char src_dir[PATH_MAX];
+    const distribution_t* dist;
+    bench_file_t* files;
+    size_t file_count;
+    size_t dir_count;
+    uint64_t total_bytes;
+    uint64_t size_kib;
+    uint64_t inodes;
+    unsigned repeat;
+    size_t single_adds;
+    uint64_t seed;
+} bench_t;
+
+void print_usage(const char* program_name) {
+    printf("Usage: %s [--bin-dir <dir>] [--work-dir <dir>] [--files <n>] [--sizes small|mixed|large] [--size-kib <n>] [--repeat <n>] [--single-adds <n>] [--seed <n>] [--json] [--keep]\n",
+           program_name);
+    printf("  --bin-dir: Directory holding mkfs_builder, mkfs_adder, mkfs_fsck and vsfs_extract (default: .)\n");
+    printf("  --work-dir: Directory to create the benchmark's own directory in (default: /tmp)\n");
+    printf("  --files: Number of files to generate (default: 2000)\n");
+    printf("  --sizes: File size distribution (default: mixed)\n");
+    printf("           small: 16 B - 8 KiB, mixed: 16 B - 4 MiB, large: 256 KiB - 16 MiB\n");
+    printf("  --size-kib: Image size (default: fitted to the generated files)\n");
+    printf("  --repeat: Runs of each benchmark (default: 5)\n");
+    printf("  --single-adds: Files added one mkfs_adder process at a time (default: 100)\n");
+    printf("  --seed: Seed for file sizes and contents (default: 1)\n");
+    printf("  --json: Print results as one JSON object instead of a table\n");
+    printf("  --keep: Keep the generated files and images\n");
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t next_random(uint64_t* state) {
+    uint64_t x = *state;
+    x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+    return *state = x;
+}
+
+static int record(result_t* r, double seconds) {
+    if (r->count == r->capacity) {
+        size_t capacity = r->capacity ? r->capacity * 2 : 64;
+        double* grown = realloc(r->samples, capacity * sizeof(double));
+        if (!grown) {
+            fprintf(stderr, "Error: Memory allocation failed\n");
+            return -1;
+        }
+        r->samples = grown;
+        r->capacity = capacity;
+    }
+    r->samples[r->count++] = seconds;
+    r->seconds += seconds;
+    return 0;
+}
+
+// Joins dir and name into a PATH_MAX buffer, failing rather than
+// truncating a path that does not fit
+static int join_path(char* out, const char* dir, const char* name) {
+    int n = snprintf(out, PATH_MAX, "%s/%s", dir, name);
+    if (n < 0 || n >= PATH_MAX) {
+        fprintf(stderr, "Error: Path %s/%s is too long\n", dir, name);
+        return -1;
+    }
+    return 0;
+}
+
+// Runs a tool from the bin directory with cwd set to the source directory,
+// adding its wall time, CPU time and peak RSS to r (when r is not NULL)
+static int run_tool(bench_t* b, result_t* r, char* const args[]) {
+    char program[PATH_MAX];
+    if (join_path(program, b->bin_dir, args[0]) != 0) return -1;
+
+    double start = now_seconds();
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("Error: fork");
+        return -1;
+    }
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd >= 0) dup2(null_fd, STDOUT_FILENO);
+        if (chdir(b->src_dir) != 0) _exit(127);
+        execv(program, args);
+        fprintf(stderr, "Error: Cannot run %s: %s\n", program, strerror(errno));
+        _exit(127);
+    }
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) < 0) {
+        perror("Error: wait4");
+        return -1;
+    }
+    double elapsed = now_seconds() - start;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "Error: %s %s failed (status %d)\n", args[0], args[1] ? args[1] : "", status);
+        return -1;
+    }
+    if (!r) return 0;
+    r->cpu_seconds += usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+                      usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+    if (usage.ru_maxrss > r->peak_rss_kib) r->peak_rss_kib = usage.ru_maxrss;
+    return record(r, elapsed);
+}
+
+static int remove_entry(const char* path, const struct stat* st, int type, struct FTW* ftw) {
+    (void)st; (void)type; (void)ftw;
+    return remove(path);
+}
+
+static int remove_tree(const char* path) {
+    if (access(path, F_OK) != 0) return 0;
+    if (nftw(path, remove_entry, 16, FTW_DEPTH | FTW_PHYS) != 0) {
+        fprintf(stderr, "Error: Cannot remove %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int work_path(const bench_t* b, const char* name, char* out) {
+    return join_path(out, b->work_dir, name);
+}
+
+// Draws the file sizes and writes the files under src/dNNN/. Contents are
+// pseudo-random so no two blocks are alike.
+static int generate_files(bench_t* b, size_t count) {
+    b->files = calloc(count, sizeof(bench_file_t));
+    uint8_t* buffer = malloc(WRITE_BUFFER);
+    if (!b->files || !buffer) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        free(buffer);
+        return -1;
+    }
+    b->file_count = count;
+    b->dir_count = (count + FILES_PER_DIR - 1) / FILES_PER_DIR;
+    if (mkdir(b->src_dir, 0755) != 0) {
+        fprintf(stderr, "Error: Cannot create %s: %s\n", b->src_dir, strerror(errno));
+        free(buffer);
+        return -1;
+    }
+
+    uint64_t state = b->seed * 0x9E3779B97F4A7C15ull | 1;
+    for (size_t i = 0; i < count; i++) {
+        bench_file_t* f = &b->files[i];
+        int bits = b->dist->min_bits + (int)(next_random(&state) % (uint64_t)(b->dist->max_bits - b->dist->min_bits));
+        f->size = (1ull << bits) + next_random(&state) % (1ull << bits);
+        b->total_bytes += f->size;
+
+        char dir[PATH_MAX];
+        snprintf(f->path, sizeof(f->path), "d%03zu", i / FILES_PER_DIR);
+        if (join_path(dir, b->src_dir, f->path) != 0) {
+            free(buffer);
+            return -1;
+        }
+        if (i % FILES_PER_DIR == 0 && mkdir(dir, 0755) != 0) {
+            fprintf(stderr, "Error: Cannot create %s: %s\n", dir, strerror(errno));
+            free(buffer);
+            return -1;
+        }
+        snprintf(f->path + strlen(f->path), sizeof(f->path) - strlen(f->path), "/f%05zu.bin", i);
+
+        char host_path[PATH_MAX];
+        if (join_path(host_path, b->src_dir, f->path) != 0) {
+            free(buffer);
+            return -1;
+        }
+        int fd = open(host_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            fprintf(stderr, "Error: Cannot create %s: %s\n", host_path, strerror(errno));
+            free(buffer);
+            return -1;
+        }
+        for (uint64_t done = 0; done < f->size;) {
+            size_t n = f->size - done < WRITE_BUFFER ? (size_t)(f->size - done) : WRITE_BUFFER;
+            for (size_t k = 0; k < n; k += 8) {
+                uint64_t v = next_random(&state);
+                memcpy(buffer + k, &v, n - k < 8 ? n - k : 8);
+            }
+            if (write(fd, buffer, n) != (ssize_t)n) {
+                fprintf(stderr, "Error: Cannot write %s: %s\n", host_path, strerror(errno));
+                close(fd);
+                free(buffer);
+                return -1;
+            }
+            done += n;
+        }
+        close(fd);
+    }
+    free(buffer);
+
+    char manifest_path[PATH_MAX];
+    if (work_path(b, "manifest.txt", manifest_path) != 0) return -1;
+    FILE* manifest = fopen(manifest_path, "w");
+    if (!manifest) {
+        fprintf(stderr, "Error: Cannot create %s: %s\n", manifest_path, strerror(errno));
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++) fprintf(manifest, "%s\n", b->files[i].path);
+    if (fclose(manifest) != 0) {
+        fprintf(stderr, "Error: Cannot write %s\n", manifest_path);
+        return -1;
+    }
+    return 0;
+}
+
+// Picks an image size with room for the data plus a quarter for extent,
+// directory and index blocks, so the adds never run out of space
+static void fit_image(bench_t* b) {
+    uint64_t blocks = 0;
+    for (size_t i = 0; i < b->file_count; i++) blocks += (b->files[i].size + BS - 1) / BS;
+    b->inodes = b->file_count + b->dir_count + 64;
+    if (b->inodes < 128) b->inodes = 128;
+    if (b->size_kib) return;
+    uint64_t total = blocks + blocks / 4 + b->dir_count * 8 + b->inodes / (BS / INODE_SIZE) + 256;
+    b->size_kib = total * (BS / 1024);
+    if (b->size_kib < 1024) b->size_kib = 1024;
+}
+
+// Formats path untimed, for benchmarks that need an empty image
+static int format_image(bench_t* b, const char* path) {
+    char size_arg[32], inodes_arg[32];
+    snprintf(size_arg, sizeof(size_arg), "%lu", b->size_kib);
+    snprintf(inodes_arg, sizeof(inodes_arg), "%lu", b->inodes);
+    char* args[] = { "mkfs_builder", "--image", (char*)path, "--size-kib", size_arg, "--inodes", inodes_arg,
+                     "--fast", NULL };
+    return run_tool(b, NULL, args);
+}
+
+static int bench_format(bench_t* b, result_t* r, int fast) {
+    char image[PATH_MAX], size_arg[32], inodes_arg[32];
+    if (work_path(b, "format.img", image) != 0) return -1;
+    snprintf(size_arg, sizeof(size_arg), "%lu", b->size_kib);
+    snprintf(inodes_arg, sizeof(inodes_arg), "%lu", b->inodes);
+    char* args[] = { "mkfs_builder", "--image", image, "--size-kib", size_arg, "--inodes", inodes_arg,
+                     fast ? "--fast" : NULL, NULL };
+    for (unsigned i = 0; i < b->repeat; i++) {
+        if (run_tool(b, r, args) != 0) return -1;
+        r->bytes += b->size_kib * 1024;
+    }
+    return unlink(image) == 0 ? 0 : -1;
+}
+
+static int bench_add_batch(bench_t* b, result_t* r) {
+    char image[PATH_MAX], manifest[PATH_MAX];
+    if (work_path(b, "batch.img", image) != 0 || work_path(b, "manifest.txt", manifest) != 0) return -1;
+    char* args[] = { "mkfs_adder", "--input", image, "--in-place", "--mkdir-p", "--manifest", manifest, NULL };
+    // The image of the last run is kept for the lookup, extract and verify runs
+    for (unsigned i = 0; i < b->repeat; i++) {
+        if (format_image(b, image) != 0 || run_tool(b, r, args) != 0) return -1;
+        r->bytes += b->total_bytes;
+    }
+    return 0;
+}
+
+static int bench_add_single(bench_t* b, result_t* r) {
+    char image[PATH_MAX];
+    if (work_path(b, "single.img", image) != 0) return -1;
+    if (format_image(b, image) != 0) return -1;
+    size_t count = b->single_adds < b->file_count ? b->single_adds : b->file_count;
+    for (size_t i = 0; i < count; i++) {
+        char* args[] = { "mkfs_adder", "--input", image, "--in-place", "--mkdir-p", "--file", b->files[i].path,
+                         NULL };
+        if (run_tool(b, r, args) != 0) return -1;
+        r->bytes += b->files[i].size;
+    }
+    return unlink(image) == 0 ? 0 : -1;
+}
+
+// Resolves every path in a shuffled order, with a fresh handle (and so a
+// cold block cache) for each pass
+static int bench_lookup(bench_t* b, result_t* r) {
+    char image[PATH_MAX];
+    if (work_path(b, "batch.img", image) != 0) return -1;
+    size_t* order = malloc(b->file_count * sizeof(size_t));
+    if (!order) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return -1;
+    }
+    uint64_t state = b->seed * 0xD1B54A32D192ED03ull | 1;
+    for (size_t i = 0; i < b->file_count; i++) order[i] = i;
+
+    struct rusage before;
+    getrusage(RUSAGE_SELF, &before);
+    int rc = 0;
+    for (unsigned pass = 0; pass < b->repeat && rc == 0; pass++) {
+        for (size_t i = b->file_count; i > 1; i--) {
+            size_t j = next_random(&state) % i;
+            size_t t = order[i - 1]; order[i - 1] = order[j]; order[j] = t;
+        }
+        vsfs_t* fs = vsfs_open(image, VSFS_RDONLY, LOOKUP_CACHE_BLOCKS);
+        if (!fs) {
+            fprintf(stderr, "Error: Cannot open %s: %s\n", image, strerror(errno));
+            rc = -1;
+            break;
+        }
+        for (size_t i = 0; i < b->file_count; i++) {
+            double start = now_seconds();
+            int64_t ino = vsfs_lookup(fs, b->files[order[i]].path);
+            double elapsed = now_seconds() - start;
+            if (ino < 0) {
+                fprintf(stderr, "Error: Lookup of %s failed: %s\n", b->files[order[i]].path, strerror(errno));
+                rc = -1;
+                break;
+            }
+            if (record(r, elapsed) != 0) {
+                rc = -1;
+                break;
+            }
+        }
+        vsfs_close(fs);
+    }
+    free(order);
+
+    struct rusage after;
+    getrusage(RUSAGE_SELF, &after);
+    r->cpu_seconds = (after.ru_utime.tv_sec - before.ru_utime.tv_sec) + (after.ru_stime.tv_sec - before.ru_stime.tv_sec) +
+                     (after.ru_utime.tv_usec - before.ru_utime.tv_usec + after.ru_stime.tv_usec - before.ru_stime.tv_usec) / 1e6;
+    r->peak_rss_kib = after.ru_maxrss;
+    return rc;
+}
+
+static int bench_extract(bench_t* b, result_t* r) {
+    char image[PATH_MAX], target[PATH_MAX];
+    if (work_path(b, "batch.img", image) != 0 || work_path(b, "extract", target) != 0) return -1;
+    char* args[] = { "vsfs_extract", "--image", image, "--all", target, NULL };
+    for (unsigned i = 0; i < b->repeat; i++) {
+        if (remove_tree(target) != 0 || run_tool(b, r, args) != 0) return -1;
+        r->bytes += b->total_bytes;
+    }
+    return remove_tree(target);
+}
+
+static int bench_verify(bench_t* b, result_t* r) {
+    char image[PATH_MAX];
+    if (work_path(b, "batch.img", image) != 0) return -1;
+    char* args[] = { "mkfs_fsck", "--image", image, NULL };
+    for (unsigned i = 0; i < b->repeat; i++) {
+        if (run_tool(b, r, args) != 0) return -1;
+        r->bytes += b->size_kib * 1024;
+    }
+    return 0;
+}
+
+static int compare_double(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of the sorted samples, in microseconds
+static double percentile_us(const result_t* r, double p) {
+    if (r->count == 0) return 0;
+    size_t rank = (size_t)(p / 100.0 * (double)r->count + 0.999999);
+    if (rank < 1) rank = 1;
+    if (rank > r->count) rank = r->count;
+    return r->samples[rank - 1] * 1e6;
+}
+
+static void print_results(const bench_t* b, result_t* results, size_t count, int json) {
+    for (size_t i = 0; i < count; i++) qsort(results[i].samples, results[i].count, sizeof(double), compare_double);
+
+    if (!json) {
+        printf("%lu files (%s, %.1f MiB) in %zu directories, %lu KiB image, %lu inodes, %u runs\n",
+               (unsigned long)b->file_count, b->dist->name, b->total_bytes / 1048576.0, b->dir_count, b->size_kib,
+               b->inodes, b->repeat);
+        printf("%-12s %8s %10s %10s %11s %11s %11s %11s %9s %10s\n", "benchmark", "ops", "MiB/s", "ops/s",
+               "p50 us", "p90 us", "p99 us", "max us", "cpu s", "rss KiB");
+        for (size_t i = 0; i < count; i++) {
+            const result_t* r = &results[i];
+            double seconds = r->seconds > 0 ? r->seconds : 1e-9;
+            printf("%-12s %8zu %10.1f %10.1f %11.1f %11.1f %11.1f %11.1f %9.3f %10ld\n", r->name, r->count,
+                   r->bytes / 1048576.0 / seconds, r->count / seconds, percentile_us(r, 50), percentile_us(r, 90),
+                   percentile_us(r, 99), percentile_us(r, 100), r->cpu_seconds, r->peak_rss_kib);
+        }
+        return;
+    }
+
+    printf("{\"config\":{\"files\":%zu,\"directories\":%zu,\"sizes\":\"%s\",\"file_bytes\":%lu,\"size_kib\":%lu,"
+           "\"inodes\":%lu,\"repeat\":%u,\"single_adds\":%zu,\"seed\":%lu},\"results\":[",
+           b->file_count, b->dir_count, b->dist->name, b->total_bytes, b->size_kib, b->inodes, b->repeat,
+           b->single_adds, b->seed);
+    for (size_t i = 0; i < count; i++) {
+        const result_t* r = &results[i];
+        double seconds = r->seconds > 0 ? r->seconds : 1e-9;
+        printf("%s{\"name\":\"%s\",\"ops\":%zu,\"bytes\":%lu,\"seconds\":%.6f,\"mib_per_s\":%.3f,\"ops_per_s\":%.3f,"
+               "\"latency_us\":{\"min\":%.3f,\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f,\"max\":%.3f,\"mean\":%.3f},"
+               "\"cpu_seconds\":%.6f,\"peak_rss_kib\":%ld}",
+               i ? "," : "", r->name, r->count, r->bytes, r->seconds, r->bytes / 1048576.0 / seconds,
+               r->count / seconds, r->count ? r->samples[0] * 1e6 : 0, percentile_us(r, 50), percentile_us(r, 90),
+               percentile_us(r, 99), percentile_us(r, 100), r->count ? r->seconds / r->count * 1e6 : 0,
+               r->cpu_seconds, r->peak_rss_kib);
+    }
+    printf("]}\n");
+}
+
+static int parse_count(const char* option, const char* value, uint64_t min, uint64_t max, uint64_t* out) {
+    char* end;
+    errno = 0;
+    unsigned long long n = strtoull(value, &end, 10);
+    if (errno != 0 || *end != '\0' || value[0] == '-' || n < min || n > max) {
+        fprintf(stderr, "Error: Invalid --%s value '%s'\n", option, value);
+        return -1;
+    }
+    *out = n;
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    bench_t b;
+    memset(&b, 0, sizeof(b));
+    const char* bin_dir = ".";
+    const char* work_dir = NULL;
+    uint64_t file_count = 2000;
+    uint64_t repeat = 5;
+    uint64_t single_adds = 100;
+    uint64_t seed = 1;
+    int json = 0;
+    int keep = 0;
+    b.dist = &DISTRIBUTIONS[1];
+
+    static struct option long_options[] = {
+        {"bin-dir", required_argument, 0, 'b'},
+        {"work-dir", required_argument, 0, 'w'},
+        {"files", required_argument, 0, 'f'},
+        {"sizes", required_argument, 0, 'z'},
+        {"size-kib", required_argument, 0, 's'},
+        {"repeat", required_argument, 0, 'r'},
+        {"single-adds", required_argument, 0, 'a'},
+        {"seed", required_argument, 0, 'S'},
+        {"json", no_argument, 0, 'J'},
+        {"keep", no_argument, 0, 'k'},
+        {0, 0, 0, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        int rc = 0;
+        switch (opt) {
+            case 'b':
+                bin_dir = optarg;
+                break;
+            case 'w':
+                work_dir = optarg;
+                break;
+            case 'f':
+                rc = parse_count("files", optarg, 1, 1000000, &file_count);
+                break;
+            case 'z': {
+                b.dist = NULL;
+                for (size_t i = 0; i < DISTRIBUTION_COUNT; i++) {
+                    if (strcmp(optarg, DISTRIBUTIONS[i].name) == 0) b.dist = &DISTRIBUTIONS[i];
+                }
+                if (!b.dist) {
+                    fprintf(stderr, "Error: Invalid --sizes value '%s' (use small, mixed or large)\n", optarg);
+                    rc = -1;
+                }
+                break;
+            }
+            case 's':
+                rc = parse_count("size-kib", optarg, 180, (1ull << 32) * (BS / 1024), &b.size_kib);
+                if (rc == 0 && b.size_kib % 4 != 0) {
+                    fprintf(stderr, "Error: --size-kib must be a multiple of 4\n");
+                    rc = -1;
+                }
+                break;
+            case 'r':
+                rc = parse_count("repeat", optarg, 1, 1000, &repeat);
+                break;
+            case 'a':
+                rc = parse_count("single-adds", optarg, 0, 1000000, &single_adds);
+                break;
+            case 'S':
+                rc = parse_count("seed", optarg, 0, UINT64_MAX, &seed);
+                break;
+            case 'J':
+                json = 1;
+                break;
+            case 'k':
+                keep = 1;
+                break;
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+        if (rc != 0) return 1;
+    }
+    if (optind < argc) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    if (!realpath(bin_dir, b.bin_dir)) {
+        fprintf(stderr, "Error: Cannot resolve --bin-dir %s: %s\n", bin_dir, strerror(errno));
+        return 1;
+    }
+    // Everything goes into a directory of the benchmark's own, so nothing
+    // already in --work-dir is overwritten or removed
+    char parent[PATH_MAX] = "/tmp";
+    if (work_dir) {
+        if (mkdir(work_dir, 0755) != 0 && errno != EEXIST) {
+            fprintf(stderr, "Error: Cannot create %s: %s\n", work_dir, strerror(errno));
+            return 1;
+        }
+        if (!realpath(work_dir, parent)) {
+            fprintf(stderr, "Error: Cannot resolve --work-dir %s: %s\n", work_dir, strerror(errno));
+            return 1;
+        }
+    }
+    if (join_path(b.work_dir, parent, "vsfs_bench.XXXXXX") != 0) return 1;
+    if (!mkdtemp(b.work_dir)) {
+        fprintf(stderr, "Error: Cannot create a work directory in %s: %s\n", parent, strerror(errno));
+        return 1;
+    }
+    if (work_path(&b, "src", b.src_dir) != 0) {
+        remove_tree(b.work_dir);
+        return 1;
+    }
+    b.repeat = (unsigned)repeat;
+    b.single_adds = (size_t)single_adds;
+    b.seed = seed;
+
+    result_t results[] = {
+        { .name = "format" },
+        { .name = "format_fast" },
+        { .name = "add_batch" },
+        { .name = "add_single" },
+        { .name = "lookup" },
+        { .name = "extract" },
+        { .name = "verify" },
+    };
+    size_t result_count = sizeof(results) / sizeof(results[0]);
+
+    int status = generate_files(&b, (size_t)file_count) == 0 ? 0 : 1;
+    if (status == 0) {
+        fit_image(&b);
+        if (bench_format(&b, &results[0], 0) != 0 || bench_format(&b, &results[1], 1) != 0 ||
+            bench_add_batch(&b, &results[2]) != 0 || bench_add_single(&b, &results[3]) != 0 ||
+            bench_lookup(&b, &results[4]) != 0 || bench_extract(&b, &results[5]) != 0 ||
+            bench_verify(&b, &results[6]) != 0) {
+            status = 1;
+        }
+    }
+    if (status == 0) print_results(&b, results, result_count, json);
+
+    if (keep) {
+        fprintf(stderr, "Kept the generated files and images in %s\n", b.work_dir);
+    } else if (remove_tree(b.work_dir) != 0) {
+        status = 1;
+    }
+    for (size_t i = 0; i < result_count; i++) free(results[i].samples);
+    free(b.files);
+    return status;
+}
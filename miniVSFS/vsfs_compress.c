@@ -0,0 +1,176 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lz4.h"
+#include "vsfs_compress.h"
+#include "vsfs_format.h"
+
+static inline void store_le64(uint8_t* p, uint64_t v) {
+    for (int i = 0; i < 8; i++) p[i] = (uint8_t)(v >> (8 * i));
+}
+
+static inline uint64_t load_le64(const uint8_t* p) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++) v |= (uint64_t)p[i] << (8 * i);
+    return v;
+}
+
+int compress_stream(uint64_t size, compress_fill_fn fill, void* ctx, uint8_t** stream_out, uint64_t* stream_len_out) {
+    uint64_t chunks = (size + COMPRESS_CHUNK - 1) / COMPRESS_CHUNK;
+    uint64_t raw_blocks = (size + BS - 1) / BS;
+    uint64_t data_start = sizeof(compress_header_t) + (chunks + 1) * sizeof(uint64_t);
+    // Past this the stream saves nothing, so give up as soon as it is reached
+    uint64_t limit = (raw_blocks > 0 ? raw_blocks - 1 : 0) * BS;
+    if (data_start >= limit) return 1;
+
+    uint8_t* chunk = malloc(COMPRESS_CHUNK);
+    // Start at a quarter of the raw size and grow; a compressible file never
+    // needs the full size, and an incompressible one is dropped early
+    uint64_t cap = data_start + COMPRESS_CHUNK + size / 4;
+    if (cap > limit) cap = limit;
+    uint8_t* stream = malloc(cap);
+    if (!chunk || !stream) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        free(chunk);
+        free(stream);
+        return -1;
+    }
+
+    compress_header_t* header = (compress_header_t*)stream;
+    header->magic = COMPRESS_MAGIC;
+    header->chunk_size = COMPRESS_CHUNK;
+    header->chunks = chunks;
+    uint8_t* offsets = stream + sizeof(compress_header_t);
+    uint64_t len = data_start;
+    int rc = 1;
+
+    for (uint64_t c = 0; c < chunks; c++) {
+        size_t n = c + 1 < chunks ? COMPRESS_CHUNK : (size_t)(size - c * COMPRESS_CHUNK);
+        if (fill(ctx, chunk, n) != 0) {
+            rc = -1;
+            goto out;
+        }
+        store_le64(offsets + c * sizeof(uint64_t), len);
+        if (len + n > cap && cap < limit) {
+            uint64_t new_cap = cap * 2 < limit ? cap * 2 : limit;
+            uint8_t* grown = realloc(stream, new_cap);
+            if (!grown) {
+                fprintf(stderr, "Error: Memory allocation failed\n");
+                rc = -1;
+                goto out;
+            }
+            stream = grown;
+            offsets = stream + sizeof(compress_header_t);
+            cap = new_cap;
+        }
+        if (len >= cap) goto out;
+
+        // Anything not strictly shorter than the chunk is stored raw, which
+        // is how the reader tells the two apart
+        size_t room = cap - len;
+        size_t stored = lz4_compress(chunk, n, stream + len, room < n ? room : n - 1);
+        if (stored == 0) {
+            if (n > room) goto out;
+            memcpy(stream + len, chunk, n);
+            stored = n;
+        }
+        len += stored;
+    }
+    store_le64(offsets + chunks * sizeof(uint64_t), len);
+    if ((len + BS - 1) / BS >= raw_blocks) goto out;
+
+    *stream_out = stream;
+    *stream_len_out = len;
+    stream = NULL;
+    rc = 0;
+out:
+    free(chunk);
+    free(stream);
+    return rc;
+}
+
+int compress_reader_init(compress_reader_t* r, compress_fetch_fn fetch, void* ctx, uint64_t size,
+                         uint64_t stream_len) {
+    memset(r, 0, sizeof(*r));
+    compress_header_t header;
+    if (stream_len < sizeof(header) || fetch(ctx, 0, &header, sizeof(header)) != 0) {
+        fprintf(stderr, "Error: Compressed stream is truncated\n");
+        return -1;
+    }
+    uint64_t chunks = (size + COMPRESS_CHUNK - 1) / COMPRESS_CHUNK;
+    if (header.magic != COMPRESS_MAGIC || header.chunk_size != COMPRESS_CHUNK || header.chunks != chunks ||
+        sizeof(header) + (chunks + 1) * sizeof(uint64_t) > stream_len) {
+        fprintf(stderr, "Error: Corrupt compressed stream header\n");
+        return -1;
+    }
+
+    r->chunk_buf = malloc(COMPRESS_CHUNK);
+    r->in_buf = malloc(COMPRESS_CHUNK);
+    if (!r->chunk_buf || !r->in_buf) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        compress_reader_free(r);
+        return -1;
+    }
+    r->fetch = fetch;
+    r->ctx = ctx;
+    r->size = size;
+    r->stream_len = stream_len;
+    r->chunks = chunks;
+    r->cached = UINT64_MAX;
+    return 0;
+}
+
+// Decompresses chunk c into chunk_buf unless it is already there
+static int load_chunk(compress_reader_t* r, uint64_t c) {
+    if (r->cached == c) return 0;
+    r->cached = UINT64_MAX;
+
+    uint8_t bounds[2 * sizeof(uint64_t)];
+    if (r->fetch(r->ctx, sizeof(compress_header_t) + c * sizeof(uint64_t), bounds, sizeof(bounds)) != 0) return -1;
+    uint64_t start = load_le64(bounds);
+    uint64_t end = load_le64(bounds + sizeof(uint64_t));
+    size_t n = c + 1 < r->chunks ? COMPRESS_CHUNK : (size_t)(r->size - c * COMPRESS_CHUNK);
+    if (start > end || end > r->stream_len || end - start > n) {
+        fprintf(stderr, "Error: Corrupt offset of compressed chunk %lu\n", c);
+        return -1;
+    }
+
+    size_t stored = (size_t)(end - start);
+    if (stored == n) {
+        if (r->fetch(r->ctx, start, r->chunk_buf, n) != 0) return -1;
+    } else {
+        if (r->fetch(r->ctx, start, r->in_buf, stored) != 0) return -1;
+        if (lz4_decompress(r->in_buf, stored, r->chunk_buf, n) != (int64_t)n) {
+            fprintf(stderr, "Error: Compressed chunk %lu is corrupt\n", c);
+            return -1;
+        }
+    }
+    r->cached = c;
+    return 0;
+}
+
+int64_t compress_reader_read(compress_reader_t* r, uint64_t offset, void* buf, size_t len) {
+    if (offset >= r->size) return 0;
+    if (len > r->size - offset) len = (size_t)(r->size - offset);
+
+    uint8_t* out = buf;
+    size_t done = 0;
+    while (done < len) {
+        uint64_t pos = offset + done;
+        uint64_t c = pos / COMPRESS_CHUNK;
+        size_t in_chunk = (size_t)(pos % COMPRESS_CHUNK);
+        size_t n = c + 1 < r->chunks ? COMPRESS_CHUNK : (size_t)(r->size - c * COMPRESS_CHUNK);
+        size_t take = n - in_chunk < len - done ? n - in_chunk : len - done;
+        if (load_chunk(r, c) != 0) return -1;
+        memcpy(out + done, r->chunk_buf + in_chunk, take);
+        done += take;
+    }
+    return (int64_t)done;
+}
+
+void compress_reader_free(compress_reader_t* r) {
+    free(r->chunk_buf);
+    free(r->in_buf);
+    r->chunk_buf = NULL;
+    r->in_buf = NULL;
+}
@@ -0,0 +1,46 @@
+#ifndef MINIVSFS_COMPRESS_H
+#define MINIVSFS_COMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Builds and reads the compressed stream of a file, laid out as described
+// next to compress_header_t in vsfs_format.h. Neither side touches an image:
+// callers supply the bytes through callbacks, so the same code serves the
+// adder, the library and the extractor.
+//
+// Functions print an "Error: ..." line to stderr and return -1 on failure.
+
+// Reads exactly len bytes; returns 0, or -1 after printing an error
+typedef int (*compress_fill_fn)(void* ctx, void* buf, size_t len);
+typedef int (*compress_fetch_fn)(void* ctx, uint64_t stream_offset, void* buf, size_t len);
+
+// Compresses a file of `size` bytes pulled in order from fill(). Returns 0
+// with the stream in *stream (the caller frees it) and its length in
+// *stream_len, 1 when the stream would not take fewer blocks than the raw
+// data (the file should be stored as is), or -1 on error. Chunks that do not
+// shrink are stored raw inside the stream.
+int compress_stream(uint64_t size, compress_fill_fn fill, void* ctx, uint8_t** stream, uint64_t* stream_len);
+
+typedef struct {
+    compress_fetch_fn fetch;
+    void* ctx;
+    uint64_t size;            // uncompressed file size
+    uint64_t stream_len;
+    uint64_t chunks;
+    uint64_t cached;          // chunk held in chunk_buf, or UINT64_MAX
+    uint8_t* chunk_buf;       // one decompressed chunk
+    uint8_t* in_buf;          // one stored chunk
+} compress_reader_t;
+
+// Checks the stream header; fetch() reads stream bytes at an offset
+int compress_reader_init(compress_reader_t* r, compress_fetch_fn fetch, void* ctx, uint64_t size,
+                         uint64_t stream_len);
+
+// Reads up to len bytes of the uncompressed file at offset, decompressing
+// only the chunks the range touches; returns the bytes read, 0 at the end
+int64_t compress_reader_read(compress_reader_t* r, uint64_t offset, void* buf, size_t len);
+
+void compress_reader_free(compress_reader_t* r);
+
+#endif
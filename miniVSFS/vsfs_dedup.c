@@ -0,0 +1,184 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vsfs_dedup.h"
+#include "vsfs_file.h"
+
+// Returns the reference count of a data block inside its cached table block
+static uint16_t* refcount_at(image_t* img, uint64_t block_no, uint64_t* table_block) {
+    uint64_t index = block_no - img->sb.data_region_start;
+    *table_block = dedup_start(&img->sb) + index / DEDUP_REFS_PER_BLOCK;
+    uint8_t* block = image_block(img, *table_block);
+    return block ? (uint16_t*)block + index % DEDUP_REFS_PER_BLOCK : NULL;
+}
+
+// Returns an index slot inside its cached index block
+static dedup_entry_t* entry_at(image_t* img, uint64_t slot, uint64_t* index_block) {
+    *index_block = dedup_start(&img->sb) + dedup_refcount_blocks_for(img->sb.data_region_blocks) +
+                   slot / DEDUP_ENTRIES_PER_BLOCK;
+    uint8_t* block = image_block(img, *index_block);
+    return block ? (dedup_entry_t*)block + slot % DEDUP_ENTRIES_PER_BLOCK : NULL;
+}
+
+// Whether an indexed block can take one more owner of `data`
+static int shareable(image_t* img, uint64_t block_no, const uint8_t* data) {
+    const superblock_t* sb = &img->sb;
+    if (block_no < sb->data_region_start || block_no - sb->data_region_start >= sb->data_region_blocks ||
+        !bitmap_test(&img->data_bm, block_no - sb->data_region_start)) {
+        return 0;
+    }
+    uint64_t table_block;
+    uint16_t* refs = refcount_at(img, block_no, &table_block);
+    if (!refs) return -1;
+    if (*refs == 0 || *refs == UINT16_MAX) return 0;
+    const uint8_t* existing = image_block(img, block_no);
+    if (!existing) return -1;
+    return memcmp(existing, data, BS) == 0;
+}
+
+uint64_t dedup_store(image_t* img, const uint8_t* data, int share, int* shared) {
+    uint32_t hash = crc32(data, BS);
+    uint64_t slots = dedup_index_blocks_for(img->sb.data_region_blocks) * DEDUP_ENTRIES_PER_BLOCK;
+    uint64_t home = hash % slots;
+    uint64_t target = home;
+    int found_empty = 0;
+    uint64_t index_block;
+    uint64_t table_block;
+
+    for (uint64_t p = 0; p < DEDUP_PROBE; p++) {
+        uint64_t slot = (home + p) % slots;
+        dedup_entry_t* entry = entry_at(img, slot, &index_block);
+        if (!entry) return 0;
+        if (entry->block == 0) {
+            if (!found_empty) target = slot;
+            found_empty = 1;
+            continue;
+        }
+        if (!share || entry->hash != hash) continue;
+        int ok = shareable(img, entry->block, data);
+        if (ok < 0) return 0;
+        if (!ok) continue;
+
+        uint16_t* refs = refcount_at(img, entry->block, &table_block);
+        if (!refs) return 0;
+        (*refs)++;
+        image_mark_dirty(img, table_block);
+        *shared = 1;
+        return entry->block;
+    }
+
+    uint64_t block_no = image_alloc_block(img);
+    if (!block_no) {
+        fprintf(stderr, "Error: Not enough free data blocks\n");
+        return 0;
+    }
+    uint8_t* block = image_block_zeroed(img, block_no);
+    uint16_t* refs = block ? refcount_at(img, block_no, &table_block) : NULL;
+    dedup_entry_t* entry = refs ? entry_at(img, target, &index_block) : NULL;
+    if (!entry) {
+        image_free_run(img, block_no, 1);
+        return 0;
+    }
+    memcpy(block, data, BS);
+    *refs = 1;
+    image_mark_dirty(img, table_block);
+    entry->hash = hash;
+    entry->block = (uint32_t)block_no;
+    image_mark_dirty(img, index_block);
+    *shared = 0;
+    return block_no;
+}
+
+int dedup_free_run(image_t* img, uint64_t first, uint64_t count) {
+    // Blocks that lose their last owner are freed in runs
+    uint64_t run_start = first;
+    uint64_t run_length = 0;
+    for (uint64_t b = first; b < first + count; b++) {
+        uint64_t table_block;
+        uint16_t* refs = refcount_at(img, b, &table_block);
+        if (!refs) return -1;
+        if (*refs > 1) {
+            (*refs)--;
+            image_mark_dirty(img, table_block);
+            if (run_length) image_free_run(img, run_start, run_length);
+            run_length = 0;
+            continue;
+        }
+        if (*refs == 1) {
+            *refs = 0;
+            image_mark_dirty(img, table_block);
+        }
+        if (run_length == 0) run_start = b;
+        run_length++;
+    }
+    if (run_length) image_free_run(img, run_start, run_length);
+    return 0;
+}
+
+// Releases the block references taken for a file that could not be created
+static void undo_runs(image_t* img, bitmap_extent_t* runs, int n_runs) {
+    for (int r = 0; r < n_runs; r++) dedup_free_run(img, runs[r].start, runs[r].length);
+    free(runs);
+}
+
+int64_t dedup_create_file(image_t* img, const char* name, uint64_t size, dedup_fill_fn fill, void* ctx,
+                          uint64_t* shared_blocks) {
+    if (!(img->sb.flags & SB_FLAG_DEDUP)) {
+        fprintf(stderr, "Error: Image was not built with --dedup\n");
+        return -1;
+    }
+    size_t max_runs = file_max_runs(img);
+    bitmap_extent_t* runs = malloc(max_runs * sizeof(bitmap_extent_t));
+    uint8_t* data = malloc(BS);
+    if (!runs || !data) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        free(runs);
+        free(data);
+        return -1;
+    }
+
+    int n_runs = 0;
+    uint64_t shared_count = 0;
+    for (uint64_t pos = 0; pos < size; pos += BS) {
+        size_t n = size - pos < BS ? (size_t)(size - pos) : BS;
+        if (n < BS) memset(data + n, 0, BS - n);
+        if (fill(ctx, data, n) != 0) {
+            undo_runs(img, runs, n_runs);
+            free(data);
+            return -1;
+        }
+
+        // Shared blocks split the file into more runs; near the limit only
+        // new blocks are taken, which next-fit allocation keeps contiguous
+        int shared = 0;
+        uint64_t block_no = dedup_store(img, data, (size_t)n_runs + 2 < max_runs, &shared);
+        if (!block_no) {
+            undo_runs(img, runs, n_runs);
+            free(data);
+            return -1;
+        }
+        shared_count += (uint64_t)shared;
+        if (n_runs > 0 && runs[n_runs - 1].start + runs[n_runs - 1].length == block_no) {
+            runs[n_runs - 1].length++;
+        } else if ((size_t)n_runs < max_runs) {
+            runs[n_runs++] = (bitmap_extent_t){ block_no, 1 };
+        } else {
+            fprintf(stderr, "Error: Free space is too fragmented to map '%s' (more than %zu extents)\n",
+                    name, max_runs);
+            dedup_free_run(img, block_no, 1);
+            undo_runs(img, runs, n_runs);
+            free(data);
+            return -1;
+        }
+    }
+    free(data);
+
+    int64_t inode_no = file_create_mapped(img, name, size, runs, n_runs);
+    if (inode_no < 0) {
+        undo_runs(img, runs, n_runs);
+        return -1;
+    }
+    free(runs);
+    *shared_blocks = shared_count;
+    return inode_no;
+}
@@ -0,0 +1,36 @@
+#ifndef MINIVSFS_DEDUP_H
+#define MINIVSFS_DEDUP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "vsfs_image.h"
+
+// Block deduplication on images with SB_FLAG_DEDUP. The reference counts and
+// the hash index are described next to dedup_entry_t in vsfs_format.h; both
+// go through the block cache like any other metadata.
+//
+// Functions print an "Error: ..." line to stderr and return -1 (or 0 for a
+// block number) on failure.
+
+// Reads exactly len bytes; returns 0, or -1 after printing an error
+typedef int (*dedup_fill_fn)(void* ctx, void* buf, size_t len);
+
+// Stores one block of file data (BS bytes, zero-padded past the end of the
+// file). An indexed block with the same contents gets one more reference and
+// is returned with *shared set; otherwise a new block is allocated, filled
+// and entered in the index. share = 0 always allocates. Returns the absolute
+// block number, or 0 on error.
+uint64_t dedup_store(image_t* img, const uint8_t* data, int share, int* shared);
+
+// Drops one reference from each block of a run and returns the blocks left
+// without an owner to the data bitmap
+int dedup_free_run(image_t* img, uint64_t first, uint64_t count);
+
+// Creates a regular file of `size` bytes pulled in order from fill(), every
+// block going through dedup_store(). Returns the new inode number, with the
+// blocks shared with other files in *shared_blocks, or -1 with every block
+// reference taken undone.
+int64_t dedup_create_file(image_t* img, const char* name, uint64_t size, dedup_fill_fn fill, void* ctx,
+                          uint64_t* shared_blocks);
+
+#endif
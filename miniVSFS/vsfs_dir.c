@@ -0,0 +1,614 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "vsfs_dir.h"
+
+#define DIRENTS_PER_BLOCK (BS / sizeof(dirent64_t))
+
+static inode_t* dir_inode(image_t* img, uint32_t dir_ino, int for_write) {
+    inode_t* dir = for_write ? image_inode(img, dir_ino) : image_inode_peek(img, dir_ino);
+    if (!dir) return NULL;
+    if ((dir->mode & 0170000) != MODE_DIR) {
+        fprintf(stderr, "Error: Inode %u is not a directory\n", dir_ino);
+        return NULL;
+    }
+    return dir;
+}
+
+// Returns the index header of an indexed directory after basic sanity checks.
+// The table checksum is left to offline checking: verifying it here would
+// make every lookup read the whole table.
+static dx_header_t* dx_header(image_t* img, const inode_t* dir, uint32_t dir_ino) {
+    dx_header_t* hdr = (dx_header_t*)image_block(img, dir->xattr_ptr);
+    if (!hdr) return NULL;
+    if (hdr->magic != DX_MAGIC || hdr->depth > DX_MAX_DEPTH || hdr->owner != dir_ino) {
+        fprintf(stderr, "Error: Corrupt directory index in inode %u\n", dir_ino);
+        return NULL;
+    }
+    return hdr;
+}
+
+// Slot `index` of the table whose header is at block `table`. The table runs
+// on past the header block, so each slot is located through the cache.
+static int dx_get(image_t* img, uint64_t table, uint64_t index, uint32_t* leaf) {
+    uint64_t offset = sizeof(dx_header_t) + index * sizeof(uint32_t);
+    uint8_t* block = image_block(img, table + offset / BS);
+    if (!block) return -1;
+    memcpy(leaf, block + offset % BS, sizeof(uint32_t));
+    return 0;
+}
+
+static int dx_set(image_t* img, uint64_t table, uint64_t index, uint32_t leaf) {
+    uint64_t offset = sizeof(dx_header_t) + index * sizeof(uint32_t);
+    uint8_t* block = image_block(img, table + offset / BS);
+    if (!block) return -1;
+    memcpy(block + offset % BS, &leaf, sizeof(uint32_t));
+    image_mark_dirty(img, table + offset / BS);
+    return 0;
+}
+
+static int dx_finalize(image_t* img, uint64_t table) {
+    dx_header_t* hdr = (dx_header_t*)image_block(img, table);
+    if (!hdr) return -1;
+    hdr->checksum = 0;
+    uint64_t bytes = sizeof(dx_header_t) + ((uint64_t)sizeof(uint32_t) << hdr->depth);
+    uint32_t crc = 0;
+    for (uint64_t done = 0; done < bytes; done += BS) {
+        uint8_t* block = image_block(img, table + done / BS);
+        if (!block) return -1;
+        crc = crc32_update(crc, block, bytes - done < BS ? bytes - done : BS);
+    }
+    hdr->checksum = crc;
+    image_mark_dirty(img, table);
+    return 0;
+}
+
+// Returns the first block of `count` free data blocks, all zeroed and dirty
+static uint64_t dx_alloc_zeroed(image_t* img, uint64_t count, uint32_t dir_ino) {
+    uint64_t first = count == 1 ? image_alloc_block(img) : image_alloc_run(img, count);
+    if (!first) {
+        fprintf(stderr, "Error: No free data blocks left to grow directory inode %u\n", dir_ino);
+        return 0;
+    }
+    for (uint64_t b = 0; b < count; b++) {
+        if (!image_block_zeroed(img, first + b)) return 0;
+    }
+    return first;
+}
+
+// Turns a directory whose first block is full into an indexed one with a
+// single empty leaf
+static int dx_create(image_t* img, inode_t* dir, uint32_t dir_ino) {
+    uint64_t table = dx_alloc_zeroed(img, dx_table_blocks(0), dir_ino);
+    if (!table) return -1;
+    uint64_t leaf = dx_alloc_zeroed(img, 1, dir_ino);
+    if (!leaf) return -1;
+
+    dx_header_t* hdr = (dx_header_t*)image_block(img, table);
+    hdr->magic = DX_MAGIC;
+    hdr->depth = 0;
+    hdr->owner = dir_ino;
+    if (dx_set(img, table, 0, (uint32_t)leaf) != 0) return -1;
+
+    dir->flags |= INODE_FL_INDEX;
+    dir->xattr_ptr = table;
+    return dx_finalize(img, table);
+}
+
+// Doubles the table, moving it to a larger run of blocks when it outgrows
+// its current one
+static int dx_grow(image_t* img, inode_t* dir, uint32_t dir_ino) {
+    uint64_t table = dir->xattr_ptr;
+    dx_header_t* hdr = dx_header(img, dir, dir_ino);
+    if (!hdr) return -1;
+    uint32_t depth = hdr->depth;
+
+    uint64_t old_blocks = dx_table_blocks(depth);
+    uint64_t new_blocks = dx_table_blocks(depth + 1);
+    if (new_blocks != old_blocks) {
+        uint64_t moved = dx_alloc_zeroed(img, new_blocks, dir_ino);
+        if (!moved) return -1;
+        for (uint64_t b = 0; b < old_blocks; b++) {
+            uint8_t* src = image_block(img, table + b);
+            if (!src) return -1;
+            memcpy(image_block(img, moved + b), src, BS);
+        }
+        image_free_run(img, table, old_blocks);
+        dir->xattr_ptr = table = moved;
+        hdr = (dx_header_t*)image_block(img, table);
+    }
+
+    // Both halves of the doubled table start out pointing at the same leaves
+    for (uint64_t j = 0; j < (1ull << depth); j++) {
+        uint32_t leaf;
+        if (dx_get(img, table, j, &leaf) != 0 || dx_set(img, table, j + (1ull << depth), leaf) != 0) return -1;
+    }
+    hdr->depth = depth + 1;
+    image_mark_dirty(img, table);
+    return 0;
+}
+
+// Splits the full leaf behind table slot `index` on the next hash bit
+static int dx_split(image_t* img, inode_t* dir, uint32_t dir_ino, uint64_t index) {
+    dx_header_t* hdr = dx_header(img, dir, dir_ino);
+    if (!hdr) return -1;
+    uint64_t table = dir->xattr_ptr;
+    uint32_t leaf_no;
+    if (dx_get(img, table, index, &leaf_no) != 0) return -1;
+
+    // The slots sharing a leaf of local depth d are exactly those equal to
+    // index modulo 1 << d, so d is found by flipping high bits of index
+    uint32_t local = hdr->depth;
+    while (local > 0) {
+        uint32_t other;
+        if (dx_get(img, table, index ^ (1ull << (local - 1)), &other) != 0) return -1;
+        if (other != leaf_no) break;
+        local--;
+    }
+
+    if (local == hdr->depth) {
+        if (hdr->depth == DX_MAX_DEPTH) {
+            fprintf(stderr, "Error: Directory index of inode %u is full\n", dir_ino);
+            return -1;
+        }
+        if (dx_grow(img, dir, dir_ino) != 0) return -1;
+        table = dir->xattr_ptr;
+        hdr = (dx_header_t*)image_block(img, table);
+    }
+
+    uint64_t new_no = dx_alloc_zeroed(img, 1, dir_ino);
+    if (!new_no) return -1;
+    dirent64_t* old_leaf = (dirent64_t*)image_block(img, leaf_no);
+    dirent64_t* new_leaf = (dirent64_t*)image_block(img, new_no);
+    if (!old_leaf || !new_leaf) return -1;
+
+    size_t moved = 0;
+    for (size_t i = 0; i < DIRENTS_PER_BLOCK; i++) {
+        if (old_leaf[i].inode_no == 0) continue;
+        if ((dirent_name_hash(old_leaf[i].name) >> local) & 1) {
+            new_leaf[moved++] = old_leaf[i];
+            memset(&old_leaf[i], 0, sizeof(dirent64_t));
+        }
+    }
+    image_mark_dirty(img, leaf_no);
+
+    uint64_t step = 1ull << (local + 1);
+    for (uint64_t j = (index & ((1ull << local) - 1)) | (1ull << local); j < (1ull << hdr->depth); j += step) {
+        if (dx_set(img, table, j, (uint32_t)new_no) != 0) return -1;
+    }
+    return dx_finalize(img, table);
+}
+
+static int dx_insert(image_t* img, inode_t* dir, uint32_t dir_ino, const dirent64_t* entry) {
+    uint32_t hash = dirent_name_hash(entry->name);
+    // Each split frees room unless every entry shares the next hash bit; the
+    // depth limit bounds the retries
+    for (;;) {
+        dx_header_t* hdr = dx_header(img, dir, dir_ino);
+        if (!hdr) return -1;
+        uint64_t index = hash & ((1ull << hdr->depth) - 1);
+        uint32_t leaf_no;
+        if (dx_get(img, dir->xattr_ptr, index, &leaf_no) != 0) return -1;
+        dirent64_t* leaf = (dirent64_t*)image_block(img, leaf_no);
+        if (!leaf) return -1;
+
+        for (size_t i = 0; i < DIRENTS_PER_BLOCK; i++) {
+            if (leaf[i].inode_no == 0) {
+                leaf[i] = *entry;
+                image_mark_dirty(img, leaf_no);
+                return 0;
+            }
+        }
+        if (dx_split(img, dir, dir_ino, index) != 0) return -1;
+    }
+}
+
+// Returns the slot holding `name` in a block of entries, or -1
+static int scan_block(const dirent64_t* entries, const char* name) {
+    for (size_t i = 0; i < DIRENTS_PER_BLOCK; i++) {
+        if (entries[i].inode_no != 0 && strncmp(entries[i].name, name, DIRENT_NAME_MAX) == 0) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+// Finds the block and slot of `name`; returns 1 if found, 0 if not, -1 on error
+static int dir_find(image_t* img, const inode_t* dir, uint32_t dir_ino, const char* name,
+                    uint64_t* block_no, int* slot) {
+    const dirent64_t* first = (const dirent64_t*)image_block(img, dir->direct[0]);
+    if (!first) return -1;
+    *block_no = dir->direct[0];
+    *slot = scan_block(first, name);
+    if (*slot >= 0 || !(dir->flags & INODE_FL_INDEX)) return *slot >= 0;
+
+    dx_header_t* hdr = dx_header(img, dir, dir_ino);
+    if (!hdr) return -1;
+    uint32_t leaf_no;
+    if (dx_get(img, dir->xattr_ptr, dirent_name_hash(name) & ((1ull << hdr->depth) - 1), &leaf_no) != 0) {
+        return -1;
+    }
+    const dirent64_t* leaf = (const dirent64_t*)image_block(img, leaf_no);
+    if (!leaf) return -1;
+    *block_no = leaf_no;
+    *slot = scan_block(leaf, name);
+    return *slot >= 0;
+}
+
+int64_t dir_lookup(image_t* img, uint32_t dir_ino, const char* name) {
+    inode_t* dir = dir_inode(img, dir_ino, 0);
+    if (!dir) return -1;
+
+    uint64_t block_no;
+    int slot;
+    int found = dir_find(img, dir, dir_ino, name, &block_no, &slot);
+    if (found <= 0) return found;
+    return ((const dirent64_t*)image_block(img, block_no))[slot].inode_no;
+}
+
+int64_t dir_remove(image_t* img, uint32_t dir_ino, const char* name) {
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        fprintf(stderr, "Error: Cannot remove '%s' from a directory\n", name);
+        return -1;
+    }
+    inode_t* dir = dir_inode(img, dir_ino, 0);
+    if (!dir) return -1;
+
+    uint64_t block_no;
+    int slot;
+    int found = dir_find(img, dir, dir_ino, name, &block_no, &slot);
+    if (found <= 0) return found;
+
+    // The slot is left empty for a later dir_add; leaves are not merged
+    dirent64_t* entries = (dirent64_t*)image_block(img, block_no);
+    uint32_t inode_no = entries[slot].inode_no;
+    memset(&entries[slot], 0, sizeof(dirent64_t));
+    image_mark_dirty(img, block_no);
+
+    dir = image_inode(img, dir_ino);
+    dir->size_bytes -= sizeof(dirent64_t);
+    dir->mtime = time(NULL);
+    inode_crc_finalize(dir);
+    return inode_no;
+}
+
+int dir_relocate(image_t* img, uint32_t dir_ino, uint64_t (*move)(void* arg, uint64_t block_no, uint64_t count),
+                 void* arg) {
+    inode_t* dir = dir_inode(img, dir_ino, 0);
+    if (!dir) return -1;
+    uint64_t first = move(arg, dir->direct[0], 1);
+    if (!first) return -1;
+    if (first != dir->direct[0]) {
+        dir = image_inode(img, dir_ino);
+        dir->direct[0] = (uint32_t)first;
+        inode_crc_finalize(dir);
+    }
+    if (!(dir->flags & INODE_FL_INDEX)) return 0;
+
+    dx_header_t* hdr = dx_header(img, dir, dir_ino);
+    if (!hdr) return -1;
+    uint32_t depth = hdr->depth;
+    uint64_t table = move(arg, dir->xattr_ptr, dx_table_blocks(depth));
+    if (!table) return -1;
+    if (table != dir->xattr_ptr) {
+        dir = image_inode(img, dir_ino);
+        dir->xattr_ptr = table;
+        inode_crc_finalize(dir);
+    }
+
+    // A leaf first appears at its lowest slot, as in dir_iterate(); slots
+    // repeating a moved leaf follow it there
+    uint64_t slots = 1ull << depth;
+    uint32_t* old = malloc(slots * sizeof(uint32_t));
+    if (!old) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return -1;
+    }
+    int rc = 0, changed = 0;
+    for (uint64_t i = 0; rc == 0 && i < slots; i++) rc = dx_get(img, table, i, &old[i]);
+    for (uint64_t i = 0; rc == 0 && i < slots; i++) {
+        uint32_t now;
+        if (i > 0 && old[i & ~(1ull << (63 - __builtin_clzll(i)))] == old[i]) {
+            rc = dx_get(img, table, i & ~(1ull << (63 - __builtin_clzll(i))), &now);
+        } else {
+            uint64_t moved = move(arg, old[i], 1);
+            if (!moved) rc = -1;
+            now = (uint32_t)moved;
+        }
+        if (rc == 0 && now != old[i]) {
+            rc = dx_set(img, table, i, now);
+            changed = 1;
+        }
+    }
+    free(old);
+    if (rc == 0 && changed) rc = dx_finalize(img, table);
+    return rc;
+}
+
+static int visit_block(image_t* img, uint64_t block_no, size_t first_slot,
+                       int (*fn)(const dirent64_t*, void*), void* arg) {
+    const dirent64_t* entries = (const dirent64_t*)image_block(img, block_no);
+    if (!entries) return -1;
+    for (size_t i = first_slot; i < DIRENTS_PER_BLOCK; i++) {
+        if (entries[i].inode_no == 0) continue;
+        int rc = fn(&entries[i], arg);
+        if (rc != 0) return rc;
+    }
+    return 0;
+}
+
+int dir_iterate(image_t* img, uint32_t dir_ino, int (*fn)(const dirent64_t*, void*), void* arg) {
+    inode_t* dir = dir_inode(img, dir_ino, 0);
+    if (!dir) return -1;
+    int rc = visit_block(img, dir->direct[0], 2, fn, arg);
+    if (rc != 0 || !(dir->flags & INODE_FL_INDEX)) return rc;
+
+    dx_header_t* hdr = dx_header(img, dir, dir_ino);
+    if (!hdr) return -1;
+    uint64_t table = dir->xattr_ptr;
+    uint32_t depth = hdr->depth;
+    for (uint64_t i = 0; i < (1ull << depth); i++) {
+        // A leaf shared by several slots is visited at its lowest slot only:
+        // slot i repeats slot i minus its top bit exactly when they match
+        uint32_t leaf_no, lower_no;
+        if (dx_get(img, table, i, &leaf_no) != 0) return -1;
+        if (i > 0) {
+            if (dx_get(img, table, i & ~(1ull << (63 - __builtin_clzll(i))), &lower_no) != 0) return -1;
+            if (lower_no == leaf_no) continue;
+        }
+        rc = visit_block(img, leaf_no, 0, fn, arg);
+        if (rc != 0) return rc;
+    }
+    return 0;
+}
+
+int dir_add(image_t* img, uint32_t dir_ino, const char* name, uint32_t inode_no, uint8_t type) {
+    inode_t* dir = dir_inode(img, dir_ino, 1);
+    if (!dir) return -1;
+
+    dirent64_t entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.inode_no = inode_no;
+    entry.type = type;
+    strncpy(entry.name, name, DIRENT_NAME_MAX);
+    entry.name[DIRENT_NAME_MAX] = '\0';
+    dirent_checksum_finalize(&entry);
+
+    // Entries freed in the first block are reused before the index grows
+    dirent64_t* first = (dirent64_t*)image_block(img, dir->direct[0]);
+    if (!first) return -1;
+    size_t slot = 0;
+    while (slot < DIRENTS_PER_BLOCK && first[slot].inode_no != 0) slot++;
+
+    if (slot < DIRENTS_PER_BLOCK) {
+        first[slot] = entry;
+        image_mark_dirty(img, dir->direct[0]);
+    } else {
+        if (!(dir->flags & INODE_FL_INDEX)) {
+            if (img->sb.version < VSFS_VERSION_EXTENTS) {
+                fprintf(stderr, "Error: No free directory entry slots in directory inode %u\n", dir_ino);
+                return -1;
+            }
+            if (dx_create(img, dir, dir_ino) != 0) return -1;
+        }
+        if (dx_insert(img, dir, dir_ino, &entry) != 0) return -1;
+    }
+
+    dir->size_bytes += sizeof(dirent64_t);
+    dir->mtime = time(NULL);
+    inode_crc_finalize(dir);
+    return 0;
+}
+
+int64_t dir_mkdir(image_t* img, uint32_t parent_ino, const char* name) {
+    image_set_goal(img, parent_ino, 1, 1);
+    uint32_t inode_no = image_alloc_inode(img);
+    if (!inode_no) {
+        fprintf(stderr, "Error: No free inodes available\n");
+        return -1;
+    }
+    uint64_t block_no = image_alloc_block(img);
+    if (!block_no) {
+        fprintf(stderr, "Error: No free data blocks left for directory '%s'\n", name);
+        return -1;
+    }
+    dirent64_t* entries = (dirent64_t*)image_block_zeroed(img, block_no);
+    if (!entries) return -1;
+
+    entries[0].inode_no = inode_no;
+    entries[0].type = TYPE_DIR;
+    strcpy(entries[0].name, ".");
+    dirent_checksum_finalize(&entries[0]);
+    entries[1].inode_no = parent_ino;
+    entries[1].type = TYPE_DIR;
+    strcpy(entries[1].name, "..");
+    dirent_checksum_finalize(&entries[1]);
+
+    inode_t* dir = image_inode(img, inode_no);
+    if (!dir) return -1;
+    memset(dir, 0, sizeof(inode_t));
+    dir->mode = MODE_DIR;
+    dir->links = 2;
+    dir->size_bytes = 2 * sizeof(dirent64_t);
+    time_t now = time(NULL);
+    dir->atime = now;
+    dir->mtime = now;
+    dir->ctime = now;
+    dir->direct[0] = (uint32_t)block_no;
+    inode_crc_finalize(dir);
+
+    // The new directory's ".." links its parent
+    inode_t* parent = image_inode(img, parent_ino);
+    if (!parent) return -1;
+    if (parent->links < UINT16_MAX) parent->links++;
+    if (dir_add(img, parent_ino, name, inode_no, TYPE_DIR) != 0) return -1;
+    return inode_no;
+}
+
+void dcache_init(dcache_t* cache) {
+    memset(cache, 0, sizeof(*cache));
+}
+
+void dcache_free(dcache_t* cache) {
+    for (size_t i = 0; i < cache->capacity; i++) free(cache->slots[i].path);
+    free(cache->slots);
+    memset(cache, 0, sizeof(*cache));
+}
+
+static size_t dcache_slot(const dcache_t* cache, const char* path, size_t len) {
+    size_t mask = cache->capacity - 1;
+    size_t i = crc32(path, len) & mask;
+    while (cache->slots[i].path &&
+           (strlen(cache->slots[i].path) != len || memcmp(cache->slots[i].path, path, len) != 0)) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+// Returns the cached inode of the first `len` bytes of path, or 0
+static uint32_t dcache_get(const dcache_t* cache, const char* path, size_t len) {
+    if (cache->capacity == 0) return 0;
+    const dcache_entry_t* entry = &cache->slots[dcache_slot(cache, path, len)];
+    return entry->path ? entry->inode_no : 0;
+}
+
+static int dcache_put(dcache_t* cache, const char* path, size_t len, uint32_t inode_no) {
+    if ((cache->used + 1) * 4 > cache->capacity * 3) {
+        dcache_t grown = { calloc(cache->capacity ? cache->capacity * 2 : 64, sizeof(dcache_entry_t)),
+                           cache->capacity ? cache->capacity * 2 : 64, cache->used };
+        if (!grown.slots) return -1;
+        for (size_t i = 0; i < cache->capacity; i++) {
+            const char* p = cache->slots[i].path;
+            if (p) grown.slots[dcache_slot(&grown, p, strlen(p))] = cache->slots[i];
+        }
+        free(cache->slots);
+        *cache = grown;
+    }
+    dcache_entry_t* entry = &cache->slots[dcache_slot(cache, path, len)];
+    if (!entry->path) {
+        entry->path = strndup(path, len);
+        if (!entry->path) return -1;
+        cache->used++;
+    }
+    entry->inode_no = inode_no;
+    return 0;
+}
+
+// Resolves the directory named by the first `len` bytes of a normalized
+// path ("a/b/c", no empty or "." components); returns its inode, 0 if a
+// component is missing and `create` is not set, or -1
+static int64_t resolve_dir(image_t* img, dcache_t* cache, const char* path, size_t len, int create) {
+    if (len == 0) return ROOT_INO;
+    uint32_t cached = dcache_get(cache, path, len);
+    if (cached) return cached;
+
+    size_t name_start = len;
+    while (name_start > 0 && path[name_start - 1] != '/') name_start--;
+    int64_t parent = resolve_dir(img, cache, path, name_start ? name_start - 1 : 0, create);
+    if (parent <= 0) return parent;
+
+    char name[DIRENT_NAME_MAX + 1];
+    size_t name_len = len - name_start < DIRENT_NAME_MAX ? len - name_start : DIRENT_NAME_MAX;
+    memcpy(name, path + name_start, name_len);
+    name[name_len] = '\0';
+
+    // Another writer sharing the image may create the same directory, so the
+    // lookup and the insert happen under the parent's lock
+    if (image_lock_dir(img, (uint32_t)parent) != 0) return -1;
+    int64_t inode_no = dir_lookup(img, (uint32_t)parent, name);
+    if (inode_no == 0 && create) inode_no = dir_mkdir(img, (uint32_t)parent, name);
+    if (image_unlock_dir(img, (uint32_t)parent) != 0) inode_no = -1;
+    if (inode_no <= 0) return inode_no;
+    inode_t* inode = image_inode_peek(img, (uint64_t)inode_no);
+    if (!inode) return -1;
+    if ((inode->mode & 0170000) != MODE_DIR) {
+        fprintf(stderr, "Error: '%.*s' is not a directory\n", (int)len, path);
+        return -1;
+    }
+
+    if (dcache_put(cache, path, len, (uint32_t)inode_no) != 0) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return -1;
+    }
+    return inode_no;
+}
+
+// Collapses path into "a/b/c" so equal directories share one cache key.
+// *last points at the final component within `path`, or is NULL if the path
+// names the root.
+static char* normalize_path(const char* path, size_t* len_out, const char** last_out) {
+    char* norm = malloc(strlen(path) + 1);
+    if (!norm) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return NULL;
+    }
+    size_t len = 0;
+    const char* last = NULL;
+    for (const char* p = path; *p; ) {
+        const char* end = strchr(p, '/');
+        if (!end) end = p + strlen(p);
+        size_t n = (size_t)(end - p);
+        if (n > 0 && !(n == 1 && p[0] == '.')) {
+            if (len) norm[len++] = '/';
+            memcpy(norm + len, p, n);
+            len += n;
+            last = p;
+        }
+        p = *end ? end + 1 : end;
+    }
+    norm[len] = '\0';
+    *len_out = len;
+    *last_out = last;
+    return norm;
+}
+
+int dir_resolve_parent(image_t* img, dcache_t* cache, const char* path, int create,
+                       uint32_t* parent_ino, const char** leaf) {
+    size_t len;
+    const char* last;
+    char* norm = normalize_path(path, &len, &last);
+    if (!norm) return -1;
+
+    size_t last_len = last ? strcspn(last, "/") : 0;
+    if (!last || last[last_len] != '\0' || (last_len == 2 && last[0] == '.' && last[1] == '.')) {
+        fprintf(stderr, "Error: '%s' does not name a file\n", path);
+        free(norm);
+        return -1;
+    }
+
+    size_t parent_len = len > last_len ? len - last_len - 1 : 0;
+    int64_t parent = resolve_dir(img, cache, norm, parent_len, create);
+    if (parent == 0) {
+        fprintf(stderr, "Error: Directory '%.*s' does not exist (use --mkdir-p to create it)\n",
+                (int)parent_len, norm);
+    }
+    free(norm);
+    if (parent <= 0) return -1;
+    *parent_ino = (uint32_t)parent;
+    *leaf = last;
+    return 0;
+}
+
+int64_t dir_resolve(image_t* img, dcache_t* cache, const char* path) {
+    size_t len;
+    const char* last;
+    char* norm = normalize_path(path, &len, &last);
+    if (!norm) return -1;
+    if (!last) {
+        free(norm);
+        return ROOT_INO;
+    }
+
+    size_t last_len = strcspn(last, "/");
+    int64_t parent = resolve_dir(img, cache, norm, len > last_len ? len - last_len - 1 : 0, 0);
+    free(norm);
+    if (parent <= 0) return parent;
+
+    char name[DIRENT_NAME_MAX + 1];
+    size_t name_len = last_len < DIRENT_NAME_MAX ? last_len : DIRENT_NAME_MAX;
+    memcpy(name, last, name_len);
+    name[name_len] = '\0';
+    return dir_lookup(img, (uint32_t)parent, name);
+}
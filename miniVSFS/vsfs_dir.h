@@ -0,0 +1,72 @@
+#ifndef MINIVSFS_DIR_H
+#define MINIVSFS_DIR_H
+
+#include <stdint.h>
+#include "vsfs_image.h"
+
+// Directory entries on top of the image block cache. A lookup or insert
+// touches the directory's first block plus, for indexed directories, the
+// index table and one leaf, however many entries the directory holds. See
+// dx_header_t in vsfs_format.h for the layout.
+
+// Returns the inode number of `name` in directory dir_ino, 0 if there is no
+// such entry, or -1 on error. Names are compared as stored, i.e. truncated
+// to DIRENT_NAME_MAX characters.
+int64_t dir_lookup(image_t* img, uint32_t dir_ino, const char* name);
+
+// Inserts an entry without checking for duplicates (use dir_lookup first).
+// Fills the first block, then converts the directory to an indexed one on
+// version 2 images. Updates the directory inode's size, mtime and checksum.
+int dir_add(image_t* img, uint32_t dir_ino, const char* name, uint32_t inode_no, uint8_t type);
+
+// Removes the entry `name` (neither "." nor "..") and returns the inode it
+// named, 0 if there is no such entry, or -1 on error. Updates the directory
+// inode's size, mtime and checksum; the named inode is left to the caller.
+int64_t dir_remove(image_t* img, uint32_t dir_ino, const char* name);
+
+// Calls fn for every entry except "." and "..", in on-disk order. Stops at
+// the first nonzero return of fn and returns it; returns -1 on error.
+int dir_iterate(image_t* img, uint32_t dir_ino, int (*fn)(const dirent64_t*, void*), void* arg);
+
+// Creates an empty subdirectory `name` in parent_ino (no duplicate check)
+// and returns its inode number, or -1 on error
+int64_t dir_mkdir(image_t* img, uint32_t parent_ino, const char* name);
+
+// Offers each block run directory dir_ino owns (its first block, its index
+// table, each index leaf) to `move`, which returns where the run starts now:
+// the same block to leave it, a new one it has copied the run to, or 0 on
+// error. The directory inode and index are updated to match; the old runs
+// are left to `move` to free. Returns 0 or -1.
+int dir_relocate(image_t* img, uint32_t dir_ino, uint64_t (*move)(void* arg, uint64_t block_no, uint64_t count),
+                 void* arg);
+
+// In-process dentry cache: directory inode numbers keyed by their path
+// relative to the root, so a batch of adds under one prefix resolves each
+// directory once instead of walking every component again.
+typedef struct {
+    char* path;          // NULL marks an empty slot
+    uint32_t inode_no;
+} dcache_entry_t;
+
+typedef struct {
+    dcache_entry_t* slots;
+    size_t capacity;     // always a power of two
+    size_t used;
+} dcache_t;
+
+void dcache_init(dcache_t* cache);
+void dcache_free(dcache_t* cache);
+
+// Splits `path` into its parent directory and final name. Leading and
+// repeated slashes and "." components are ignored. The parent is resolved
+// through the cache, creating missing directories when `create` is set.
+// On success *leaf points into `path` at the final component.
+int dir_resolve_parent(image_t* img, dcache_t* cache, const char* path, int create,
+                       uint32_t* parent_ino, const char** leaf);
+
+// Returns the inode of the file or directory at `path` (the root for "" or
+// "/"), 0 if any component does not exist, or -1 on error. Prints nothing
+// for a missing path.
+int64_t dir_resolve(image_t* img, dcache_t* cache, const char* path);
+
+#endif
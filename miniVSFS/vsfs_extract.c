@@ -0,0 +1,510 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include "crc32.h"
+#include "vsfs_format.h"
+#include "vsfs_image.h"
+#include "vsfs_dir.h"
+#include "vsfs_file.h"
+#include "vsfs_compress.h"
+
+// Copies files out of an image without staging their data in userspace.
+// Metadata is read through the image block cache; data goes from the image
+// fd to the output fd with one copy_file_range() per run of contiguous
+// blocks (which may share extents on reflink-capable filesystems), falling
+// back to sendfile() for pipes and other non-regular outputs and to
+// pread/write only when neither is available. Compressed files are the
+// exception: they are decompressed chunk by chunk through a buffer.
+
+#define COPY_BUFFER (1u << 20)
+
+void print_usage(const char* program_name) {
+    printf("Usage: %s --image <image.img> --file <path> [--output <host file>]\n", program_name);
+    printf("       %s --image <image.img> --all <host dir> [--jobs <n>]\n", program_name);
+    printf("  --image: Image to read\n");
+    printf("  --file: Path of the file inside the image; written to stdout without --output\n");
+    printf("  --output: Host file to write instead of stdout\n");
+    printf("  --all: Extract every file and directory into this host directory\n");
+    printf("  --jobs: Copy threads for --all (default: online CPUs)\n");
+}
+
+// Copies len bytes from image offset `from` to out_fd, at `to` or at the
+// current file position when `to` is negative
+static int copy_range(int in_fd, uint64_t from, int out_fd, int64_t to, uint64_t len) {
+    loff_t in_off = (loff_t)from;
+    loff_t out_off = to;
+    uint64_t done = 0;
+
+    while (done < len) {
+        ssize_t n = copy_file_range(in_fd, &in_off, out_fd, to >= 0 ? &out_off : NULL, len - done, 0);
+        if (n <= 0) break;
+        done += (uint64_t)n;
+    }
+    if (done == len) return 0;
+
+    if (to >= 0 && lseek(out_fd, (off_t)(to + done), SEEK_SET) < 0) return -1;
+    while (done < len) {
+        off_t off = (off_t)(from + done);
+        ssize_t n = sendfile(out_fd, in_fd, &off, len - done);
+        if (n <= 0) break;
+        done += (uint64_t)n;
+    }
+    if (done == len) return 0;
+
+    uint8_t* buffer = malloc(COPY_BUFFER);
+    if (!buffer) return -1;
+    while (done < len) {
+        size_t want = len - done < COPY_BUFFER ? len - done : COPY_BUFFER;
+        ssize_t got = pread(in_fd, buffer, want, (off_t)(from + done));
+        if (got <= 0) break;
+        ssize_t put = 0;
+        while (put < got) {
+            ssize_t n = write(out_fd, buffer + put, got - put);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            put += n;
+        }
+        if (put < got) break;
+        done += (uint64_t)got;
+    }
+    free(buffer);
+    return done == len ? 0 : -1;
+}
+
+// Writes the first `size` bytes mapped by runs, in file order
+static int copy_runs(int in_fd, const bitmap_extent_t* runs, int n_runs, uint64_t size, int out_fd, int positional) {
+    uint64_t file_offset = 0;
+    for (int r = 0; r < n_runs && file_offset < size; r++) {
+        uint64_t length = runs[r].length * BS;
+        if (length > size - file_offset) length = size - file_offset;
+        if (copy_range(in_fd, runs[r].start * BS, out_fd, positional ? (int64_t)file_offset : -1, length) != 0) {
+            return -1;
+        }
+        file_offset += length;
+    }
+    return file_offset == size ? 0 : -1;
+}
+
+// Writes len bytes to out_fd, at `to` or at the current file position when
+// `to` is negative
+static int write_bytes(int out_fd, const uint8_t* data, uint64_t len, int64_t to) {
+    for (uint64_t done = 0; done < len; ) {
+        ssize_t n = to >= 0 ? pwrite(out_fd, data + done, len - done, (off_t)(to + done))
+                            : write(out_fd, data + done, len - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        done += (uint64_t)n;
+    }
+    return 0;
+}
+
+typedef struct {
+    int in_fd;
+    const bitmap_extent_t* runs;
+    int n_runs;
+} stream_ctx_t;
+
+// Reads stream bytes of a compressed file through its block map
+static int fetch_stream(void* arg, uint64_t stream_offset, void* buf, size_t len) {
+    const stream_ctx_t* ctx = arg;
+    uint8_t* out = buf;
+    uint64_t run_first = 0;
+    for (int r = 0; r < ctx->n_runs && len > 0; r++) {
+        uint64_t run_bytes = ctx->runs[r].length * BS;
+        if (stream_offset < run_first + run_bytes) {
+            uint64_t in_run = stream_offset - run_first;
+            size_t n = run_bytes - in_run < len ? (size_t)(run_bytes - in_run) : len;
+            for (size_t done = 0; done < n; ) {
+                ssize_t got = pread(ctx->in_fd, out + done, n - done, (off_t)(ctx->runs[r].start * BS + in_run + done));
+                if (got < 0 && errno == EINTR) continue;
+                if (got <= 0) return -1;
+                done += (size_t)got;
+            }
+            out += n;
+            stream_offset += n;
+            len -= n;
+        }
+        run_first += run_bytes;
+    }
+    return len == 0 ? 0 : -1;
+}
+
+// Writes the decompressed contents of a compressed file, in file order
+static int copy_compressed(int in_fd, const bitmap_extent_t* runs, int n_runs, uint64_t size, uint64_t stream_len,
+                           int out_fd, int positional) {
+    stream_ctx_t ctx = { in_fd, runs, n_runs };
+    compress_reader_t reader;
+    if (compress_reader_init(&reader, fetch_stream, &ctx, size, stream_len) != 0) {
+        errno = EIO;
+        return -1;
+    }
+    uint8_t* buffer = malloc(COMPRESS_CHUNK);
+    int rc = buffer ? 0 : -1;
+    for (uint64_t pos = 0; rc == 0 && pos < size; ) {
+        int64_t n = compress_reader_read(&reader, pos, buffer, COMPRESS_CHUNK);
+        if (n <= 0) {
+            errno = EIO;
+            rc = -1;
+        } else if (write_bytes(out_fd, buffer, (uint64_t)n, positional ? (int64_t)pos : -1) != 0) {
+            rc = -1;
+        } else {
+            pos += (uint64_t)n;
+        }
+    }
+    free(buffer);
+    compress_reader_free(&reader);
+    return rc;
+}
+
+static int extract_one(image_t* img, const char* path, const char* output_name) {
+    dcache_t dcache;
+    dcache_init(&dcache);
+    int64_t inode_no = dir_resolve(img, &dcache, path);
+    dcache_free(&dcache);
+    if (inode_no <= 0) {
+        if (inode_no == 0) fprintf(stderr, "Error: '%s' not found in image\n", path);
+        return -1;
+    }
+    inode_t* inode = image_inode_peek(img, (uint64_t)inode_no);
+    if (!inode) return -1;
+    if ((inode->mode & 0170000) != MODE_FILE) {
+        fprintf(stderr, "Error: '%s' is not a regular file\n", path);
+        return -1;
+    }
+    uint64_t size = inode->size_bytes;
+    int inline_file = (inode->flags & INODE_FL_INLINE) != 0;
+    uint8_t small[INLINE_DATA_MAX];
+    if (inline_file) {
+        if (size > INLINE_DATA_MAX) {
+            fprintf(stderr, "Error: Inline inode %ld claims %lu bytes\n", inode_no, size);
+            return -1;
+        }
+        memcpy(small, inode_inline_data(inode), size);
+    }
+    int compressed = (inode->flags & INODE_FL_COMPRESSED) != 0;
+    uint64_t stream_len = inode_stored_bytes(inode);
+
+    bitmap_extent_t* runs;
+    int n_runs;
+    if (file_map(img, (uint32_t)inode_no, &runs, &n_runs) != 0) return -1;
+
+    int out_fd = STDOUT_FILENO;
+    if (output_name) {
+        out_fd = open(output_name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (out_fd < 0) {
+            fprintf(stderr, "Error: Cannot create '%s': %s\n", output_name, strerror(errno));
+            free(runs);
+            return -1;
+        }
+    }
+    int positional = output_name != NULL;
+    int rc;
+    if (inline_file) {
+        rc = write_bytes(out_fd, small, size, positional ? 0 : -1);
+    } else if (compressed) {
+        rc = copy_compressed(img->in_fd, runs, n_runs, size, stream_len, out_fd, positional);
+    } else {
+        rc = copy_runs(img->in_fd, runs, n_runs, size, out_fd, positional);
+    }
+    if (rc != 0) fprintf(stderr, "Error: Cannot copy '%s': %s\n", path, strerror(errno));
+    free(runs);
+    if (output_name && close(out_fd) != 0 && rc == 0) {
+        fprintf(stderr, "Error: Cannot write '%s': %s\n", output_name, strerror(errno));
+        rc = -1;
+    }
+    return rc;
+}
+
+// ==================================EXTRACT ALL=================================
+// --all walks the image serially, creating the host directories and
+// collecting each file's block map, then a pool of threads copies the files.
+
+typedef struct {
+    char* host_path;
+    uint64_t size;
+    bitmap_extent_t* runs;
+    int n_runs;
+    int inline_file;
+    uint8_t data[INLINE_DATA_MAX];   // contents of an inline file
+    int compressed;
+    uint64_t stream_len;             // bytes of a compressed file's stream
+} extract_job_t;
+
+typedef struct {
+    extract_job_t* jobs;
+    size_t job_count;
+    size_t job_capacity;
+    uint64_t dirs;
+    uint64_t bytes;
+} extract_plan_t;
+
+typedef struct {
+    char name[DIRENT_NAME_MAX + 1];
+    uint32_t inode_no;
+} child_t;
+
+typedef struct {
+    child_t* children;
+    size_t count;
+    size_t capacity;
+} child_list_t;
+
+static int collect_child(const dirent64_t* de, void* arg) {
+    child_list_t* list = arg;
+    if (list->count == list->capacity) {
+        size_t new_capacity = list->capacity ? list->capacity * 2 : 64;
+        child_t* grown = realloc(list->children, new_capacity * sizeof(child_t));
+        if (!grown) return -1;
+        list->children = grown;
+        list->capacity = new_capacity;
+    }
+    child_t* child = &list->children[list->count++];
+    memcpy(child->name, de->name, DIRENT_NAME_MAX);
+    child->name[DIRENT_NAME_MAX] = '\0';
+    child->inode_no = de->inode_no;
+    return 0;
+}
+
+static int plan_push(extract_plan_t* plan, char* host_path, inode_t* inode, bitmap_extent_t* runs, int n_runs) {
+    if (plan->job_count == plan->job_capacity) {
+        size_t new_capacity = plan->job_capacity ? plan->job_capacity * 2 : 256;
+        extract_job_t* grown = realloc(plan->jobs, new_capacity * sizeof(extract_job_t));
+        if (!grown) return -1;
+        plan->jobs = grown;
+        plan->job_capacity = new_capacity;
+    }
+    extract_job_t* job = &plan->jobs[plan->job_count++];
+    job->host_path = host_path;
+    job->size = inode->size_bytes;
+    job->runs = runs;
+    job->n_runs = n_runs;
+    job->inline_file = (inode->flags & INODE_FL_INLINE) != 0;
+    if (job->inline_file) memcpy(job->data, inode_inline_data(inode), inode->size_bytes);
+    job->compressed = (inode->flags & INODE_FL_COMPRESSED) != 0;
+    job->stream_len = inode_stored_bytes(inode);
+    plan->bytes += inode->size_bytes;
+    return 0;
+}
+
+static void plan_free(extract_plan_t* plan) {
+    for (size_t i = 0; i < plan->job_count; i++) {
+        free(plan->jobs[i].host_path);
+        free(plan->jobs[i].runs);
+    }
+    free(plan->jobs);
+}
+
+// Mirrors image directory dir_ino into host directory `path`
+static int plan_dir(image_t* img, extract_plan_t* plan, uint32_t dir_ino, const char* path) {
+    if (mkdir(path, 0777) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Error: Cannot create directory '%s': %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    child_list_t list = {0};
+    if (dir_iterate(img, dir_ino, collect_child, &list) != 0) {
+        fprintf(stderr, "Error: Cannot list directory inode %u\n", dir_ino);
+        free(list.children);
+        return -1;
+    }
+
+    int rc = 0;
+    for (size_t i = 0; rc == 0 && i < list.count; i++) {
+        const child_t* child = &list.children[i];
+        // A crafted image must not write outside the target directory
+        if (strchr(child->name, '/') || strcmp(child->name, ".") == 0 || strcmp(child->name, "..") == 0 ||
+            child->name[0] == '\0') {
+            fprintf(stderr, "Warning: Skipping entry '%s' in directory inode %u\n", child->name, dir_ino);
+            continue;
+        }
+
+        size_t host_len = strlen(path) + strlen(child->name) + 2;
+        char* host_path = malloc(host_len);
+        if (!host_path) {
+            fprintf(stderr, "Error: Memory allocation failed\n");
+            rc = -1;
+            break;
+        }
+        snprintf(host_path, host_len, "%s/%s", path, child->name);
+
+        inode_t* inode = image_inode_peek(img, child->inode_no);
+        if (!inode) {
+            rc = -1;
+        } else if ((inode->mode & 0170000) == MODE_DIR) {
+            plan->dirs++;
+            rc = plan_dir(img, plan, child->inode_no, host_path);
+        } else if ((inode->flags & INODE_FL_INLINE) && inode->size_bytes > INLINE_DATA_MAX) {
+            fprintf(stderr, "Error: Inline inode %u claims %lu bytes\n", child->inode_no, inode->size_bytes);
+            rc = -1;
+        } else {
+            bitmap_extent_t* runs;
+            int n_runs;
+            if (file_map(img, child->inode_no, &runs, &n_runs) != 0) {
+                rc = -1;
+            } else if (plan_push(plan, host_path, inode, runs, n_runs) != 0) {
+                fprintf(stderr, "Error: Memory allocation failed\n");
+                free(runs);
+                rc = -1;
+            } else {
+                host_path = NULL;  // owned by the plan now
+            }
+        }
+        free(host_path);
+    }
+    free(list.children);
+    return rc;
+}
+
+typedef struct {
+    const extract_plan_t* plan;
+    int image_fd;
+    atomic_size_t next;
+    atomic_int failed;
+} extract_pool_t;
+
+static void* extract_worker(void* arg) {
+    extract_pool_t* pool = arg;
+    while (!atomic_load(&pool->failed)) {
+        size_t i = atomic_fetch_add(&pool->next, 1);
+        if (i >= pool->plan->job_count) break;
+        const extract_job_t* job = &pool->plan->jobs[i];
+
+        int fd = open(job->host_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (fd < 0) {
+            fprintf(stderr, "Error: Cannot create '%s': %s\n", job->host_path, strerror(errno));
+            atomic_store(&pool->failed, 1);
+            break;
+        }
+        int rc;
+        if (job->inline_file) {
+            rc = write_bytes(fd, job->data, job->size, 0);
+        } else if (job->compressed) {
+            rc = copy_compressed(pool->image_fd, job->runs, job->n_runs, job->size, job->stream_len, fd, 1);
+        } else {
+            rc = copy_runs(pool->image_fd, job->runs, job->n_runs, job->size, fd, 1);
+        }
+        if (rc != 0) {
+            fprintf(stderr, "Error: Cannot copy '%s': %s\n", job->host_path, strerror(errno));
+            atomic_store(&pool->failed, 1);
+        }
+        if (close(fd) != 0) {
+            fprintf(stderr, "Error: Cannot write '%s': %s\n", job->host_path, strerror(errno));
+            atomic_store(&pool->failed, 1);
+        }
+    }
+    return NULL;
+}
+
+static int extract_all(image_t* img, const char* target, unsigned threads) {
+    extract_plan_t plan = {0};
+    if (plan_dir(img, &plan, ROOT_INO, target) != 0) {
+        plan_free(&plan);
+        return -1;
+    }
+
+    extract_pool_t pool;
+    pool.plan = &plan;
+    pool.image_fd = img->in_fd;
+    atomic_init(&pool.next, 0);
+    atomic_init(&pool.failed, 0);
+
+    if (threads > plan.job_count) threads = plan.job_count ? (unsigned)plan.job_count : 1;
+    pthread_t* tids = calloc(threads, sizeof(pthread_t));
+    if (!tids) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        plan_free(&plan);
+        return -1;
+    }
+    unsigned started = 0;
+    for (; started < threads; started++) {
+        if (pthread_create(&tids[started], NULL, extract_worker, &pool) != 0) break;
+    }
+    if (started == 0) extract_worker(&pool);
+    for (unsigned t = 0; t < started; t++) pthread_join(tids[t], NULL);
+    free(tids);
+
+    int rc = atomic_load(&pool.failed) ? -1 : 0;
+    if (rc == 0) {
+        printf("Extracted %zu files (%lu bytes) and %lu directories to '%s' (copy threads: %u)\n",
+               plan.job_count, plan.bytes, plan.dirs, target, started ? started : 1);
+    }
+    plan_free(&plan);
+    return rc;
+}
+
+int main(int argc, char* argv[]) {
+    crc32_init();
+
+    char* image_name = NULL;
+    char* file_name = NULL;
+    char* output_name = NULL;
+    char* all_target = NULL;
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned threads = online > 0 ? (unsigned)online : 1;
+
+    static struct option long_options[] = {
+        {"image", required_argument, 0, 'i'},
+        {"file", required_argument, 0, 'f'},
+        {"output", required_argument, 0, 'o'},
+        {"all", required_argument, 0, 'a'},
+        {"jobs", required_argument, 0, 'j'},
+        {0, 0, 0, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'i':
+                image_name = optarg;
+                break;
+            case 'f':
+                file_name = optarg;
+                break;
+            case 'o':
+                output_name = optarg;
+                break;
+            case 'a':
+                all_target = optarg;
+                break;
+            case 'j': {
+                char* end;
+                unsigned long n = strtoul(optarg, &end, 10);
+                if (*end != '\0' || n == 0 || n > 1024) {
+                    fprintf(stderr, "Error: Invalid --jobs value '%s'\n", optarg);
+                    return 1;
+                }
+                threads = (unsigned)n;
+                break;
+            }
+            default:
+                print_usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (!image_name || (!file_name == !all_target) || (all_target && output_name)) {
+        fprintf(stderr, "Error: --image and exactly one of --file or --all are required\n");
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    image_t img;
+    int status = image_open(&img, image_name, NULL, 0) == 0 ? 0 : 1;
+    if (status == 0) {
+        int rc = all_target ? extract_all(&img, all_target, threads) : extract_one(&img, file_name, output_name);
+        if (rc != 0) status = 1;
+    }
+    image_close(&img);
+    return status;
+}
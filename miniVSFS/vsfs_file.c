@@ -0,0 +1,307 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "vsfs_file.h"
+#include "vsfs_dedup.h"
+
+// Undoes the allocations of a failed file_create and frees the run list
+static void release_runs(image_t* img, bitmap_extent_t* runs, int n_runs) {
+    for (int r = 0; r < n_runs; r++) image_free_run(img, runs[r].start, runs[r].length);
+    free(runs);
+}
+
+size_t file_max_runs(const image_t* img) {
+    return img->sb.version >= VSFS_VERSION_EXTENTS ? INLINE_EXTENTS + EXTENT_BLOCK_MAX : DIRECT_MAX;
+}
+
+// Allocates the inode (and overflow extent block) of a new regular file mapped
+// by runs and fills it in. On failure the inode and extent block are released
+// again; the runs are left to the caller.
+static int64_t build_inode(image_t* img, const char* name, uint64_t size, const void* inline_data, int use_inline,
+                           const bitmap_extent_t* runs, int n_runs) {
+    int use_extents = img->sb.version >= VSFS_VERSION_EXTENTS;
+    uint64_t extent_block_no = 0;
+    if (use_extents && n_runs > INLINE_EXTENTS) {
+        extent_block_no = image_alloc_block(img);
+        if (!extent_block_no) {
+            fprintf(stderr, "Error: No free data block left for the extent block of '%s'\n", name);
+            return -1;
+        }
+    }
+    
+    uint32_t inode_no = image_alloc_inode(img);
+    if (inode_no == 0) {
+        fprintf(stderr, "Error: No free inodes available\n");
+        if (extent_block_no) image_free_run(img, extent_block_no, 1);
+        return -1;
+    }
+    
+    inode_t* inode = image_inode(img, inode_no);
+    if (!inode) {
+        image_free_inode(img, inode_no);
+        if (extent_block_no) image_free_run(img, extent_block_no, 1);
+        return -1;
+    }
+    memset(inode, 0, sizeof(inode_t));
+    inode->mode = MODE_FILE;
+    inode->links = 1;
+    inode->uid = 0;
+    inode->gid = 0;
+    inode->size_bytes = size;
+    time_t now = time(NULL);
+    inode->atime = now;
+    inode->mtime = now;
+    inode->ctime = now;
+    
+    if (use_inline) {
+        inode->flags = INODE_FL_INLINE;
+        if (size) memcpy(inode_inline_data(inode), inline_data, size);
+    } else if (use_extents) {
+        inode->flags = INODE_FL_EXTENTS;
+        extent_block_t* overflow = NULL;
+        if (extent_block_no) {
+            overflow = (extent_block_t*)image_block_zeroed(img, extent_block_no);
+            if (!overflow) {
+                memset(inode, 0, sizeof(inode_t));
+                image_free_inode(img, inode_no);
+                image_free_run(img, extent_block_no, 1);
+                return -1;
+            }
+            overflow->magic = EXTENT_BLOCK_MAGIC;
+            overflow->owner = inode_no;
+            inode->xattr_ptr = extent_block_no;
+        }
+        for (int r = 0; r < n_runs; r++) {
+            extent_t* ext = r < INLINE_EXTENTS ? &inode->extents[r]
+                                               : &overflow->extents[overflow->count++];
+            ext->start = (uint32_t)runs[r].start;
+            ext->length = (uint32_t)runs[r].length;
+        }
+        if (overflow) extent_block_crc_finalize(overflow);
+    } else {
+        uint64_t i = 0;
+        for (int r = 0; r < n_runs; r++) {
+            for (uint64_t b = 0; b < runs[r].length; b++, i++) {
+                inode->direct[i] = (uint32_t)(runs[r].start + b);
+            }
+        }
+    }
+    inode_crc_finalize(inode);
+    return inode_no;
+}
+
+int64_t file_create(image_t* img, const char* name, uint64_t size, const void* inline_data,
+                    bitmap_extent_t** runs_out, int* n_runs_out) {
+    superblock_t* superblock = &img->sb;
+    int use_extents = superblock->version >= VSFS_VERSION_EXTENTS;
+    int use_inline = use_extents && size <= INLINE_DATA_MAX && (inline_data || size == 0);
+    uint64_t blocks_needed = use_inline ? 0 : (size + BS - 1) / BS;
+    if (!use_extents && blocks_needed > DIRECT_MAX) {
+        fprintf(stderr, "Error: File '%s' is too large (max %dKB with %d direct blocks)\n", 
+                name, (DIRECT_MAX * BS) / 1024, DIRECT_MAX);
+        return -1;
+    }
+    
+    // Version 1 images map each block through direct[]; later versions store
+    // runs, spilling into one extent block when they don't fit in the inode
+    size_t max_runs = file_max_runs(img);
+    bitmap_extent_t* runs = malloc(max_runs * sizeof(bitmap_extent_t));
+    if (!runs) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return -1;
+    }
+    int n_runs = blocks_needed ? image_alloc_extents(img, blocks_needed, runs, max_runs) : 0;
+    if (n_runs < 0) {
+        uint64_t free_blocks = image_free_blocks(img);
+        if (free_blocks >= blocks_needed && img->shared && img->shards_busy) {
+            fprintf(stderr, "Error: The %lu free blocks '%s' needs are in shards other writers hold\n",
+                    blocks_needed, name);
+        } else if (free_blocks >= blocks_needed) {
+            fprintf(stderr, "Error: Free space is too fragmented to map '%s' (more than %zu extents)\n",
+                    name, max_runs);
+        } else {
+            fprintf(stderr, "Error: Not enough free data blocks (need %lu, found %lu)\n",
+                    blocks_needed, free_blocks);
+        }
+        free(runs);
+        return -1;
+    }
+    
+    int64_t inode_no = build_inode(img, name, size, inline_data, use_inline, runs, n_runs);
+    if (inode_no < 0) {
+        release_runs(img, runs, n_runs);
+        return -1;
+    }
+    
+    *runs_out = runs;
+    *n_runs_out = n_runs;
+    return inode_no;
+}
+
+int64_t file_create_mapped(image_t* img, const char* name, uint64_t size, const bitmap_extent_t* runs, int n_runs) {
+    uint64_t blocks = 0;
+    for (int r = 0; r < n_runs; r++) blocks += runs[r].length;
+    if ((size_t)n_runs > file_max_runs(img) || (img->sb.version < VSFS_VERSION_EXTENTS && blocks > DIRECT_MAX) ||
+        blocks != (size + BS - 1) / BS) {
+        fprintf(stderr, "Error: Cannot map '%s' onto %lu blocks in %d runs\n", name, blocks, n_runs);
+        return -1;
+    }
+    return build_inode(img, name, size, NULL, 0, runs, n_runs);
+}
+
+int64_t file_create_compressed(image_t* img, const char* name, uint64_t size, const uint8_t* stream,
+                               uint64_t stream_len) {
+    if (img->sb.version < VSFS_VERSION_EXTENTS) {
+        fprintf(stderr, "Error: Cannot store '%s' compressed in a version %u image\n", name, img->sb.version);
+        return -1;
+    }
+    bitmap_extent_t* runs;
+    int n_runs;
+    int64_t inode_no = file_create(img, name, stream_len, NULL, &runs, &n_runs);
+    if (inode_no < 0) return -1;
+
+    uint64_t pos = 0;
+    for (int r = 0; r < n_runs; r++) {
+        for (uint64_t b = 0; b < runs[r].length; b++) {
+            uint8_t* block = image_block_zeroed(img, runs[r].start + b);
+            if (!block) {
+                free(runs);
+                file_release(img, (uint32_t)inode_no);
+                return -1;
+            }
+            size_t n = stream_len - pos < BS ? stream_len - pos : BS;
+            memcpy(block, stream + pos, n);
+            pos += n;
+        }
+    }
+    free(runs);
+
+    inode_t* inode = image_inode(img, (uint32_t)inode_no);
+    if (!inode) {
+        file_release(img, (uint32_t)inode_no);
+        return -1;
+    }
+    inode->size_bytes = size;
+    inode->flags |= INODE_FL_COMPRESSED;
+    inode->reserved_0 = (uint32_t)stream_len;
+    inode->reserved_1 = (uint32_t)(stream_len >> 32);
+    inode_crc_finalize(inode);
+    return inode_no;
+}
+
+// Appends a run, merging it into the previous one when they touch
+static void push_run(bitmap_extent_t* runs, int* n_runs, uint64_t start, uint64_t length) {
+    if (*n_runs > 0 && runs[*n_runs - 1].start + runs[*n_runs - 1].length == start) {
+        runs[*n_runs - 1].length += length;
+    } else {
+        runs[(*n_runs)++] = (bitmap_extent_t){ start, length };
+    }
+}
+
+int file_map(image_t* img, uint32_t inode_no, bitmap_extent_t** runs_out, int* n_runs_out) {
+    inode_t* inode = image_inode_peek(img, inode_no);
+    if (!inode) return -1;
+    if ((inode->mode & 0170000) != MODE_FILE) {
+        fprintf(stderr, "Error: Inode %u is not a regular file\n", inode_no);
+        return -1;
+    }
+
+    const extent_block_t* overflow = NULL;
+    if ((inode->flags & INODE_FL_EXTENTS) && inode->xattr_ptr) {
+        overflow = (const extent_block_t*)image_block(img, inode->xattr_ptr);
+        if (!overflow) return -1;
+        if (overflow->magic != EXTENT_BLOCK_MAGIC || overflow->owner != inode_no ||
+            overflow->count > EXTENT_BLOCK_MAX) {
+            fprintf(stderr, "Error: Corrupt extent block %lu in inode %u\n", inode->xattr_ptr, inode_no);
+            return -1;
+        }
+    }
+
+    bitmap_extent_t* runs = malloc((INLINE_EXTENTS + EXTENT_BLOCK_MAX) * sizeof(bitmap_extent_t));
+    if (!runs) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return -1;
+    }
+    int n_runs = 0;
+    if (inode->flags & INODE_FL_INLINE) {
+        // Nothing mapped: the data is in the inode
+    } else if (inode->flags & INODE_FL_EXTENTS) {
+        for (int i = 0; i < INLINE_EXTENTS && inode->extents[i].length; i++) {
+            push_run(runs, &n_runs, inode->extents[i].start, inode->extents[i].length);
+        }
+        for (uint32_t i = 0; overflow && i < overflow->count; i++) {
+            push_run(runs, &n_runs, overflow->extents[i].start, overflow->extents[i].length);
+        }
+    } else {
+        uint64_t blocks = (inode->size_bytes + BS - 1) / BS;
+        for (uint64_t i = 0; i < blocks && i < DIRECT_MAX && inode->direct[i]; i++) {
+            push_run(runs, &n_runs, inode->direct[i], 1);
+        }
+    }
+
+    for (int r = 0; r < n_runs; r++) {
+        if (runs[r].start < img->sb.data_region_start ||
+            runs[r].start + runs[r].length > img->sb.data_region_start + img->sb.data_region_blocks) {
+            fprintf(stderr, "Error: Inode %u maps blocks outside the data region\n", inode_no);
+            free(runs);
+            return -1;
+        }
+    }
+    *runs_out = runs;
+    *n_runs_out = n_runs;
+    return 0;
+}
+
+int file_remap(image_t* img, uint32_t inode_no, uint64_t start, uint64_t count, uint64_t* extent_block) {
+    inode_t* inode = image_inode(img, inode_no);
+    if (!inode) return -1;
+    if (inode->flags & INODE_FL_INLINE || count > UINT32_MAX ||
+        (!(inode->flags & INODE_FL_EXTENTS) && count > DIRECT_MAX)) {
+        fprintf(stderr, "Error: Cannot map inode %u onto %lu contiguous blocks\n", inode_no, count);
+        return -1;
+    }
+
+    *extent_block = 0;
+    if (inode->flags & INODE_FL_EXTENTS) {
+        *extent_block = inode->xattr_ptr;
+        inode->xattr_ptr = 0;
+        memset(inode->extents, 0, sizeof(inode->extents));
+        inode->extents[0].start = (uint32_t)start;
+        inode->extents[0].length = (uint32_t)count;
+    } else {
+        for (uint64_t i = 0; i < count; i++) inode->direct[i] = (uint32_t)(start + i);
+    }
+    inode_crc_finalize(inode);
+    return 0;
+}
+
+int file_release(image_t* img, uint32_t inode_no) {
+    inode_t* inode = image_inode(img, inode_no);
+    if (!inode) return -1;
+    if (inode->links > 1) {
+        inode->links--;
+        inode->ctime = time(NULL);
+        inode_crc_finalize(inode);
+        return 0;
+    }
+
+    bitmap_extent_t* runs;
+    int n_runs;
+    if (file_map(img, inode_no, &runs, &n_runs) != 0) return -1;
+    // Deduplicated blocks are only freed with their last owner
+    for (int r = 0; r < n_runs; r++) {
+        if (!(img->sb.flags & SB_FLAG_DEDUP)) {
+            image_free_run(img, runs[r].start, runs[r].length);
+        } else if (dedup_free_run(img, runs[r].start, runs[r].length) != 0) {
+            free(runs);
+            return -1;
+        }
+    }
+    free(runs);
+    if ((inode->flags & INODE_FL_EXTENTS) && inode->xattr_ptr) image_free_run(img, inode->xattr_ptr, 1);
+
+    memset(inode, 0, sizeof(inode_t));
+    image_free_inode(img, inode_no);
+    return 0;
+}
@@ -0,0 +1,56 @@
+#ifndef MINIVSFS_FILE_H
+#define MINIVSFS_FILE_H
+
+#include <stdint.h>
+#include "bitmap.h"
+#include "vsfs_image.h"
+
+// Allocates an inode and the data blocks for a regular file of `size` bytes
+// and fills in the inode: extents (spilling into an overflow extent block) on
+// version 2 images, direct[] on version 1. The data itself is left to the
+// caller, which gets the runs in file order as absolute block numbers in
+// *runs and must free them. `name` is only used in error messages.
+//
+// On version 2 images a file of at most INLINE_DATA_MAX bytes whose contents
+// are passed in inline_data is stored in the inode instead, as is any empty
+// file; *n_runs is then 0. inline_data may be NULL, or longer than the file.
+// Returns the new inode number, or -1 on error with every allocation undone.
+int64_t file_create(image_t* img, const char* name, uint64_t size, const void* inline_data,
+                    bitmap_extent_t** runs, int* n_runs);
+
+// Most runs a regular file can be mapped with on this image
+size_t file_max_runs(const image_t* img);
+
+// Creates a regular file of `size` bytes over blocks the caller already
+// allocated and filled, given as runs of absolute block numbers in file
+// order. Returns the new inode number, or -1 on error; the blocks stay the
+// caller's to release then.
+int64_t file_create_mapped(image_t* img, const char* name, uint64_t size, const bitmap_extent_t* runs, int n_runs);
+
+// Creates a regular file of `size` bytes kept as the compressed stream built
+// by compress_stream(): blocks are allocated for stream_len bytes, the stream
+// is copied into them through the cache and the inode gets
+// INODE_FL_COMPRESSED. Version 2 images only. Returns the new inode number,
+// or -1 on error with every allocation undone.
+int64_t file_create_compressed(image_t* img, const char* name, uint64_t size, const uint8_t* stream,
+                               uint64_t stream_len);
+
+// Collects the data blocks of a regular file as runs of absolute block
+// numbers in file order, merging extents or direct[] blocks that touch on
+// disk; an inline file has none. The caller frees *runs.
+int file_map(image_t* img, uint32_t inode_no, bitmap_extent_t** runs, int* n_runs);
+
+// Maps a regular file onto `count` contiguous blocks from absolute block
+// `start`, which must already hold its data in file order (count being the
+// number of blocks it maps now). A single extent needs no overflow block:
+// the one it had, if any, is returned in *extent_block (0 otherwise) for the
+// caller to free. The old blocks are left to the caller too.
+int file_remap(image_t* img, uint32_t inode_no, uint64_t start, uint64_t count, uint64_t* extent_block);
+
+// Drops one link to a regular file; on the last one its data blocks, extent
+// block and inode go back to the free pools and the inode is zeroed. On a
+// deduplicated image a data block shared with other files only loses one
+// reference.
+int file_release(image_t* img, uint32_t inode_no);
+
+#endif
@@ -0,0 +1,437 @@
+#ifndef MINIVSFS_FORMAT_H
+#define MINIVSFS_FORMAT_H
+
+// On-disk format shared by every MiniVSFS tool
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "crc32.h"
+
+#define BS 4096u
+#define INODE_SIZE 128u
+#define ROOT_INO 1u
+#define DIRECT_MAX 12
+
+#define VSFS_MAGIC 0x4D565346
+
+// Version 1 maps file data only through inode.direct[]. Version 2 adds
+// extent-mapped inodes (INODE_FL_EXTENTS); version 1 inodes stay valid in it.
+#define VSFS_VERSION_DIRECT  1
+#define VSFS_VERSION_EXTENTS 2
+#define VSFS_VERSION         VSFS_VERSION_EXTENTS
+
+// Superblock flags
+#define SB_FLAG_LAZY_ITABLE 0x1   // inode table blocks past the first were never zeroed;
+                                  // only inodes marked in the inode bitmap are meaningful
+#define SB_FLAG_JOURNAL     0x2   // the blocks after the data region hold a metadata journal
+#define SB_FLAG_DEDUP       0x4   // block reference counts and a dedup index follow the data region
+#define SB_FLAG_SUMMARY     0x8   // free-space counters (and allocation groups) follow the superblock
+
+#pragma pack(push, 1)
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t total_blocks;
+    uint64_t inode_count;
+    uint64_t inode_bitmap_start;
+    uint64_t inode_bitmap_blocks;
+    uint64_t data_bitmap_start;
+    uint64_t data_bitmap_blocks;
+    uint64_t inode_table_start;
+    uint64_t inode_table_blocks;
+    uint64_t data_region_start;
+    uint64_t data_region_blocks;
+    uint64_t root_inode;
+    uint64_t mtime_epoch;
+    uint32_t flags;
+
+    // THIS FIELD SHOULD STAY AT THE END
+    // ALL OTHER FIELDS SHOULD BE ABOVE THIS
+    uint32_t checksum;                // crc32(superblock[0..4091])
+} superblock_t;
+#pragma pack(pop)
+_Static_assert(sizeof(superblock_t) == 116, "superblock must fit in one block");
+
+// Free-space summary (SB_FLAG_SUMMARY).
+//
+// The superblock checksum covers the whole of block 0, so the space after the
+// superblock holds a summary_t at SUMMARY_OFFSET and then `groups`
+// group_desc_t entries. free_blocks and free_inodes always equal the clear
+// bits of the data and inode bitmaps, so a capacity check needs no scan.
+//
+// With groups > 0 the inodes and data blocks are split into allocation
+// groups, like ext block groups laid over the existing regions: group g owns
+// inodes from g * inodes_per_group + 1 and data blocks from data_region_start
+// + g * blocks_per_group, so a contiguous slice of each bitmap and of the
+// inode table, and its descriptor counts what is free in it. A new file takes
+// its inode and blocks from its directory's group while that has room; a new
+// directory goes to the group with the most free blocks.
+#define SUMMARY_MAGIC  0x55535356   // "VSSU"
+#define SUMMARY_OFFSET 128
+
+#pragma pack(push,1)
+typedef struct {
+    uint32_t magic;
+    uint32_t groups;                  // 0: counters only
+    uint64_t free_blocks;
+    uint64_t free_inodes;
+    uint32_t blocks_per_group;        // a multiple of 64
+    uint32_t inodes_per_group;        // a multiple of the inodes per table block
+} summary_t;
+
+typedef struct {
+    uint32_t free_blocks;
+    uint32_t free_inodes;
+} group_desc_t;
+#pragma pack(pop)
+_Static_assert(SUMMARY_OFFSET >= 116 && sizeof(summary_t) == 32, "summary layout mismatch");
+
+// Descriptors that fit in the checksummed part of block 0
+#define GROUPS_MAX ((BS - 4 - SUMMARY_OFFSET - sizeof(summary_t)) / sizeof(group_desc_t))
+
+// Data blocks and inodes of group g; the last group may be short, and groups
+// past the inode count have no inodes
+static inline uint64_t group_data_blocks(const superblock_t* sb, const summary_t* s, uint32_t g) {
+    uint64_t first = (uint64_t)g * s->blocks_per_group;
+    if (first >= sb->data_region_blocks) return 0;
+    uint64_t left = sb->data_region_blocks - first;
+    return left < s->blocks_per_group ? left : s->blocks_per_group;
+}
+
+static inline uint64_t group_inodes(const superblock_t* sb, const summary_t* s, uint32_t g) {
+    uint64_t first = (uint64_t)g * s->inodes_per_group;
+    if (first >= sb->inode_count) return 0;
+    uint64_t left = sb->inode_count - first;
+    return left < s->inodes_per_group ? left : s->inodes_per_group;
+}
+
+static inline int summary_valid(const superblock_t* sb, const summary_t* s) {
+    if (s->magic != SUMMARY_MAGIC || s->free_blocks > sb->data_region_blocks || s->free_inodes > sb->inode_count) {
+        return 0;
+    }
+    if (s->groups == 0) return 1;
+    return s->groups <= GROUPS_MAX && s->blocks_per_group > 0 && s->blocks_per_group % 64 == 0 &&
+           s->inodes_per_group > 0 && s->inodes_per_group % (BS / INODE_SIZE) == 0 &&
+           (uint64_t)s->groups * s->blocks_per_group >= sb->data_region_blocks &&
+           (uint64_t)(s->groups - 1) * s->blocks_per_group < sb->data_region_blocks &&
+           (uint64_t)s->groups * s->inodes_per_group >= sb->inode_count;
+}
+
+// A run of `length` blocks starting at absolute block number `start`
+#pragma pack(push,1)
+typedef struct {
+    uint32_t start;
+    uint32_t length;
+} extent_t;
+#pragma pack(pop)
+_Static_assert(sizeof(extent_t) == 8, "extent size mismatch");
+
+#define INLINE_EXTENTS (DIRECT_MAX * 4 / 8)
+
+// Inode flags
+#define INODE_FL_EXTENTS 0x1   // direct[] holds extent_t runs, see below
+#define INODE_FL_INDEX   0x2   // directory with a hashed name index at xattr_ptr, see dx_header_t
+#define INODE_FL_INLINE  0x4   // regular file whose data lives in the inode, see inode_inline_data()
+#define INODE_FL_COMPRESSED 0x8   // regular file whose blocks hold a compressed stream, see compress_header_t
+
+#pragma pack(push,1)
+typedef struct {
+    uint16_t mode;
+    uint16_t links;
+    uint32_t uid;
+    uint32_t gid;
+    uint64_t size_bytes;
+    uint64_t atime;
+    uint64_t mtime;
+    uint64_t ctime;
+    union {
+        uint32_t direct[DIRECT_MAX];
+        // With INODE_FL_EXTENTS: up to INLINE_EXTENTS runs in file order, the
+        // first zero-length entry ending the list. Further runs continue in
+        // the extent block at xattr_ptr.
+        extent_t extents[INLINE_EXTENTS];
+    };
+    uint32_t reserved_0;
+    uint32_t reserved_1;
+    uint32_t flags;                   // INODE_FL_*; reserved_2 in version 1
+    uint32_t proj_id;
+    uint32_t uid16_gid16;
+    uint64_t xattr_ptr;               // overflow extent block, or 0
+
+    // THIS FIELD SHOULD STAY AT THE END
+    // ALL OTHER FIELDS SHOULD BE ABOVE THIS
+    uint64_t inode_crc;   // low 4 bytes store crc32 of bytes [0..119]; high 4 bytes 0
+
+} inode_t;
+#pragma pack(pop)
+_Static_assert(sizeof(inode_t)==INODE_SIZE, "inode size mismatch");
+
+// With INODE_FL_INLINE (version 2 only) the file has no data blocks: its
+// size_bytes bytes are stored from direct[0] on, running on into reserved_0
+// and reserved_1
+#define INLINE_DATA_MAX (DIRECT_MAX * 4 + 8)
+_Static_assert(offsetof(inode_t, reserved_1) + 4 - offsetof(inode_t, direct) == INLINE_DATA_MAX,
+               "inline data area mismatch");
+
+static inline uint8_t* inode_inline_data(inode_t* inode) {
+    return (uint8_t*)inode->direct;
+}
+
+// Compressed files (version 2 only, always with INODE_FL_EXTENTS). The data
+// blocks hold a stream of inode_stored_bytes() bytes instead of the file's
+// size_bytes: this header, then chunks + 1 little-endian uint64_t chunk
+// offsets, then the chunks. The file is cut into COMPRESS_CHUNK-byte chunks
+// (the last one shorter), each compressed on its own in the LZ4 block format
+// so a read decompresses only the chunks it touches. Chunk i occupies stream
+// bytes [offsets[i], offsets[i + 1]); a chunk whose stored length equals its
+// uncompressed length is stored raw.
+#define COMPRESS_MAGIC 0x5A435356   // "VSCZ"
+#define COMPRESS_CHUNK (64u << 10)
+
+#pragma pack(push,1)
+typedef struct {
+    uint32_t magic;
+    uint32_t chunk_size;              // COMPRESS_CHUNK
+    uint64_t chunks;                  // ceil(size_bytes / chunk_size)
+} compress_header_t;
+#pragma pack(pop)
+_Static_assert(sizeof(compress_header_t) == 16, "compress header size mismatch");
+
+// Bytes of the data blocks in use: the stream length of a compressed file,
+// kept in reserved_0 (low half) and reserved_1 (high half), else size_bytes
+static inline uint64_t inode_stored_bytes(const inode_t* inode) {
+    if (!(inode->flags & INODE_FL_COMPRESSED)) return inode->size_bytes;
+    return inode->reserved_0 | (uint64_t)inode->reserved_1 << 32;
+}
+
+// Overflow extents of one inode, referenced from inode.xattr_ptr
+#define EXTENT_BLOCK_MAGIC 0x58455356   // "VSEX"
+#define EXTENT_BLOCK_MAX   ((BS - 16) / sizeof(extent_t))
+
+#pragma pack(push,1)
+typedef struct {
+    uint32_t magic;
+    uint32_t count;                   // used entries in extents[]
+    uint32_t owner;                   // inode number, for consistency checks
+    uint32_t checksum;                // crc32 of the block with this field zeroed
+    extent_t extents[EXTENT_BLOCK_MAX];
+} extent_block_t;
+#pragma pack(pop)
+_Static_assert(sizeof(extent_block_t) == BS, "extent block size mismatch");
+
+// Hashed directory index (version 2 only).
+//
+// direct[0] of every directory is its first block, holding "." and ".." and
+// up to 62 more entries that are found by a linear scan. Once that block is
+// full the directory gets INODE_FL_INDEX and xattr_ptr points at a table of
+// 1 << depth leaf block numbers, stored right after this header in
+// dx_table_blocks(depth) contiguous blocks. A name lives in the leaf at
+// table[dirent_name_hash(name) & ((1 << depth) - 1)]; leaves are plain blocks
+// of 64 dirents. Several table slots share a leaf until it fills and is split
+// (extendible hashing), and the table doubles when a leaf that splits has
+// only one slot pointing at it.
+#define DX_MAGIC     0x58445356   // "VSDX"
+#define DX_MAX_DEPTH 16
+
+#pragma pack(push,1)
+typedef struct {
+    uint32_t magic;
+    uint32_t depth;                   // the table holds 1 << depth leaf block numbers
+    uint32_t owner;                   // directory inode number
+    uint32_t checksum;                // crc32 of header + table with this field zeroed
+} dx_header_t;
+#pragma pack(pop)
+_Static_assert(sizeof(dx_header_t) == 16, "dx header size mismatch");
+
+static inline uint64_t dx_table_blocks(uint32_t depth) {
+    return (sizeof(dx_header_t) + (sizeof(uint32_t) << depth) + BS - 1) / BS;
+}
+
+// Block deduplication (SB_FLAG_DEDUP).
+//
+// The data region is followed by a reference count table, one uint16_t per
+// data block, and then by a hash index of dedup_entry_t slots, one slot per
+// data block. A count of 0 means the block is free or has a single owner that
+// was written without deduplication; blocks written in dedup mode count their
+// owners, and only those are ever shared. Freeing a block drops one count and
+// returns it to the data bitmap once no owner is left.
+//
+// The index maps the crc32 of a block's contents to a block holding them. A
+// block lives in one of the DEDUP_PROBE slots from crc % slots on; when all
+// of them are taken the first is overwritten. Lookups compare contents and
+// check the reference count before sharing, so stale or lost entries only
+// cost a missed match and the index never has to be exact.
+#pragma pack(push,1)
+typedef struct {
+    uint32_t hash;                    // crc32 of the block
+    uint32_t block;                   // absolute block number, 0 for an empty slot
+} dedup_entry_t;
+#pragma pack(pop)
+
+#define DEDUP_REFS_PER_BLOCK    (BS / sizeof(uint16_t))
+#define DEDUP_ENTRIES_PER_BLOCK (BS / sizeof(dedup_entry_t))
+#define DEDUP_PROBE             8
+
+static inline uint64_t dedup_refcount_blocks_for(uint64_t data_blocks) {
+    return (data_blocks + DEDUP_REFS_PER_BLOCK - 1) / DEDUP_REFS_PER_BLOCK;
+}
+
+static inline uint64_t dedup_index_blocks_for(uint64_t data_blocks) {
+    return (data_blocks + DEDUP_ENTRIES_PER_BLOCK - 1) / DEDUP_ENTRIES_PER_BLOCK;
+}
+
+// First block of the reference count table; the index follows it
+static inline uint64_t dedup_start(const superblock_t* sb) {
+    return sb->data_region_start + sb->data_region_blocks;
+}
+
+static inline uint64_t dedup_blocks(const superblock_t* sb) {
+    if (!(sb->flags & SB_FLAG_DEDUP)) return 0;
+    return dedup_refcount_blocks_for(sb->data_region_blocks) + dedup_index_blocks_for(sb->data_region_blocks);
+}
+
+// Metadata journal (SB_FLAG_JOURNAL).
+//
+// The journal fills the blocks from journal_start() (right after the data
+// region, or after the dedup tables) to the end of the image: a header block,
+// then a ring of transactions. Each
+// transaction is one or more descriptor blocks, each followed by the copies
+// of the blocks its logged entries name, and then a commit block.
+//
+// Entries flagged JOURNAL_FL_IN_PLACE name blocks that were free before the
+// transaction (new file data, new directory blocks). They are written straight
+// to their final place instead of being copied, and the commit block carries
+// a crc of their contents so a transaction whose in-place blocks never reached
+// the disk is discarded as a whole.
+//
+// Logged copies, in-place blocks and the commit are made durable by one
+// fdatasync; only then are the logged blocks written to their final place.
+// On open the newest complete transaction is replayed, preceded by the one
+// before it when replay_prev is set, since that one's in-place writes may not
+// have been durable yet when the crash happened.
+#define JOURNAL_MAGIC        0x484A5356   // "VSJH"
+#define JOURNAL_DESC_MAGIC   0x444A5356   // "VSJD"
+#define JOURNAL_COMMIT_MAGIC 0x434A5356   // "VSJC"
+#define JOURNAL_MIN_BLOCKS   8
+
+#pragma pack(push,1)
+typedef struct {
+    uint32_t magic;
+    uint32_t checksum;                // crc32 of the block with this field zeroed
+    uint64_t blocks;                  // journal size including this header
+} journal_header_t;
+
+#define JOURNAL_FL_IN_PLACE 0x1
+
+typedef struct {
+    uint64_t start;                   // absolute block number
+    uint32_t count;
+    uint32_t flags;                   // JOURNAL_FL_*
+} journal_entry_t;
+
+#define JOURNAL_DESC_ENTRIES ((BS - 32) / sizeof(journal_entry_t))
+
+typedef struct {
+    uint32_t magic;
+    uint32_t checksum;                // crc32 of the block with this field zeroed
+    uint64_t seq;                     // transaction sequence number
+    uint32_t index;                   // position among the transaction's descriptors
+    uint32_t count;                   // used entries
+    uint32_t last;                    // 1 on the transaction's final descriptor
+    uint32_t reserved;
+    journal_entry_t entries[JOURNAL_DESC_ENTRIES];
+} journal_desc_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t checksum;                // crc32 of the block with this field zeroed
+    uint64_t seq;
+    uint64_t blocks;                  // descriptor and copy blocks before this one
+    uint32_t journal_crc;             // crc32 over those blocks
+    uint32_t in_place_crc;            // crc32 over the in-place blocks, in entry order
+    uint32_t replay_prev;             // the previous transaction must be replayed first
+    uint32_t reserved;
+} journal_commit_t;
+#pragma pack(pop)
+_Static_assert(sizeof(journal_desc_t) == BS, "journal descriptor size mismatch");
+
+static inline uint64_t journal_start(const superblock_t* sb) {
+    return dedup_start(sb) + dedup_blocks(sb);
+}
+
+static inline uint64_t journal_blocks(const superblock_t* sb) {
+    return (sb->flags & SB_FLAG_JOURNAL) ? sb->total_blocks - journal_start(sb) : 0;
+}
+
+// Checksums a journal header, descriptor or commit block; each keeps its
+// checksum in bytes [4..7]
+static inline uint32_t journal_block_crc_finalize(uint8_t* block) {
+    memset(block + 4, 0, 4);
+    uint32_t c = crc32(block, BS);
+    memcpy(block + 4, &c, 4);
+    return c;
+}
+
+#pragma pack(push,1)
+typedef struct {
+    uint32_t inode_no;
+    uint8_t type;
+    char name[58];
+
+    uint8_t  checksum;
+} dirent64_t;
+#pragma pack(pop)
+_Static_assert(sizeof(dirent64_t)==64, "dirent size mismatch");
+
+// File modes
+#define MODE_FILE 0100000
+#define MODE_DIR  0040000
+
+// Directory entry types
+#define TYPE_FILE 1
+#define TYPE_DIR  2
+
+// Longest name a dirent holds; longer names are truncated on insert
+#define DIRENT_NAME_MAX 57
+
+// Hash used by the directory index, over the name as stored in the dirent
+static inline uint32_t dirent_name_hash(const char* name) {
+    return crc32(name, strnlen(name, DIRENT_NAME_MAX));
+}
+
+// WARNING: CALL THIS ONLY AFTER ALL OTHER SUPERBLOCK ELEMENTS HAVE BEEN FINALIZED
+// sb must point at a full BS-byte block: the checksum covers bytes [0..4091].
+static inline uint32_t superblock_crc_finalize(superblock_t *sb) {
+    sb->checksum = 0;
+    uint32_t s = crc32((void *) sb, BS - 4);
+    sb->checksum = s;
+    return s;
+}
+
+// WARNING: CALL THIS ONLY AFTER ALL OTHER INODE ELEMENTS HAVE BEEN FINALIZED
+static inline void inode_crc_finalize(inode_t* ino){
+    uint8_t tmp[INODE_SIZE];
+    memcpy(tmp, ino, INODE_SIZE);
+    // zero crc area before computing
+    memset(&tmp[120], 0, 8);
+    uint32_t c = crc32(tmp, 120);
+    ino->inode_crc = (uint64_t)c; // low 4 bytes carry the crc
+}
+
+// WARNING: CALL THIS ONLY AFTER ALL OTHER DIRENT ELEMENTS HAVE BEEN FINALIZED
+static inline void dirent_checksum_finalize(dirent64_t* de) {
+    const uint8_t* p = (const uint8_t*)de;
+    uint8_t x = 0;
+    for (int i = 0; i < 63; i++) x ^= p[i];   // covers ino(4) + type(1) + name(58)
+    de->checksum = x;
+}
+
+// WARNING: CALL THIS ONLY AFTER ALL OTHER EXTENT BLOCK ELEMENTS HAVE BEEN FINALIZED
+static inline void extent_block_crc_finalize(extent_block_t* eb) {
+    eb->checksum = 0;
+    eb->checksum = crc32(eb, BS);
+}
+
+#endif
@@ -0,0 +1,1254 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include "vsfs_image.h"
+#include "vsfs_journal.h"
+#include "vsfs_stats.h"
+
+#define FLUSH_IOV_MAX 64
+
+// Shard locks sit past the end of any image, on bytes no I/O ever touches
+#define LOCK_SHARDS (1ull << 62)
+
+// Shared writers on an image without allocation groups split the bitmaps into
+// at most this many slices, each a shard of its own
+#define SHARD_SLICES 16
+
+static int next_shard(image_t* img, int inode, uint64_t blocks, uint32_t* tries);
+static int settle_shards(image_t* img);
+static int touch_inode(image_t* img, uint64_t inode_no);
+
+static size_t block_home(const image_t* img, uint64_t block_no) {
+    return (size_t)((block_no * 0x9E3779B97F4A7C15ull) >> 32) & (img->capacity - 1);
+}
+
+static size_t block_slot(const image_t* img, uint64_t block_no) {
+    size_t mask = img->capacity - 1;
+    size_t i = block_home(img, block_no);
+    while (img->slots[i] && img->slots[i]->block_no != block_no) i = (i + 1) & mask;
+    return i;
+}
+
+static int image_grow_cache(image_t* img) {
+    size_t old_capacity = img->capacity;
+    cached_block_t** old_slots = img->slots;
+    img->capacity = old_capacity ? old_capacity * 2 : 64;
+    img->slots = calloc(img->capacity, sizeof(cached_block_t*));
+    if (!img->slots) {
+        img->slots = old_slots;
+        img->capacity = old_capacity;
+        return -1;
+    }
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old_slots[i]) img->slots[block_slot(img, old_slots[i]->block_no)] = old_slots[i];
+    }
+    free(old_slots);
+    return 0;
+}
+
+// The LRU list only holds clean, unborrowed blocks of a bounded cache, so
+// the tail is always a block that can be dropped without writing it
+static void lru_unlink(image_t* img, cached_block_t* block) {
+    if (!block->lru_prev && img->lru_head != block) return;
+    if (block->lru_prev) block->lru_prev->lru_next = block->lru_next;
+    else img->lru_head = block->lru_next;
+    if (block->lru_next) block->lru_next->lru_prev = block->lru_prev;
+    else img->lru_tail = block->lru_prev;
+    block->lru_prev = block->lru_next = NULL;
+    img->lru_count--;
+}
+
+static void lru_touch(image_t* img, cached_block_t* block) {
+    if (img->limit == 0 || block->dirty || block->borrowed) return;
+    lru_unlink(img, block);
+    block->lru_next = img->lru_head;
+    if (img->lru_head) img->lru_head->lru_prev = block;
+    img->lru_head = block;
+    if (!img->lru_tail) img->lru_tail = block;
+    img->lru_count++;
+}
+
+static void mark_dirty(image_t* img, cached_block_t* block) {
+    block->dirty = 1;
+    lru_unlink(img, block);
+}
+
+// Removes the entry at slot i, shifting later entries of its probe chain back
+// so lookups never stop early at the hole
+static void remove_slot(image_t* img, size_t i) {
+    size_t mask = img->capacity - 1;
+    img->slots[i] = NULL;
+    img->used--;
+    for (size_t j = (i + 1) & mask; img->slots[j]; j = (j + 1) & mask) {
+        size_t home = block_home(img, img->slots[j]->block_no);
+        int stays = i <= j ? (home > i && home <= j) : (home > i || home <= j);
+        if (!stays) {
+            img->slots[i] = img->slots[j];
+            img->slots[j] = NULL;
+            i = j;
+        }
+    }
+}
+
+void image_set_cache_limit(image_t* img, size_t blocks) {
+    img->limit = blocks;
+}
+
+void image_trim(image_t* img) {
+    if (img->limit == 0) return;
+    while (img->lru_count > img->limit) {
+        cached_block_t* victim = img->lru_tail;
+        lru_unlink(img, victim);
+        remove_slot(img, block_slot(img, victim->block_no));
+        free(victim->data);
+        free(victim);
+    }
+}
+
+// Returns the cache entry for block_no, inserting an empty buffer if absent.
+// *fresh is set when the buffer was just allocated and holds no data yet.
+static cached_block_t* image_slot(image_t* img, uint64_t block_no, int* fresh) {
+    if (block_no >= img->sb.total_blocks) {
+        fprintf(stderr, "Error: Block %lu is outside the image\n", block_no);
+        return NULL;
+    }
+    if ((img->used + 1) * 4 > img->capacity * 3 && image_grow_cache(img) != 0) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return NULL;
+    }
+    cached_block_t** slot = &img->slots[block_slot(img, block_no)];
+    *fresh = 0;
+    if (!*slot) {
+        cached_block_t* block = calloc(1, sizeof(cached_block_t));
+        if (block) block->data = calloc(1, BS);
+        if (!block || !block->data) {
+            free(block);
+            fprintf(stderr, "Error: Memory allocation failed\n");
+            return NULL;
+        }
+        block->block_no = block_no;
+        *slot = block;
+        img->used++;
+        *fresh = 1;
+    }
+    return *slot;
+}
+
+uint8_t* image_block(image_t* img, uint64_t block_no) {
+    int fresh;
+    cached_block_t* block = image_slot(img, block_no, &fresh);
+    if (!block) return NULL;
+    if (fresh) stats_io(BS, 0);
+    if (fresh && pread(img->in_fd, block->data, BS, (off_t)(block_no * BS)) != (ssize_t)BS) {
+        fprintf(stderr, "Error: Cannot read block %lu of input image\n", block_no);
+        remove_slot(img, block_slot(img, block_no));
+        free(block->data);
+        free(block);
+        return NULL;
+    }
+    lru_touch(img, block);
+    return block->data;
+}
+
+uint8_t* image_cached(image_t* img, uint64_t block_no) {
+    if (img->capacity == 0) return NULL;
+    cached_block_t* block = img->slots[block_slot(img, block_no)];
+    if (!block) return NULL;
+    lru_touch(img, block);
+    return block->data;
+}
+
+uint8_t* image_block_zeroed(image_t* img, uint64_t block_no) {
+    int fresh;
+    cached_block_t* block = image_slot(img, block_no, &fresh);
+    if (!block) return NULL;
+    memset(block->data, 0, BS);
+    block->fresh = 1;
+    mark_dirty(img, block);
+    return block->data;
+}
+
+void image_mark_dirty(image_t* img, uint64_t block_no) {
+    int fresh;
+    cached_block_t* block = image_slot(img, block_no, &fresh);
+    if (block) mark_dirty(img, block);
+}
+
+// Reads `count` consecutive blocks into one buffer and caches each block as a
+// view into it, so a structure spanning several blocks (a bitmap) stays
+// contiguous in memory while its blocks are still written back individually
+static uint8_t* image_map_region(image_t* img, uint64_t first, uint64_t count) {
+    uint8_t* region = malloc(count * BS);
+    if (!region) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return NULL;
+    }
+    for (uint64_t done = 0; done < count * BS; ) {
+        ssize_t n = pread(img->in_fd, region + done, count * BS - done, (off_t)(first * BS + done));
+        stats_io(n > 0 ? (uint64_t)n : 0, 0);
+        if (n <= 0) {
+            fprintf(stderr, "Error: Cannot read blocks %lu-%lu of input image\n", first, first + count - 1);
+            free(region);
+            return NULL;
+        }
+        done += (uint64_t)n;
+    }
+    for (uint64_t i = 0; i < count; i++) {
+        while ((img->used + 1) * 4 > img->capacity * 3) {
+            if (image_grow_cache(img) != 0) {
+                fprintf(stderr, "Error: Memory allocation failed\n");
+                free(region);
+                return NULL;
+            }
+        }
+        cached_block_t* block = calloc(1, sizeof(cached_block_t));
+        if (!block) {
+            fprintf(stderr, "Error: Memory allocation failed\n");
+            free(region);
+            return NULL;
+        }
+        block->block_no = first + i;
+        block->data = region + i * BS;
+        block->borrowed = 1;
+        img->slots[block_slot(img, first + i)] = block;
+        img->used++;
+    }
+    return region;
+}
+
+void image_mark_bits_dirty(image_t* img, uint64_t bitmap_start, uint64_t start, uint64_t length) {
+    if (length == 0) return;
+    for (uint64_t b = start / (BS * 8); b <= (start + length - 1) / (BS * 8); b++) {
+        image_mark_dirty(img, bitmap_start + b);
+    }
+}
+
+inode_t* image_inode_peek(image_t* img, uint64_t inode_no) {
+    if (inode_no == 0 || inode_no > img->sb.inode_count) {
+        fprintf(stderr, "Error: Inode %lu is outside the inode table\n", inode_no);
+        return NULL;
+    }
+    uint64_t index = inode_no - 1;
+    uint8_t* block = image_block(img, img->sb.inode_table_start + index / (BS / INODE_SIZE));
+    return block ? (inode_t*)(block + (index % (BS / INODE_SIZE)) * INODE_SIZE) : NULL;
+}
+
+inode_t* image_inode(image_t* img, uint64_t inode_no) {
+    inode_t* inode = image_inode_peek(img, inode_no);
+    if (inode) image_mark_dirty(img, img->sb.inode_table_start + (inode_no - 1) / (BS / INODE_SIZE));
+    if (inode && img->shared && touch_inode(img, inode_no) != 0) return NULL;
+    return inode;
+}
+
+static int shard_held(const image_t* img, uint32_t g) {
+    return (img->shards_held[g / 64] >> (g % 64)) & 1;
+}
+
+// A shared writer allocates from its shard's slices of the bitmaps; `first`
+// is the bitmap bit the pool's bit 0 stands for
+static bitmap_t* inode_pool(image_t* img, uint64_t* first) {
+    *first = img->shared ? img->shard_first_inode : 0;
+    return img->shared ? &img->shard_inode_bm : &img->inode_bm;
+}
+
+static bitmap_t* data_pool(image_t* img, uint64_t* first) {
+    *first = img->shared ? img->shard_first_block : 0;
+    return img->shared ? &img->shard_data_bm : &img->data_bm;
+}
+
+// Moves the summary counters by `count` data blocks from bit on: taken when
+// freed is 0, returned when it is 1
+static void count_blocks(image_t* img, uint64_t bit, uint64_t count, int freed) {
+    if (!(img->sb.flags & SB_FLAG_SUMMARY)) return;
+    summary_t* s = &img->summary;
+    s->free_blocks = freed ? s->free_blocks + count : s->free_blocks - count;
+    // A run can cross into the next group
+    for (uint64_t end = bit + count; s->groups && bit < end; ) {
+        uint64_t g = bit / s->blocks_per_group;
+        uint64_t group_end = (g + 1) * s->blocks_per_group;
+        uint32_t n = (uint32_t)((end < group_end ? end : group_end) - bit);
+        img->groups[g].free_blocks = freed ? img->groups[g].free_blocks + n : img->groups[g].free_blocks - n;
+        bit += n;
+    }
+}
+
+static void count_inode(image_t* img, uint64_t bit, int freed) {
+    if (!(img->sb.flags & SB_FLAG_SUMMARY)) return;
+    summary_t* s = &img->summary;
+    s->free_inodes = freed ? s->free_inodes + 1 : s->free_inodes - 1;
+    if (s->groups) {
+        group_desc_t* group = &img->groups[bit / s->inodes_per_group];
+        group->free_inodes = freed ? group->free_inodes + 1 : group->free_inodes - 1;
+    }
+}
+
+void image_free_inode(image_t* img, uint32_t inode_no) {
+    if (img->shared && !shard_held(img, (inode_no - 1) / img->shard_layout.inodes_per_group)) return;
+    bitmap_clear(&img->inode_bm, inode_no - 1);
+    image_mark_bits_dirty(img, img->sb.inode_bitmap_start, inode_no - 1, 1);
+    count_inode(img, inode_no - 1, 1);
+}
+
+uint32_t image_alloc_inode(image_t* img) {
+    uint64_t first;
+    int64_t bit;
+    uint32_t tries = 0;
+    while ((bit = bitmap_alloc(inode_pool(img, &first))) < 0) {
+        if (next_shard(img, 1, 0, &tries) != 0) {
+            settle_shards(img);
+            return 0;
+        }
+    }
+    bit += (int64_t)first;
+    image_mark_bits_dirty(img, img->sb.inode_bitmap_start, (uint64_t)bit, 1);
+    count_inode(img, (uint64_t)bit, 0);
+    if (tries && settle_shards(img) != 0) return 0;
+    return (uint32_t)bit + 1;
+}
+
+uint64_t image_alloc_block(image_t* img) {
+    uint64_t first;
+    int64_t bit;
+    uint32_t tries = 0;
+    while ((bit = bitmap_alloc(data_pool(img, &first))) < 0) {
+        if (next_shard(img, 0, 1, &tries) != 0) {
+            settle_shards(img);
+            return 0;
+        }
+    }
+    bit += (int64_t)first;
+    stats_add(STATS_BLOCKS_ALLOCATED, 1);
+    image_mark_bits_dirty(img, img->sb.data_bitmap_start, (uint64_t)bit, 1);
+    count_blocks(img, (uint64_t)bit, 1, 0);
+    if (tries && settle_shards(img) != 0) return 0;
+    return img->sb.data_region_start + (uint64_t)bit;
+}
+
+uint64_t image_alloc_run(image_t* img, uint64_t count) {
+    bitmap_extent_t run;
+    if ((img->sb.flags & SB_FLAG_SUMMARY) && img->summary.free_blocks < count) return 0;
+    uint64_t first;
+    uint32_t tries = 0;
+    while (bitmap_alloc_extents(data_pool(img, &first), count, &run, 1) != 1) {
+        if (next_shard(img, 0, count, &tries) != 0) {
+            settle_shards(img);
+            return 0;
+        }
+    }
+    run.start += first;
+    stats_add(STATS_BLOCKS_ALLOCATED, count);
+    image_mark_bits_dirty(img, img->sb.data_bitmap_start, run.start, run.length);
+    count_blocks(img, run.start, run.length, 0);
+    if (tries && settle_shards(img) != 0) return 0;
+    return img->sb.data_region_start + run.start;
+}
+
+// A shared writer takes what its shard has and goes on in further shards, so
+// a file can be larger than one shard. Runs that continue each other across a
+// shard boundary are joined. On failure every run taken is given back before
+// the shards moved away from are let go.
+static int shared_alloc_extents(image_t* img, uint64_t count, bitmap_extent_t* runs, size_t max_runs) {
+    size_t n_runs = 0;
+    uint64_t left = count;
+    for (uint32_t tries = 0; left > 0; ) {
+        uint64_t first;
+        bitmap_t* pool = data_pool(img, &first);
+        uint64_t take = bitmap_count_free(pool);
+        if (take > left) take = left;
+        int n = take && n_runs < max_runs ? bitmap_alloc_extents(pool, take, runs + n_runs, max_runs - n_runs) : -1;
+        // The new runs are read ahead of where the joined list is written
+        size_t added = n_runs;
+        for (int r = 0; r < n; r++) {
+            bitmap_extent_t run = runs[added + r];
+            run.start += first;
+            image_mark_bits_dirty(img, img->sb.data_bitmap_start, run.start, run.length);
+            count_blocks(img, run.start, run.length, 0);
+            if (n_runs && runs[n_runs - 1].start + runs[n_runs - 1].length == run.start) {
+                runs[n_runs - 1].length += run.length;
+            } else {
+                runs[n_runs++] = run;
+            }
+        }
+        if (n > 0) left -= take;
+        if (left > 0 && next_shard(img, 0, 1, &tries) != 0) {
+            for (size_t r = 0; r < n_runs; r++) {
+                bitmap_clear_range(&img->data_bm, runs[r].start, runs[r].length);
+                count_blocks(img, runs[r].start, runs[r].length, 1);
+            }
+            settle_shards(img);
+            return -1;
+        }
+    }
+    if (settle_shards(img) != 0) return -1;
+    stats_add(STATS_BLOCKS_ALLOCATED, count);
+    for (size_t r = 0; r < n_runs; r++) runs[r].start += img->sb.data_region_start;
+    return (int)n_runs;
+}
+
+int image_alloc_extents(image_t* img, uint64_t count, bitmap_extent_t* runs, size_t max_runs) {
+    // The summary answers "not enough space" without searching the bitmap
+    if ((img->sb.flags & SB_FLAG_SUMMARY) && img->summary.free_blocks < count) return -1;
+    if (img->shared) return shared_alloc_extents(img, count, runs, max_runs);
+    int n_runs = bitmap_alloc_extents(&img->data_bm, count, runs, max_runs);
+    if (n_runs < 0) return -1;
+    stats_add(STATS_BLOCKS_ALLOCATED, count);
+    for (int r = 0; r < n_runs; r++) {
+        image_mark_bits_dirty(img, img->sb.data_bitmap_start, runs[r].start, runs[r].length);
+        count_blocks(img, runs[r].start, runs[r].length, 0);
+        runs[r].start += img->sb.data_region_start;
+    }
+    return n_runs;
+}
+
+uint64_t image_free_blocks(image_t* img) {
+    return (img->sb.flags & SB_FLAG_SUMMARY) ? img->summary.free_blocks : bitmap_count_free(&img->data_bm);
+}
+
+uint64_t image_free_inodes(image_t* img) {
+    return (img->sb.flags & SB_FLAG_SUMMARY) ? img->summary.free_inodes : bitmap_count_free(&img->inode_bm);
+}
+
+void image_set_goal(image_t* img, uint32_t parent_ino, uint64_t blocks, int is_dir) {
+    const summary_t* s = &img->summary;
+    // A shared writer's allocations stay in its shard
+    if (!(img->sb.flags & SB_FLAG_SUMMARY) || s->groups == 0 || img->shared) return;
+
+    // Directories spread out to the group with the most free blocks; files
+    // stay in their directory's group, or the next one after it with room
+    uint32_t best = UINT32_MAX;
+    uint32_t home = parent_ino ? (parent_ino - 1) / s->inodes_per_group : 0;
+    if (home >= s->groups) home = 0;
+    for (uint32_t i = 0; i < s->groups; i++) {
+        uint32_t g = (home + i) % s->groups;
+        if (img->groups[g].free_inodes == 0) continue;
+        if (is_dir) {
+            if (best == UINT32_MAX || img->groups[g].free_blocks > img->groups[best].free_blocks) best = g;
+        } else if (img->groups[g].free_blocks >= blocks) {
+            best = g;
+            break;
+        }
+    }
+    if (best == UINT32_MAX) return;   // no group fits: plain next-fit
+
+    // Moving the cursors only when they are outside the group keeps next-fit
+    // going inside it instead of rescanning the group from its start
+    if (img->inode_bm.cursor / s->inodes_per_group != best) {
+        img->inode_bm.cursor = (uint64_t)best * s->inodes_per_group;
+    }
+    if (img->data_bm.cursor / s->blocks_per_group != best) {
+        img->data_bm.cursor = (uint64_t)best * s->blocks_per_group;
+    }
+}
+
+int image_write_super(image_t* img) {
+    uint8_t* super = image_block(img, 0);
+    if (!super) return -1;
+    memcpy(super, &img->sb, sizeof(img->sb));
+    if (img->sb.flags & SB_FLAG_SUMMARY) {
+        memcpy(super + SUMMARY_OFFSET, &img->summary, sizeof(summary_t));
+        memcpy(super + SUMMARY_OFFSET + sizeof(summary_t), img->groups, img->summary.groups * sizeof(group_desc_t));
+    }
+    superblock_crc_finalize((superblock_t*)super);
+    image_mark_dirty(img, 0);
+    return 0;
+}
+
+// A shared writer only gives back blocks in shards it holds. The bits of any
+// other shard may belong to another writer by now, so those blocks stay
+// allocated until mkfs_fsck --repair reclaims them.
+static void free_bits(image_t* img, uint64_t bit, uint64_t count) {
+    uint64_t per_shard = img->shared ? img->shard_layout.blocks_per_group : UINT64_MAX;
+    for (uint64_t end = bit + count; bit < end; ) {
+        uint64_t stop = per_shard - bit % per_shard < end - bit ? bit + per_shard - bit % per_shard : end;
+        if (!img->shared || shard_held(img, (uint32_t)(bit / per_shard))) {
+            bitmap_clear_range(&img->data_bm, bit, stop - bit);
+            image_mark_bits_dirty(img, img->sb.data_bitmap_start, bit, stop - bit);
+            count_blocks(img, bit, stop - bit, 1);
+        }
+        bit = stop;
+    }
+}
+
+void image_free_run(image_t* img, uint64_t first, uint64_t count) {
+    free_bits(img, first - img->sb.data_region_start, count);
+
+    // The journal must not write a block reused within the batch in place
+    if (img->n_freed == img->freed_capacity) {
+        size_t capacity = img->freed_capacity ? img->freed_capacity * 2 : 16;
+        bitmap_extent_t* freed = realloc(img->freed, capacity * sizeof(bitmap_extent_t));
+        if (!freed) {
+            img->freed_lost = 1;
+            return;
+        }
+        img->freed = freed;
+        img->freed_capacity = capacity;
+    }
+    img->freed[img->n_freed].start = first - img->sb.data_region_start;
+    img->freed[img->n_freed].length = count;
+    img->n_freed++;
+}
+
+static int layout_valid(const superblock_t* sb) {
+    return sb->block_size == BS &&
+           (!(sb->flags & SB_FLAG_JOURNAL) || journal_blocks(sb) >= JOURNAL_MIN_BLOCKS) &&
+           sb->inode_bitmap_blocks * BS * 8 >= sb->inode_count &&
+           sb->data_bitmap_blocks * BS * 8 >= sb->data_region_blocks &&
+           sb->inode_table_blocks * (BS / INODE_SIZE) >= sb->inode_count &&
+           sb->data_region_start + sb->data_region_blocks <= sb->total_blocks &&
+           journal_start(sb) <= sb->total_blocks;
+}
+
+// Whether two superblocks place the bitmaps, inode table, data region and
+// journal alike
+static int same_layout(const superblock_t* a, const superblock_t* b) {
+    return a->total_blocks == b->total_blocks && a->inode_count == b->inode_count &&
+           a->inode_bitmap_blocks == b->inode_bitmap_blocks && a->data_bitmap_blocks == b->data_bitmap_blocks &&
+           a->inode_table_blocks == b->inode_table_blocks && a->data_region_start == b->data_region_start &&
+           a->data_region_blocks == b->data_region_blocks && a->flags == b->flags;
+}
+
+// Loads the summary that follows the superblock in block 0
+static int load_summary(image_t* img, const uint8_t* super) {
+    if (!(img->sb.flags & SB_FLAG_SUMMARY)) return 0;
+    memcpy(&img->summary, super + SUMMARY_OFFSET, sizeof(summary_t));
+    if (!summary_valid(&img->sb, &img->summary)) {
+        fprintf(stderr, "Error: Corrupt free-space summary (run mkfs_fsck --repair)\n");
+        return -1;
+    }
+    memcpy(img->groups, super + SUMMARY_OFFSET + sizeof(summary_t), img->summary.groups * sizeof(group_desc_t));
+    return 0;
+}
+
+static int compare_block_no(const void* a, const void* b) {
+    uint64_t x = (*(cached_block_t* const*)a)->block_no;
+    uint64_t y = (*(cached_block_t* const*)b)->block_no;
+    return (x > y) - (x < y);
+}
+
+// Returns the dirty blocks sorted by block number, in an array the caller frees
+static cached_block_t** collect_dirty(image_t* img, size_t* n_dirty) {
+    cached_block_t** dirty = malloc((img->used ? img->used : 1) * sizeof(cached_block_t*));
+    if (!dirty) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return NULL;
+    }
+    *n_dirty = 0;
+    for (size_t i = 0; i < img->capacity; i++) {
+        if (img->slots[i] && img->slots[i]->dirty) dirty[(*n_dirty)++] = img->slots[i];
+    }
+    qsort(dirty, *n_dirty, sizeof(cached_block_t*), compare_block_no);
+    return dirty;
+}
+
+static void mark_clean(image_t* img, cached_block_t** blocks, size_t n_blocks) {
+    for (size_t i = 0; i < n_blocks; i++) {
+        blocks[i]->dirty = 0;
+        blocks[i]->fresh = 0;
+        lru_touch(img, blocks[i]);
+    }
+    img->n_freed = 0;
+    img->freed_lost = 0;
+}
+
+// Writes the blocks loaded by journal_recover() and makes them durable, so the
+// next transaction does not depend on the one replayed
+static int replay_in_place(image_t* img) {
+    size_t n_dirty;
+    cached_block_t** dirty = collect_dirty(img, &n_dirty);
+    if (!dirty) return -1;
+    int rc = image_write_blocks(img, dirty, n_dirty);
+    if (rc == 0) stats_io(0, 0);
+    if (rc == 0 && fdatasync(img->out_fd) != 0) {
+        fprintf(stderr, "Error: Cannot sync image: %s\n", strerror(errno));
+        rc = -1;
+    }
+    if (rc == 0) {
+        mark_clean(img, dirty, n_dirty);
+        img->journal_replay_prev = 0;
+    }
+    free(dirty);
+    return rc;
+}
+
+int image_open(image_t* img, const char* input_name, const char* output_name, int in_place) {
+    memset(img, 0, sizeof(*img));
+    img->in_fd = img->out_fd = -1;
+
+    img->in_fd = open(input_name, in_place ? O_RDWR : O_RDONLY);
+    if (img->in_fd < 0) {
+        fprintf(stderr, "Error: Cannot open input image '%s': %s\n", input_name, strerror(errno));
+        return -1;
+    }
+
+    // Truncating the output would destroy the input when both name the same file
+    struct stat in_stat, out_stat;
+    if (!in_place && output_name && fstat(img->in_fd, &in_stat) == 0 && stat(output_name, &out_stat) == 0 &&
+        in_stat.st_dev == out_stat.st_dev && in_stat.st_ino == out_stat.st_ino) {
+        close(img->in_fd);
+        return image_open(img, input_name, output_name, 1);
+    }
+
+    stats_io(sizeof(img->sb), 0);
+    if (pread(img->in_fd, &img->sb, sizeof(img->sb), 0) != (ssize_t)sizeof(img->sb)) {
+        fprintf(stderr, "Error: Cannot read superblock\n");
+        return -1;
+    }
+    if (img->sb.magic != VSFS_MAGIC) {
+        fprintf(stderr, "Error: Invalid filesystem magic number\n");
+        return -1;
+    }
+    if (img->sb.version != VSFS_VERSION_DIRECT && img->sb.version != VSFS_VERSION_EXTENTS) {
+        fprintf(stderr, "Error: Unsupported filesystem version %u\n", img->sb.version);
+        return -1;
+    }
+    if (!layout_valid(&img->sb)) {
+        fprintf(stderr, "Error: Corrupt superblock layout\n");
+        return -1;
+    }
+    if (fstat(img->in_fd, &in_stat) != 0 || (uint64_t)in_stat.st_size < img->sb.total_blocks * BS) {
+        fprintf(stderr, "Error: Cannot read image data\n");
+        return -1;
+    }
+
+    if (in_place) img->out_fd = img->in_fd;
+    img->output_name = output_name;
+    if (image_grow_cache(img) != 0) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return -1;
+    }
+
+    img->regions[0] = image_map_region(img, img->sb.inode_bitmap_start, img->sb.inode_bitmap_blocks);
+    if (!img->regions[0]) return -1;
+    img->regions[1] = image_map_region(img, img->sb.data_bitmap_start, img->sb.data_bitmap_blocks);
+    if (!img->regions[1]) return -1;
+    bitmap_init(&img->inode_bm, img->regions[0], img->sb.inode_count);
+    bitmap_init(&img->data_bm, img->regions[1], img->sb.data_region_blocks);
+    if (img->sb.flags & SB_FLAG_SUMMARY) {
+        uint8_t* super = image_block(img, 0);
+        if (!super || load_summary(img, super) != 0) return -1;
+    }
+
+    if (img->sb.flags & SB_FLAG_JOURNAL) {
+        superblock_t opened = img->sb;
+        int64_t loaded = journal_recover(img);
+        if (loaded < 0) return -1;
+        if (loaded > 0 && !layout_valid(&img->sb)) {
+            fprintf(stderr, "Error: Corrupt superblock layout in journal\n");
+            return -1;
+        }
+        // A replayed resize (mkfs_resize) moves the bitmaps this open mapped
+        int moved = loaded > 0 && !same_layout(&opened, &img->sb);
+        if (moved && !in_place) {
+            fprintf(stderr, "Error: The journal holds a resize; open the image in place first (mkfs_fsck --repair)\n");
+            return -1;
+        }
+        // A replayed block 0 brings its summary along
+        uint8_t* super = loaded > 0 ? image_cached(img, 0) : NULL;
+        if (super && load_summary(img, super) != 0) return -1;
+        // A writable image gets the replayed blocks back in place right away;
+        // otherwise they stay dirty in the cache and reach a separate output
+        // with the first flush
+        if (loaded > 0 && in_place && replay_in_place(img) != 0) return -1;
+        if (moved) {
+            image_close(img);
+            return image_open(img, input_name, output_name, in_place);
+        }
+    }
+    return 0;
+}
+
+
+// Copies the whole input to the output, sharing extents where the filesystem
+// allows it: FICLONE first, then copy_file_range, then a plain read/write loop.
+static int clone_image(int in_fd, int out_fd) {
+    struct stat in_stat;
+    if (fstat(in_fd, &in_stat) != 0) return -1;
+
+    stats_io(0, 0);
+    if (ioctl(out_fd, FICLONE, in_fd) == 0) return 0;
+
+    off_t in_off = 0, out_off = 0;
+    while (in_off < in_stat.st_size) {
+        ssize_t n = copy_file_range(in_fd, &in_off, out_fd, &out_off, in_stat.st_size - in_off, 0);
+        stats_io(n > 0 ? (uint64_t)n : 0, n > 0 ? (uint64_t)n : 0);
+        if (n <= 0) break;
+    }
+    if (in_off == in_stat.st_size) return 0;
+
+    uint8_t* chunk = malloc(FLUSH_IOV_MAX * BS);
+    if (!chunk) return -1;
+    while (in_off < in_stat.st_size) {
+        ssize_t n = pread(in_fd, chunk, FLUSH_IOV_MAX * BS, in_off);
+        stats_io(n > 0 ? (uint64_t)n : 0, 0);
+        if (n > 0) stats_io(0, (uint64_t)n);
+        if (n <= 0 || pwrite(out_fd, chunk, n, out_off) != n) {
+            free(chunk);
+            return -1;
+        }
+        in_off += n;
+        out_off += n;
+    }
+    free(chunk);
+    return 0;
+}
+
+int image_write_blocks(image_t* img, cached_block_t** blocks, size_t n_blocks) {
+    struct iovec iov[FLUSH_IOV_MAX];
+    for (size_t i = 0; i < n_blocks; ) {
+        size_t run = 0;
+        size_t bytes = 0;
+        while (i + run < n_blocks && run < FLUSH_IOV_MAX &&
+               blocks[i + run]->block_no == blocks[i]->block_no + run) {
+            iov[run].iov_base = blocks[i + run]->data;
+            iov[run].iov_len = BS;
+            bytes += BS;
+            run++;
+        }
+        stats_io(0, bytes);
+        if (pwritev(img->out_fd, iov, (int)run, (off_t)(blocks[i]->block_no * BS)) != (ssize_t)bytes) {
+            fprintf(stderr, "Error: Cannot write output image: %s\n", strerror(errno));
+            return -1;
+        }
+        i += run;
+    }
+    return 0;
+}
+
+// Deallocates the host blocks behind the data blocks the batch freed, so a
+// sparse image stays sparse. Runs reused within the batch are skipped. A host
+// filesystem without hole punching leaves the blocks as they are.
+static int punch_freed_runs(image_t* img) {
+    if (img->freed_lost) return 0;
+    for (size_t i = 0; i < img->n_freed; i++) {
+        uint64_t end = img->freed[i].start + img->freed[i].length;
+        for (uint64_t bit = img->freed[i].start; bit < end; ) {
+            if (bitmap_test(&img->data_bm, bit)) {
+                bit++;
+                continue;
+            }
+            uint64_t run = 1;
+            while (bit + run < end && !bitmap_test(&img->data_bm, bit + run)) run++;
+            stats_io(0, 0);
+            if (fallocate(img->out_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                          (off_t)((img->sb.data_region_start + bit) * BS), (off_t)(run * BS)) != 0) {
+                if (errno == EOPNOTSUPP || errno == ENOSYS) {
+                    img->punch_freed = 0;
+                    return 0;
+                }
+                fprintf(stderr, "Error: Cannot punch freed blocks: %s\n", strerror(errno));
+                return -1;
+            }
+            img->punched += run;
+            bit += run;
+        }
+    }
+    return 0;
+}
+
+// Writes the dirty blocks in ascending order, merging runs of adjacent blocks
+// into one pwritev. A separate output is created and cloned from the input
+// first, so it only exists once every change has been staged.
+//
+// An in-place update of a journaled image commits the blocks as one journal
+// transaction instead. A separate output is not journaled (it is not in use
+// until the tool finishes), so it gets an empty transaction afterwards to keep
+// older ones from being replayed over the new blocks.
+//
+// With punch_freed set, the data blocks freed since the last flush are then
+// punched out of the output once the change that freed them is on disk.
+static int shared_flush(image_t* img);
+
+int image_flush(image_t* img) {
+    if (img->shared) return shared_flush(img);
+    if (img->out_fd < 0) {
+        if (!img->output_name) {
+            fprintf(stderr, "Error: Image is open read-only\n");
+            return -1;
+        }
+        img->out_fd = open(img->output_name, O_RDWR | O_CREAT | O_TRUNC, 0666);
+        if (img->out_fd < 0) {
+            fprintf(stderr, "Error: Cannot create output image '%s': %s\n", img->output_name, strerror(errno));
+            return -1;
+        }
+        if (clone_image(img->in_fd, img->out_fd) != 0) {
+            fprintf(stderr, "Error: Cannot copy input image to '%s': %s\n", img->output_name, strerror(errno));
+            return -1;
+        }
+    }
+
+    size_t n_dirty;
+    cached_block_t** dirty = collect_dirty(img, &n_dirty);
+    if (!dirty) return -1;
+
+    int rc;
+    if (!(img->sb.flags & SB_FLAG_JOURNAL)) {
+        rc = image_write_blocks(img, dirty, n_dirty);
+    } else if (img->out_fd == img->in_fd && !img->bypass_journal) {
+        rc = journal_commit(img, dirty, n_dirty);
+    } else {
+        rc = image_write_blocks(img, dirty, n_dirty);
+        if (rc == 0) rc = journal_barrier(img);
+    }
+    if (rc == 0 && img->punch_freed) rc = punch_freed_runs(img);
+    if (rc == 0) mark_clean(img, dirty, n_dirty);
+    free(dirty);
+    return rc;
+}
+
+int image_close(image_t* img) {
+    int rc = 0;
+    for (size_t i = 0; i < img->capacity; i++) {
+        if (!img->slots[i]) continue;
+        if (!img->slots[i]->borrowed) free(img->slots[i]->data);
+        free(img->slots[i]);
+    }
+    free(img->slots);
+    free(img->regions[0]);
+    free(img->regions[1]);
+    free(img->freed);
+    free(img->touched);
+    img->slots = NULL;
+    img->freed = NULL;
+    img->touched = NULL;
+    if (img->out_fd >= 0 && img->out_fd != img->in_fd && close(img->out_fd) != 0) rc = -1;
+    if (img->in_fd >= 0) close(img->in_fd);
+    img->in_fd = img->out_fd = -1;
+    return rc;
+}
+
+// ================================SHARED WRITERS===============================
+
+// Takes (F_WRLCK, F_RDLCK) or drops (F_UNLCK) an advisory lock on bytes
+// [offset, offset + length) of the image. Open file description locks belong
+// to this open of the image, so two handles in one process exclude each other
+// the way two processes do. Returns 1 if the range is busy and !wait.
+static int range_lock(image_t* img, uint64_t offset, uint64_t length, short type, int wait) {
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = (off_t)offset;
+    fl.l_len = (off_t)length;
+    while (fcntl(img->in_fd, wait ? F_OFD_SETLKW : F_OFD_SETLK, &fl) != 0) {
+        if (errno == EINTR) continue;
+        if (!wait && (errno == EAGAIN || errno == EACCES)) return 1;
+        fprintf(stderr, "Error: Cannot lock image: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static uint64_t inode_offset(const image_t* img, uint64_t inode_no) {
+    return img->sb.inode_table_start * BS + (inode_no - 1) * INODE_SIZE;
+}
+
+static int touch_inode(image_t* img, uint64_t inode_no) {
+    if (img->n_touched && img->touched[img->n_touched - 1] == inode_no) return 0;
+    if (img->n_touched == img->touched_capacity) {
+        size_t capacity = img->touched_capacity ? img->touched_capacity * 2 : 64;
+        uint32_t* touched = realloc(img->touched, capacity * sizeof(uint32_t));
+        if (!touched) {
+            fprintf(stderr, "Error: Memory allocation failed\n");
+            return -1;
+        }
+        img->touched = touched;
+        img->touched_capacity = capacity;
+    }
+    img->touched[img->n_touched++] = (uint32_t)inode_no;
+    return 0;
+}
+
+static int compare_inode_no(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+// Blocks other writers change too: they are never written whole
+static int shared_block(const image_t* img, uint64_t block_no) {
+    return block_no == 0 || (block_no >= img->sb.inode_bitmap_start && block_no < img->sb.data_bitmap_start +
+                             img->sb.data_bitmap_blocks) ||
+           (block_no >= img->sb.inode_table_start && block_no < img->sb.inode_table_start + img->sb.inode_table_blocks);
+}
+
+// Writes this writer's dirty blocks except the bitmaps and block 0, and the
+// inodes it changed, each run of consecutive inodes in one block with one
+// write. The inode table blocks are clean afterwards.
+static int publish(image_t* img) {
+    size_t n_dirty;
+    cached_block_t** dirty = collect_dirty(img, &n_dirty);
+    if (!dirty) return -1;
+    size_t n_own = 0;
+    for (size_t i = 0; i < n_dirty; i++) {
+        if (!shared_block(img, dirty[i]->block_no)) dirty[n_own++] = dirty[i];
+    }
+    int rc = image_write_blocks(img, dirty, n_own);
+    for (size_t i = 0; rc == 0 && i < n_own; i++) {
+        dirty[i]->dirty = 0;
+        dirty[i]->fresh = 0;
+        lru_touch(img, dirty[i]);
+    }
+    free(dirty);
+    if (rc != 0) return -1;
+
+    qsort(img->touched, img->n_touched, sizeof(uint32_t), compare_inode_no);
+    const uint64_t per_block = BS / INODE_SIZE;
+    for (size_t i = 0; i < img->n_touched; ) {
+        uint64_t first = img->touched[i];
+        uint64_t last = first;
+        while (++i < img->n_touched && img->touched[i] <= last + 1 && (img->touched[i] - 1) / per_block ==
+               (first - 1) / per_block) {
+            last = img->touched[i];
+        }
+        uint64_t table_block = img->sb.inode_table_start + (first - 1) / per_block;
+        uint8_t* block = image_cached(img, table_block);
+        if (!block) continue;
+        size_t length = (size_t)(last - first + 1) * INODE_SIZE;
+        stats_io(0, length);
+        if (pwrite(img->out_fd, block + ((first - 1) % per_block) * INODE_SIZE, length,
+                   (off_t)inode_offset(img, first)) != (ssize_t)length) {
+            fprintf(stderr, "Error: Cannot write output image: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+    img->n_touched = 0;
+    for (size_t i = 0; i < img->capacity; i++) {
+        cached_block_t* block = img->slots[i];
+        if (block && block->dirty && block->block_no >= img->sb.inode_table_start &&
+            block->block_no < img->sb.inode_table_start + img->sb.inode_table_blocks) {
+            block->dirty = 0;
+            lru_touch(img, block);
+        }
+    }
+    return 0;
+}
+
+// Evicts every clean block that is not part of a bitmap, so the next reads
+// see what other writers have written
+static int drop_clean(image_t* img) {
+    cached_block_t** victims = malloc((img->used ? img->used : 1) * sizeof(cached_block_t*));
+    if (!victims) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return -1;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < img->capacity; i++) {
+        cached_block_t* block = img->slots[i];
+        if (block && !block->dirty && !block->borrowed) victims[n++] = block;
+    }
+    for (size_t i = 0; i < n; i++) {
+        lru_unlink(img, victims[i]);
+        remove_slot(img, block_slot(img, victims[i]->block_no));
+        free(victims[i]->data);
+        free(victims[i]);
+    }
+    free(victims);
+    return 0;
+}
+
+// Writes the changed bitmap blocks, each under a lock on it: the bytes of the
+// slices of the shards this writer holds come from this writer and the rest
+// from disk, which also brings the cached copy up to date
+static int merge_bitmaps(image_t* img) {
+    const summary_t* layout = &img->shard_layout;
+    uint8_t disk[BS];
+    for (size_t i = 0; i < img->capacity; i++) {
+        cached_block_t* block = img->slots[i];
+        if (!block || !block->borrowed || !block->dirty) continue;
+        int inodes = block->block_no < img->sb.data_bitmap_start;
+        uint64_t block_byte = (block->block_no - (inodes ? img->sb.inode_bitmap_start : img->sb.data_bitmap_start)) * BS;
+
+        if (range_lock(img, block->block_no * BS, BS, F_WRLCK, 1) != 0) return -1;
+        stats_io(BS, 0);
+        int rc = pread(img->in_fd, disk, BS, (off_t)(block->block_no * BS)) == (ssize_t)BS ? 0 : -1;
+        for (uint32_t g = 0; rc == 0 && g < layout->groups; g++) {
+            if (!shard_held(img, g)) continue;
+            uint64_t first = (uint64_t)g * (inodes ? layout->inodes_per_group : layout->blocks_per_group);
+            uint64_t nbits = inodes ? group_inodes(&img->sb, layout, g) : group_data_blocks(&img->sb, layout, g);
+            uint64_t lo = first / 8, hi = (first + nbits + 7) / 8;
+            if (lo < block_byte) lo = block_byte;
+            if (hi > block_byte + BS) hi = block_byte + BS;
+            if (lo < hi) memcpy(disk + (lo - block_byte), block->data + (lo - block_byte), hi - lo);
+        }
+        if (rc == 0) {
+            memcpy(block->data, disk, BS);
+            stats_io(0, BS);
+            if (pwrite(img->out_fd, disk, BS, (off_t)(block->block_no * BS)) != (ssize_t)BS) rc = -1;
+        }
+        range_lock(img, block->block_no * BS, BS, F_UNLCK, 0);
+        if (rc != 0) {
+            fprintf(stderr, "Error: Cannot update bitmap block %lu: %s\n", block->block_no, strerror(errno));
+            return -1;
+        }
+        block->dirty = 0;
+    }
+    return 0;
+}
+
+// Reads the summary from disk under a shared lock on block 0
+static int read_summary(image_t* img, summary_t* summary, group_desc_t* groups) {
+    if (range_lock(img, 0, BS, F_RDLCK, 1) != 0) return -1;
+    uint8_t super[BS];
+    stats_io(BS, 0);
+    int rc = pread(img->in_fd, super, BS, 0) == (ssize_t)BS ? 0 : -1;
+    range_lock(img, 0, BS, F_UNLCK, 0);
+    if (rc != 0) {
+        fprintf(stderr, "Error: Cannot read superblock\n");
+        return -1;
+    }
+    memcpy(summary, super + SUMMARY_OFFSET, sizeof(summary_t));
+    if (!summary_valid(&img->sb, summary) || summary->groups != img->summary.groups) {
+        fprintf(stderr, "Error: Corrupt free-space summary (run mkfs_fsck --repair)\n");
+        return -1;
+    }
+    memcpy(groups, super + SUMMARY_OFFSET + sizeof(summary_t), summary->groups * sizeof(group_desc_t));
+    return 0;
+}
+
+// Adds this writer's changes to the counters since they were last read to
+// the ones on disk, and takes the result as the new starting point
+static int merge_summary(image_t* img) {
+    if (!(img->sb.flags & SB_FLAG_SUMMARY)) return 0;
+    uint8_t super[BS];
+    if (range_lock(img, 0, BS, F_WRLCK, 1) != 0) return -1;
+    stats_io(BS, 0);
+    int rc = pread(img->in_fd, super, BS, 0) == (ssize_t)BS ? 0 : -1;
+    if (rc == 0) {
+        summary_t* summary = (summary_t*)(super + SUMMARY_OFFSET);
+        group_desc_t* groups = (group_desc_t*)(super + SUMMARY_OFFSET + sizeof(summary_t));
+        summary->free_blocks += img->summary.free_blocks - img->summary_base.free_blocks;
+        summary->free_inodes += img->summary.free_inodes - img->summary_base.free_inodes;
+        for (uint32_t g = 0; g < img->summary.groups && g < summary->groups; g++) {
+            groups[g].free_blocks += img->groups[g].free_blocks - img->groups_base[g].free_blocks;
+            groups[g].free_inodes += img->groups[g].free_inodes - img->groups_base[g].free_inodes;
+        }
+        superblock_crc_finalize((superblock_t*)super);
+        stats_io(0, BS);
+        if (pwrite(img->out_fd, super, BS, 0) != (ssize_t)BS) rc = -1;
+    }
+    range_lock(img, 0, BS, F_UNLCK, 0);
+    if (rc != 0) {
+        fprintf(stderr, "Error: Cannot update superblock: %s\n", strerror(errno));
+        return -1;
+    }
+    memcpy(&img->summary, super + SUMMARY_OFFSET, sizeof(summary_t));
+    memcpy(img->groups, super + SUMMARY_OFFSET + sizeof(summary_t), img->summary.groups * sizeof(group_desc_t));
+    img->summary_base = img->summary;
+    memcpy(img->groups_base, img->groups, sizeof(img->groups));
+    uint8_t* cached = image_cached(img, 0);
+    if (cached) memcpy(cached, super, BS);
+    return 0;
+}
+
+// Shards are the allocation groups, or on an image without groups equal
+// slices of both bitmaps, 64 bits aligned, one per SHARD_SLICES-th of the
+// image as long as each slice gets 64 inodes and 64 blocks
+static void plan_shards(image_t* img) {
+    summary_t* layout = &img->shard_layout;
+    if ((img->sb.flags & SB_FLAG_SUMMARY) && img->summary.groups) {
+        *layout = img->summary;
+        return;
+    }
+    memset(layout, 0, sizeof(*layout));
+    uint64_t blocks = img->sb.data_region_blocks, inodes = img->sb.inode_count;
+    uint64_t slices = SHARD_SLICES;
+    if (slices > blocks / 64) slices = blocks / 64;
+    if (slices > inodes / 64) slices = inodes / 64;
+    if (slices == 0) slices = 1;
+    layout->blocks_per_group = (uint32_t)(((blocks + slices - 1) / slices + 63) / 64 * 64);
+    layout->inodes_per_group = (uint32_t)(((inodes + slices - 1) / slices + 63) / 64 * 64);
+    uint64_t block_slices = (blocks + layout->blocks_per_group - 1) / layout->blocks_per_group;
+    uint64_t inode_slices = (inodes + layout->inodes_per_group - 1) / layout->inodes_per_group;
+    layout->groups = (uint32_t)(block_slices > inode_slices ? block_slices : inode_slices);
+}
+
+// Locks the first shard from `start` on that neither this writer nor any
+// other holds and, when counts are known, has a free inode (if `inode` is
+// set) and `blocks` free blocks. With `wait` it waits for the first such
+// shard when all are held. Returns the shard or -1.
+static int64_t lock_free_shard(image_t* img, const group_desc_t* counts, uint32_t start, int inode, uint64_t blocks,
+                               int wait) {
+    img->shards_busy = 0;
+    uint32_t shards = img->shard_layout.groups;
+    int64_t g = -1, fallback = -1;
+    for (uint32_t i = 0; i < shards && g < 0; i++) {
+        uint32_t candidate = (start + i) % shards;
+        if (shard_held(img, candidate)) continue;
+        if (counts && ((inode && counts[candidate].free_inodes == 0) || counts[candidate].free_blocks < blocks)) continue;
+        int rc = range_lock(img, LOCK_SHARDS + candidate, 1, F_WRLCK, 0);
+        if (rc < 0) return -1;
+        if (rc == 0) g = candidate;
+        else if (fallback < 0) fallback = candidate;
+    }
+    if (g < 0 && wait && fallback >= 0 && range_lock(img, LOCK_SHARDS + (uint64_t)fallback, 1, F_WRLCK, 1) == 0) {
+        g = fallback;
+    }
+    if (g < 0 && fallback >= 0) img->shards_busy = 1;
+    if (g >= 0) img->shards_held[g / 64] |= 1ull << (g % 64);
+    return g;
+}
+
+// Lets go of every shard but the current one; their changes must be merged
+static void release_shards(image_t* img) {
+    for (uint32_t g = 0; g < img->shard_layout.groups; g++) {
+        if (g == img->shard || !shard_held(img, g)) continue;
+        range_lock(img, LOCK_SHARDS + g, 1, F_UNLCK, 0);
+        img->shards_held[g / 64] &= ~(1ull << (g % 64));
+    }
+}
+
+// Writes out the shards an allocation moved away from and lets them go, so a
+// writer holds a single shard between allocations
+static int settle_shards(image_t* img) {
+    int others = 0;
+    for (uint32_t g = 0; g < img->shard_layout.groups && !others; g++) others = g != img->shard && shard_held(img, g);
+    if (!others) return 0;
+    if (merge_bitmaps(img) != 0 || merge_summary(img) != 0) return -1;
+    release_shards(img);
+    return 0;
+}
+
+// Points the allocation pools at shard g and rereads its slices of the
+// bitmaps, which the previous holder may have changed since image_open()
+static int enter_shard(image_t* img, uint32_t g) {
+    const summary_t* s = &img->shard_layout;
+    uint64_t inodes = group_inodes(&img->sb, s, g), blocks = group_data_blocks(&img->sb, s, g);
+    img->shard = g;
+    img->shard_first_inode = inodes ? (uint64_t)g * s->inodes_per_group : 0;
+    img->shard_first_block = blocks ? (uint64_t)g * s->blocks_per_group : 0;
+    // Shards start on byte boundaries of the bitmaps
+    bitmap_init(&img->shard_inode_bm, img->regions[0] + img->shard_first_inode / 8, inodes);
+    bitmap_init(&img->shard_data_bm, img->regions[1] + img->shard_first_block / 8, blocks);
+
+    struct { uint8_t* bits; uint64_t start; uint64_t first; uint64_t count; } slices[2] = {
+        { img->regions[0], img->sb.inode_bitmap_start, img->shard_first_inode, inodes },
+        { img->regions[1], img->sb.data_bitmap_start, img->shard_first_block, blocks },
+    };
+    for (int i = 0; i < 2; i++) {
+        size_t length = (size_t)((slices[i].count + 7) / 8);
+        uint64_t byte = slices[i].first / 8;
+        stats_io(length, 0);
+        if (length && pread(img->in_fd, slices[i].bits + byte, length, (off_t)(slices[i].start * BS + byte)) !=
+                      (ssize_t)length) {
+            fprintf(stderr, "Error: Cannot read bitmaps\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Moves a writer whose shard cannot meet an allocation on to a shard with a
+// free inode (if `inode` is set) or `blocks` free blocks that nobody holds.
+// The shards it leaves stay held until the allocation is done, see
+// settle_shards(), so a failed one can still give back what it took there.
+// Never waits, since the caller may hold a directory lock. Gives up once
+// every shard has been tried.
+static int next_shard(image_t* img, int inode, uint64_t blocks, uint32_t* tries) {
+    if (!img->shared) return -1;
+    if (++*tries >= img->shard_layout.groups) {
+        img->shards_busy = 0;
+        return -1;
+    }
+    group_desc_t* counts = NULL;
+    if ((img->sb.flags & SB_FLAG_SUMMARY) && img->summary.groups) {
+        summary_t summary;
+        counts = malloc(GROUPS_MAX * sizeof(group_desc_t));
+        if (!counts) {
+            fprintf(stderr, "Error: Memory allocation failed\n");
+            return -1;
+        }
+        if (read_summary(img, &summary, counts) != 0) {
+            free(counts);
+            return -1;
+        }
+    }
+    int64_t g = lock_free_shard(img, counts, img->shard + 1, inode, blocks, 0);
+    free(counts);
+    return g < 0 ? -1 : enter_shard(img, (uint32_t)g);
+}
+
+int image_share(image_t* img) {
+    if (img->out_fd != img->in_fd) {
+        fprintf(stderr, "Error: Only an image updated in place can be shared\n");
+        return -1;
+    }
+    if (img->sb.flags & (SB_FLAG_JOURNAL | SB_FLAG_DEDUP)) {
+        fprintf(stderr, "Error: Images with a journal or dedup tables cannot take shared writers\n");
+        return -1;
+    }
+
+    int groups = (img->sb.flags & SB_FLAG_SUMMARY) && img->summary.groups;
+    if (groups && read_summary(img, &img->summary, img->groups) != 0) return -1;
+    plan_shards(img);
+    memset(img->shards_held, 0, sizeof(img->shards_held));
+    // Writers started together spread over the shards
+    uint32_t start = (uint32_t)getpid() % img->shard_layout.groups;
+    int64_t g = lock_free_shard(img, groups ? img->groups : NULL, start, 1, 0, 1);
+    if (g < 0) {
+        if (groups) fprintf(stderr, "Error: No allocation group has a free inode\n");
+        return -1;
+    }
+    img->shared = 1;
+    img->summary_base = img->summary;
+    memcpy(img->groups_base, img->groups, sizeof(img->groups));
+    // The counters as they are once this writer holds its shard
+    if (img->sb.flags & SB_FLAG_SUMMARY) {
+        if (read_summary(img, &img->summary, img->groups) != 0) return -1;
+        img->summary_base = img->summary;
+        memcpy(img->groups_base, img->groups, sizeof(img->groups));
+    }
+    return enter_shard(img, (uint32_t)g);
+}
+
+int image_lock_dir(image_t* img, uint32_t dir_ino) {
+    if (!img->shared) return 0;
+    if (dir_ino == 0 || dir_ino > img->sb.inode_count) {
+        fprintf(stderr, "Error: Inode %u is outside the inode table\n", dir_ino);
+        return -1;
+    }
+    if (range_lock(img, inode_offset(img, dir_ino), INODE_SIZE, F_WRLCK, 1) != 0) return -1;
+    img->locked_dir = dir_ino;
+    if (drop_clean(img) != 0) return -1;
+
+    // An inode table block still cached holds inodes of this writer not yet
+    // written; only the directory's own inode is reread into it
+    uint64_t per_block = BS / INODE_SIZE;
+    uint8_t* block = image_cached(img, img->sb.inode_table_start + (dir_ino - 1) / per_block);
+    stats_io(block ? INODE_SIZE : 0, 0);
+    if (block && pread(img->in_fd, block + ((dir_ino - 1) % per_block) * INODE_SIZE, INODE_SIZE,
+                       (off_t)inode_offset(img, dir_ino)) != INODE_SIZE) {
+        fprintf(stderr, "Error: Cannot read inode %u\n", dir_ino);
+        return -1;
+    }
+    return 0;
+}
+
+int image_unlock_dir(image_t* img, uint32_t dir_ino) {
+    if (!img->shared) return 0;
+    int rc = publish(img);
+    if (range_lock(img, inode_offset(img, dir_ino), INODE_SIZE, F_UNLCK, 0) != 0) rc = -1;
+    img->locked_dir = 0;
+    return rc;
+}
+
+static int shared_flush(image_t* img) {
+    if (publish(img) != 0 || merge_bitmaps(img) != 0 || merge_summary(img) != 0) return -1;
+    // Block 0 was merged on disk; nothing else is left dirty
+    uint8_t* super = image_cached(img, 0);
+    if (super) {
+        cached_block_t* block = img->slots[block_slot(img, 0)];
+        block->dirty = 0;
+        lru_touch(img, block);
+    }
+    img->n_freed = 0;
+    return 0;
+}
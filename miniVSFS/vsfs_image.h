@@ -0,0 +1,201 @@
+#ifndef MINIVSFS_IMAGE_H
+#define MINIVSFS_IMAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "bitmap.h"
+#include "vsfs_format.h"
+
+// Block-level access to an existing image.
+//
+// Blocks are read from the input image on first use and kept in a small hash
+// table keyed by block number. Only blocks marked dirty are written back, so
+// memory and I/O scale with the size of the change, not the size of the image.
+// A separate output starts as a clone of the input and is then patched the
+// same way an in-place update is.
+//
+// By default every block read stays cached until image_close(). A long-lived
+// reader can bound the cache with image_set_cache_limit(): clean blocks are
+// then kept in least-recently-used order and image_trim() evicts the oldest.
+// Eviction only happens inside image_trim(), so block pointers stay valid
+// until the caller decides to trim. Dirty blocks and the bitmaps are never
+// evicted.
+//
+// On an image with a metadata journal (SB_FLAG_JOURNAL) image_open() replays
+// the last committed transaction and an in-place image_flush() commits the
+// dirty blocks through the journal, see vsfs_journal.h.
+//
+// On an image with a free-space summary (SB_FLAG_SUMMARY) the allocation
+// functions keep the counters in step with the bitmaps, and image_set_goal()
+// steers the next allocations into an allocation group.
+//
+// Several writers can add to one image in place at the same time once each
+// calls image_share(), see below.
+//
+// Functions print an "Error: ..." line to stderr and return NULL or -1 on
+// failure.
+
+typedef struct cached_block {
+    uint64_t block_no;
+    uint8_t* data;
+    int dirty;
+    int borrowed;       // data points into a region buffer owned by the image
+    int fresh;          // zero-filled by image_block_zeroed() since the last flush
+    struct cached_block* lru_prev;  // clean blocks of a bounded cache, newest first
+    struct cached_block* lru_next;
+} cached_block_t;
+
+typedef struct {
+    int in_fd;
+    int out_fd;          // same as in_fd when updating in place; opened at flush otherwise
+    const char* output_name;
+    superblock_t sb;
+    summary_t summary;   // with SB_FLAG_SUMMARY; written back by image_write_super()
+    group_desc_t groups[GROUPS_MAX];
+    bitmap_t inode_bm;   // bits live in the cached bitmap blocks
+    bitmap_t data_bm;
+    uint8_t* regions[2]; // buffers behind the borrowed bitmap blocks
+    cached_block_t** slots;
+    size_t capacity;     // always a power of two
+    size_t used;
+    size_t limit;        // clean blocks kept by image_trim(); 0 keeps everything
+    size_t lru_count;
+    cached_block_t* lru_head;
+    cached_block_t* lru_tail;
+
+    // Metadata journal state, see vsfs_journal.c
+    uint64_t journal_seq;        // last transaction written
+    uint64_t journal_next;       // journal block where the next one goes
+    uint64_t journal_prev_start; // journal blocks of the last transaction
+    uint64_t journal_prev_blocks;
+    int journal_replay_prev;     // the last transaction's checkpoint may not be durable yet
+    int bypass_journal;          // flush in place without logging (a freshly formatted image)
+    bitmap_extent_t* freed;      // data bitmap runs freed since the last flush
+    size_t n_freed;
+    size_t freed_capacity;
+    int freed_lost;              // a freed run could not be recorded: log every block
+    int punch_freed;             // image_flush() punches holes over the data blocks freed
+    uint64_t punched;            // blocks punched by the flushes so far
+
+    // Shared writer state, see image_share()
+    int shared;
+    summary_t shard_layout;      // the allocation groups, or bitmap slices on an image without groups
+    uint64_t shards_held[(GROUPS_MAX + 63) / 64];  // shards this writer has locked
+    uint32_t shard;              // shard allocated from
+    int shards_busy;             // the last move to another shard found only shards other writers hold
+    uint32_t locked_dir;         // directory held by image_lock_dir(), 0 if none
+    bitmap_t shard_inode_bm;     // the current shard's slices of the bitmaps
+    bitmap_t shard_data_bm;
+    uint64_t shard_first_inode;  // bitmap bits the slices start at
+    uint64_t shard_first_block;
+    summary_t summary_base;      // counters as last read from disk
+    group_desc_t groups_base[GROUPS_MAX];
+    uint32_t* touched;           // inodes changed since they were last written
+    size_t n_touched;
+    size_t touched_capacity;
+} image_t;
+
+// A NULL output_name opens the input read-only; image_flush() then fails
+int image_open(image_t* img, const char* input_name, const char* output_name, int in_place);
+
+// Bounds the clean blocks kept by image_trim(); call right after image_open()
+void image_set_cache_limit(image_t* img, size_t blocks);
+
+// Evicts least recently used clean blocks down to the limit. Invalidates
+// pointers returned by earlier calls for the evicted blocks.
+void image_trim(image_t* img);
+
+// Returns the contents of block_no, reading it from the input on first use
+uint8_t* image_block(image_t* img, uint64_t block_no);
+
+// Returns block_no if it is cached, NULL otherwise; never reads the image
+uint8_t* image_cached(image_t* img, uint64_t block_no);
+
+// Returns a zero-filled, already dirty buffer for a block about to be overwritten
+uint8_t* image_block_zeroed(image_t* img, uint64_t block_no);
+
+void image_mark_dirty(image_t* img, uint64_t block_no);
+
+// Marks the bitmap blocks that hold bits [start, start + length) dirty
+void image_mark_bits_dirty(image_t* img, uint64_t bitmap_start, uint64_t start, uint64_t length);
+
+// Returns the inode inside its cached inode-table block and marks that block dirty
+inode_t* image_inode(image_t* img, uint64_t inode_no);
+
+// Same, for reading only: the block is not marked dirty
+inode_t* image_inode_peek(image_t* img, uint64_t inode_no);
+
+// Allocates an inode number (1-based), or returns 0 when none is free
+uint32_t image_alloc_inode(image_t* img);
+
+// Returns an inode number to the free pool
+void image_free_inode(image_t* img, uint32_t inode_no);
+
+// Allocates one data block and returns its absolute block number, or 0 when
+// the data region is full (block 0 always holds the superblock)
+uint64_t image_alloc_block(image_t* img);
+
+// Allocates `count` contiguous data blocks; returns the first or 0
+uint64_t image_alloc_run(image_t* img, uint64_t count);
+
+// Allocates `count` data blocks in at most max_runs runs with absolute block
+// numbers; returns the number of runs or -1, leaving the bitmap unchanged
+int image_alloc_extents(image_t* img, uint64_t count, bitmap_extent_t* runs, size_t max_runs);
+
+// Returns `count` blocks starting at absolute block `first` to the free pool
+void image_free_run(image_t* img, uint64_t first, uint64_t count);
+
+// Free data blocks and inodes: read from the summary, or counted in the bitmaps
+uint64_t image_free_blocks(image_t* img);
+uint64_t image_free_inodes(image_t* img);
+
+// Points the next inode and block allocations at the allocation group for a
+// new file of `blocks` data blocks (or a directory) created under parent_ino.
+// Does nothing on an image without allocation groups.
+void image_set_goal(image_t* img, uint32_t parent_ino, uint64_t blocks, int is_dir);
+
+// Copies the superblock and summary into block 0, checksums it and marks it dirty
+int image_write_super(image_t* img);
+
+// Shared writers. After image_share() several processes, or several handles
+// in one process, can add to an image opened in place at the same time. Each
+// writer allocates only from shards it holds an advisory lock on: allocation
+// groups, or on an image without groups up to 16 equal slices of the inode
+// and data bitmaps. A writer whose shard cannot meet an allocation moves on
+// to a shard no other writer holds, and a file larger than what is left in
+// its shard takes the rest from the next ones. The shards it moved away from
+// are written out and unlocked once that allocation is done, and blocks freed
+// in a shard the writer does not hold stay allocated until mkfs_fsck --repair
+// reclaims them. Everything else writers share is
+// guarded by open file description byte-range locks on the image:
+//   - a directory is only read and changed between image_lock_dir() and
+//     image_unlock_dir(), which lock the directory's inode, drop cached
+//     blocks that may be stale, and write the change out before unlocking;
+//   - inodes are written 128 bytes at a time, never as inode table blocks,
+//     so writers do not overwrite each other's inodes;
+//   - image_flush() writes each changed bitmap block under a lock on it,
+//     taking the bytes of the held shards' slices from this writer and the
+//     rest from disk, and adds this writer's allocations to the free-space
+//     counters.
+// A change is visible to other writers once its directory is unlocked; the
+// bitmaps and counters follow at image_flush(). Images with a journal or
+// dedup tables cannot be shared.
+int image_share(image_t* img);
+
+// Lock and unlock directory dir_ino around a lookup and its insert; both do
+// nothing unless the image is shared. Block pointers taken before
+// image_lock_dir() are invalid after it.
+int image_lock_dir(image_t* img, uint32_t dir_ino);
+int image_unlock_dir(image_t* img, uint32_t dir_ino);
+
+// Writes every dirty block; creates and clones the output first if needed
+int image_flush(image_t* img);
+
+// Writes the given blocks, sorted by block number, to their place in the
+// output, merging adjacent ones; leaves their dirty state alone
+int image_write_blocks(image_t* img, cached_block_t** blocks, size_t n_blocks);
+
+// Returns -1 if the output could not be closed cleanly
+int image_close(image_t* img);
+
+#endif
@@ -0,0 +1,454 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include "vsfs_journal.h"
+#include "vsfs_stats.h"
+
+// In-place blocks are read back in chunks of this many blocks when checking
+// a transaction's in_place_crc
+#define CHECK_CHUNK_BLOCKS 64
+
+typedef struct {
+    uint64_t seq;
+    uint64_t start;          // journal block of the first descriptor
+    uint64_t blocks;         // descriptors, copies and the commit block
+    uint32_t in_place_crc;
+    uint32_t replay_prev;
+} txn_t;
+
+static int read_all(int fd, uint8_t* buf, uint64_t bytes, uint64_t offset) {
+    for (uint64_t done = 0; done < bytes; ) {
+        ssize_t n = pread(fd, buf + done, bytes - done, (off_t)(offset + done));
+        stats_io(n > 0 ? (uint64_t)n : 0, 0);
+        if (n <= 0) return -1;
+        done += (uint64_t)n;
+    }
+    return 0;
+}
+
+static int write_all(int fd, const uint8_t* buf, uint64_t bytes, uint64_t offset) {
+    for (uint64_t done = 0; done < bytes; ) {
+        ssize_t n = pwrite(fd, buf + done, bytes - done, (off_t)(offset + done));
+        stats_io(0, n > 0 ? (uint64_t)n : 0);
+        if (n <= 0) return -1;
+        done += (uint64_t)n;
+    }
+    return 0;
+}
+
+// Checks the magic and checksum of a header, descriptor or commit block
+static int block_valid(const uint8_t* block, uint32_t magic) {
+    uint32_t found, stored;
+    memcpy(&found, block, 4);
+    memcpy(&stored, block + 4, 4);
+    if (found != magic) return 0;
+    static const uint8_t zero[4];
+    uint32_t c = crc32_update(crc32(block, 4), zero, 4);
+    return crc32_update(c, block + 8, BS - 8) == stored;
+}
+
+// Parses the transaction whose first descriptor is journal block p; returns
+// 1 if it is complete and its descriptors, copies and commit are intact
+static int parse_txn(const uint8_t* journal, uint64_t n_blocks, uint64_t total_blocks, uint64_t p, txn_t* txn) {
+    uint64_t q = p;
+    uint64_t seq = 0;
+    for (uint32_t index = 0; ; index++) {
+        if (q >= n_blocks) return 0;
+        const journal_desc_t* desc = (const journal_desc_t*)(journal + q * BS);
+        if (!block_valid((const uint8_t*)desc, JOURNAL_DESC_MAGIC) || desc->index != index ||
+            desc->count > JOURNAL_DESC_ENTRIES) {
+            return 0;
+        }
+        if (index == 0) seq = desc->seq;
+        if (desc->seq != seq) return 0;
+        uint64_t copies = 0;
+        for (uint32_t e = 0; e < desc->count; e++) {
+            const journal_entry_t* entry = &desc->entries[e];
+            if (entry->count == 0 || entry->start >= total_blocks || entry->count > total_blocks - entry->start) {
+                return 0;
+            }
+            if (!(entry->flags & JOURNAL_FL_IN_PLACE)) copies += entry->count;
+        }
+        if (copies >= n_blocks) return 0;
+        q += 1 + copies;
+        if (desc->last) break;
+    }
+    if (q >= n_blocks) return 0;
+
+    const journal_commit_t* commit = (const journal_commit_t*)(journal + q * BS);
+    if (!block_valid((const uint8_t*)commit, JOURNAL_COMMIT_MAGIC) || commit->seq != seq ||
+        commit->blocks != q - p || commit->journal_crc != crc32(journal + p * BS, (q - p) * BS)) {
+        return 0;
+    }
+    txn->seq = seq;
+    txn->start = p;
+    txn->blocks = q - p + 1;
+    txn->in_place_crc = commit->in_place_crc;
+    txn->replay_prev = commit->replay_prev;
+    return 1;
+}
+
+// Re-reads the blocks a transaction wrote in place and compares their crc
+// with the one its commit recorded
+static int in_place_intact(image_t* img, const uint8_t* journal, const txn_t* txn, uint8_t* chunk) {
+    uint32_t c = 0;
+    uint64_t q = txn->start;
+    for (;;) {
+        const journal_desc_t* desc = (const journal_desc_t*)(journal + q * BS);
+        uint64_t copies = 0;
+        for (uint32_t e = 0; e < desc->count; e++) {
+            const journal_entry_t* entry = &desc->entries[e];
+            if (!(entry->flags & JOURNAL_FL_IN_PLACE)) {
+                copies += entry->count;
+                continue;
+            }
+            for (uint64_t done = 0; done < entry->count; ) {
+                uint64_t n = entry->count - done < CHECK_CHUNK_BLOCKS ? entry->count - done : CHECK_CHUNK_BLOCKS;
+                if (read_all(img->in_fd, chunk, n * BS, (entry->start + done) * BS) != 0) return 0;
+                c = crc32_update(c, chunk, n * BS);
+                done += n;
+            }
+        }
+        q += 1 + copies;
+        if (desc->last) break;
+    }
+    return c == txn->in_place_crc;
+}
+
+// Copies a transaction's logged blocks into the cache, marking the ones that
+// differ from the current contents dirty
+static int64_t apply_txn(image_t* img, const uint8_t* journal, const txn_t* txn) {
+    int64_t loaded = 0;
+    uint64_t q = txn->start;
+    for (;;) {
+        const journal_desc_t* desc = (const journal_desc_t*)(journal + q * BS);
+        const uint8_t* copy = journal + (q + 1) * BS;
+        uint64_t copies = 0;
+        for (uint32_t e = 0; e < desc->count; e++) {
+            const journal_entry_t* entry = &desc->entries[e];
+            if (entry->flags & JOURNAL_FL_IN_PLACE) continue;
+            for (uint64_t b = 0; b < entry->count; b++, copy += BS) {
+                uint8_t* block = image_block(img, entry->start + b);
+                if (!block) return -1;
+                if (memcmp(block, copy, BS) != 0) {
+                    memcpy(block, copy, BS);
+                    image_mark_dirty(img, entry->start + b);
+                    loaded++;
+                }
+            }
+            copies += entry->count;
+        }
+        q += 1 + copies;
+        if (desc->last) break;
+    }
+    return loaded;
+}
+
+int64_t journal_recover(image_t* img) {
+    uint64_t n_blocks = journal_blocks(&img->sb);
+    uint64_t start = journal_start(&img->sb);
+    if (n_blocks < JOURNAL_MIN_BLOCKS) {
+        fprintf(stderr, "Error: Corrupt journal layout\n");
+        return -1;
+    }
+
+    uint8_t* journal = malloc(n_blocks * BS);
+    uint8_t* chunk = malloc(CHECK_CHUNK_BLOCKS * BS);
+    txn_t* txns = malloc(n_blocks * sizeof(txn_t));
+    if (!journal || !chunk || !txns) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        free(journal);
+        free(chunk);
+        free(txns);
+        return -1;
+    }
+    int64_t loaded = -1;
+    if (read_all(img->in_fd, journal, n_blocks * BS, start * BS) != 0) {
+        fprintf(stderr, "Error: Cannot read journal\n");
+        goto out;
+    }
+    const journal_header_t* header = (const journal_header_t*)journal;
+    if (!block_valid(journal, JOURNAL_MAGIC) || header->blocks != n_blocks) {
+        fprintf(stderr, "Error: Corrupt journal header\n");
+        goto out;
+    }
+
+    size_t n_txns = 0;
+    for (uint64_t p = 1; p < n_blocks; p++) {
+        if (parse_txn(journal, n_blocks, img->sb.total_blocks, p, &txns[n_txns])) {
+            p += txns[n_txns].blocks - 1;
+            n_txns++;
+        }
+    }
+
+    // The newest transaction decides where the ring continues, even when its
+    // in-place blocks did not make it to disk and it is not replayed
+    const txn_t* newest = NULL;
+    for (size_t i = 0; i < n_txns; i++) {
+        if (!newest || txns[i].seq > newest->seq) newest = &txns[i];
+    }
+    img->journal_seq = newest ? newest->seq : 0;
+    img->journal_next = newest ? newest->start + newest->blocks : 1;
+    img->journal_prev_start = newest ? newest->start : 0;
+    img->journal_prev_blocks = newest ? newest->blocks : 0;
+    img->journal_replay_prev = 1;
+
+    // Replay the newest transaction, or the one before it when the newest
+    // one's in-place blocks did not all make it. Anything older had its
+    // checkpoint made durable before the newest transaction was written.
+    const txn_t* last = NULL;
+    for (uint64_t below = UINT64_MAX; !last; ) {
+        const txn_t* candidate = NULL;
+        for (size_t i = 0; i < n_txns; i++) {
+            if (txns[i].seq < below && (!candidate || txns[i].seq > candidate->seq)) candidate = &txns[i];
+        }
+        if (!candidate || candidate->seq + 1 < img->journal_seq) break;
+        if (in_place_intact(img, journal, candidate, chunk)) last = candidate;
+        below = candidate->seq;
+    }
+    // A newest transaction with missing in-place blocks means the machine went
+    // down before its fdatasync returned; it must never be replayed as the
+    // predecessor of the next one
+    if (last != newest) img->journal_replay_prev = 0;
+
+    loaded = 0;
+    if (last && last->replay_prev) {
+        for (size_t i = 0; i < n_txns; i++) {
+            if (txns[i].seq + 1 != last->seq) continue;
+            int64_t n = apply_txn(img, journal, &txns[i]);
+            loaded = n < 0 ? -1 : loaded + n;
+        }
+    }
+    if (last && loaded >= 0) {
+        int64_t n = apply_txn(img, journal, last);
+        loaded = n < 0 ? -1 : loaded + n;
+    }
+    if (loaded > 0) {
+        uint8_t* super = image_cached(img, 0);
+        if (super) memcpy(&img->sb, super, sizeof(img->sb));
+    }
+
+out:
+    free(journal);
+    free(chunk);
+    free(txns);
+    return loaded;
+}
+
+// Adds the block to the entry list, extending the last entry when the block
+// directly follows it with the same flags
+static void push_entry(journal_entry_t* entries, size_t* n, uint64_t block_no, uint32_t flags) {
+    if (*n > 0) {
+        journal_entry_t* last = &entries[*n - 1];
+        if (last->flags == flags && last->start + last->count == block_no && last->count < UINT32_MAX) {
+            last->count++;
+            return;
+        }
+    }
+    entries[*n].start = block_no;
+    entries[*n].count = 1;
+    entries[*n].flags = flags;
+    (*n)++;
+}
+
+static int freed_in_batch(const image_t* img, uint64_t bit) {
+    if (img->freed_lost) return 1;
+    for (size_t i = 0; i < img->n_freed; i++) {
+        if (bit >= img->freed[i].start && bit - img->freed[i].start < img->freed[i].length) return 1;
+    }
+    return 0;
+}
+
+// Picks where a transaction of `blocks` journal blocks goes. The previous
+// transaction may still be needed for replay until its checkpoint is
+// durable, so overwriting it costs an extra fdatasync first.
+static int place_txn(image_t* img, uint64_t blocks, uint64_t* pos, uint32_t* replay_prev) {
+    uint64_t n_blocks = journal_blocks(&img->sb);
+    *pos = img->journal_next;
+    if (*pos < 1 || *pos + blocks > n_blocks) *pos = 1;
+    *replay_prev = (uint32_t)img->journal_replay_prev;
+    uint64_t prev_end = img->journal_prev_start + img->journal_prev_blocks;
+    if (img->journal_prev_blocks > 0 && *pos < prev_end && img->journal_prev_start < *pos + blocks) {
+        stats_io(0, 0);
+        if (fdatasync(img->out_fd) != 0) {
+            fprintf(stderr, "Error: Cannot sync output image: %s\n", strerror(errno));
+            return -1;
+        }
+        *replay_prev = 0;
+    }
+    return 0;
+}
+
+static void finish_txn(image_t* img, uint64_t pos, uint64_t blocks) {
+    img->journal_seq++;
+    img->journal_next = pos + blocks;
+    img->journal_prev_start = pos;
+    img->journal_prev_blocks = blocks;
+    img->journal_replay_prev = 1;
+}
+
+int journal_commit(image_t* img, cached_block_t** dirty, size_t n_dirty) {
+    uint64_t n_blocks = journal_blocks(&img->sb);
+    uint64_t drs = img->sb.data_region_start;
+    uint64_t dre = drs + img->sb.data_region_blocks;
+
+    cached_block_t** in_place = malloc((n_dirty ? n_dirty : 1) * sizeof(cached_block_t*));
+    cached_block_t** logged = malloc((n_dirty ? n_dirty : 1) * sizeof(cached_block_t*));
+    journal_entry_t* entries = malloc((n_dirty ? n_dirty : 1) * sizeof(journal_entry_t));
+    if (!in_place || !logged || !entries) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        free(in_place);
+        free(logged);
+        free(entries);
+        return -1;
+    }
+
+    // Blocks freed by the batch are not written at all. Blocks the batch
+    // allocated are unreachable until the commit, so they go straight to
+    // their place; a block freed and reused within the batch may still be
+    // referenced on disk and is logged like any other.
+    size_t n_in_place = 0, n_logged = 0, n_entries = 0;
+    for (size_t i = 0; i < n_dirty; i++) {
+        uint64_t b = dirty[i]->block_no;
+        int data = b >= drs && b < dre;
+        if (data && !bitmap_test(&img->data_bm, b - drs)) continue;
+        if (data && dirty[i]->fresh && !freed_in_batch(img, b - drs)) {
+            in_place[n_in_place++] = dirty[i];
+            push_entry(entries, &n_entries, b, JOURNAL_FL_IN_PLACE);
+        } else {
+            logged[n_logged++] = dirty[i];
+            push_entry(entries, &n_entries, b, 0);
+        }
+    }
+
+    uint64_t n_desc = n_entries ? (n_entries + JOURNAL_DESC_ENTRIES - 1) / JOURNAL_DESC_ENTRIES : 1;
+    uint64_t txn_blocks = n_desc + n_logged + 1;
+    uint8_t* txn = NULL;
+    int rc = -1;
+    if (txn_blocks > n_blocks - 1) {
+        fprintf(stderr, "Error: Batch needs %lu journal blocks but the journal holds %lu; "
+                "add fewer files at once or rebuild the image with a larger --journal\n",
+                txn_blocks, n_blocks - 1);
+        goto out;
+    }
+    txn = calloc(txn_blocks, BS);
+    if (!txn) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        goto out;
+    }
+
+    uint64_t seq = img->journal_seq + 1;
+    uint8_t* w = txn;
+    size_t copied = 0;
+    for (uint64_t d = 0; d < n_desc; d++) {
+        journal_desc_t* desc = (journal_desc_t*)w;
+        size_t first = d * JOURNAL_DESC_ENTRIES;
+        size_t count = n_entries - first < JOURNAL_DESC_ENTRIES ? n_entries - first : JOURNAL_DESC_ENTRIES;
+        desc->magic = JOURNAL_DESC_MAGIC;
+        desc->seq = seq;
+        desc->index = (uint32_t)d;
+        desc->count = (uint32_t)count;
+        desc->last = d == n_desc - 1;
+        memcpy(desc->entries, &entries[first], count * sizeof(journal_entry_t));
+        journal_block_crc_finalize(w);
+        w += BS;
+        for (size_t e = first; e < first + count; e++) {
+            if (entries[e].flags & JOURNAL_FL_IN_PLACE) continue;
+            for (uint32_t b = 0; b < entries[e].count; b++, w += BS) memcpy(w, logged[copied++]->data, BS);
+        }
+    }
+
+    uint32_t in_place_crc = 0;
+    for (size_t i = 0; i < n_in_place; i++) in_place_crc = crc32_update(in_place_crc, in_place[i]->data, BS);
+
+    uint64_t pos;
+    uint32_t replay_prev;
+    if (place_txn(img, txn_blocks, &pos, &replay_prev) != 0) goto out;
+
+    journal_commit_t* commit = (journal_commit_t*)w;
+    commit->magic = JOURNAL_COMMIT_MAGIC;
+    commit->seq = seq;
+    commit->blocks = txn_blocks - 1;
+    commit->journal_crc = crc32(txn, (txn_blocks - 1) * BS);
+    commit->in_place_crc = in_place_crc;
+    commit->replay_prev = replay_prev;
+    journal_block_crc_finalize(w);
+
+    // One fdatasync covers the in-place blocks and the whole transaction; a
+    // commit that lands without the rest fails its crcs and is ignored
+    if (image_write_blocks(img, in_place, n_in_place) != 0) goto out;
+    if (write_all(img->out_fd, txn, txn_blocks * BS, (journal_start(&img->sb) + pos) * BS) != 0) {
+        fprintf(stderr, "Error: Cannot write journal: %s\n", strerror(errno));
+        goto out;
+    }
+    stats_io(0, 0);
+    if (fdatasync(img->out_fd) != 0) {
+        fprintf(stderr, "Error: Cannot sync output image: %s\n", strerror(errno));
+        goto out;
+    }
+    finish_txn(img, pos, txn_blocks);
+
+    // Checkpoint. Its durability is left to the next commit's fdatasync; until
+    // then a crash is repaired by replaying this transaction.
+    rc = image_write_blocks(img, logged, n_logged);
+
+out:
+    free(in_place);
+    free(logged);
+    free(entries);
+    free(txn);
+    return rc;
+}
+
+int journal_barrier(image_t* img) {
+    uint8_t* txn = calloc(2, BS);
+    if (!txn) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return -1;
+    }
+    uint64_t pos;
+    uint32_t replay_prev;
+    int rc = place_txn(img, 2, &pos, &replay_prev);
+    if (rc == 0) {
+        journal_desc_t* desc = (journal_desc_t*)txn;
+        desc->magic = JOURNAL_DESC_MAGIC;
+        desc->seq = img->journal_seq + 1;
+        desc->last = 1;
+        journal_block_crc_finalize(txn);
+
+        journal_commit_t* commit = (journal_commit_t*)(txn + BS);
+        commit->magic = JOURNAL_COMMIT_MAGIC;
+        commit->seq = desc->seq;
+        commit->blocks = 1;
+        commit->journal_crc = crc32(txn, BS);
+        commit->replay_prev = 0;
+        journal_block_crc_finalize(txn + BS);
+
+        rc = write_all(img->out_fd, txn, 2 * BS, (journal_start(&img->sb) + pos) * BS);
+        if (rc != 0) fprintf(stderr, "Error: Cannot write journal: %s\n", strerror(errno));
+        else finish_txn(img, pos, 2);
+    }
+    free(txn);
+    return rc;
+}
+
+int journal_restart(image_t* img) {
+    stats_io(0, 0);
+    if (fdatasync(img->out_fd) != 0) {
+        fprintf(stderr, "Error: Cannot sync output image: %s\n", strerror(errno));
+        return -1;
+    }
+    img->journal_next = 1;
+    if (journal_barrier(img) != 0) return -1;
+    stats_io(0, 0);
+    if (fdatasync(img->out_fd) != 0) {
+        fprintf(stderr, "Error: Cannot sync output image: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
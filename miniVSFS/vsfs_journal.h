@@ -0,0 +1,32 @@
+#ifndef MINIVSFS_JOURNAL_H
+#define MINIVSFS_JOURNAL_H
+
+#include <stddef.h>
+#include "vsfs_image.h"
+
+// Write-ahead metadata journal of an image with SB_FLAG_JOURNAL. The on-disk
+// layout and the replay rules are described next to journal_desc_t in
+// vsfs_format.h. image_open() and image_flush() call these; tools only need
+// journal_barrier().
+//
+// Functions print an "Error: ..." line to stderr and return -1 on failure.
+
+// Reads the journal and loads the blocks of the transactions that need
+// replaying into the cache as dirty blocks. Returns how many were loaded.
+int64_t journal_recover(image_t* img);
+
+// Commits the dirty blocks (sorted by block number) as one transaction:
+// in-place blocks and journal copies, one fdatasync, then the checkpoint
+int journal_commit(image_t* img, cached_block_t** dirty, size_t n_dirty);
+
+// Appends an empty transaction that replays nothing, for after the image was
+// changed outside the journal
+int journal_barrier(image_t* img);
+
+// Makes everything written so far durable and appends an empty transaction at
+// the front of the ring, so only the first journal blocks matter for replay
+// until the next commit: the rest of the journal may then be overwritten
+// while the superblock still points at it
+int journal_restart(image_t* img);
+
+#endif
@@ -0,0 +1,116 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "vsfs_stats.h"
+
+int g_stats_enabled = 0;
+_Atomic uint64_t g_stats_counters[STATS_COUNTERS];
+
+static const char* const PHASE_NAMES[STATS_PHASES] = {
+    "parse", "load", "alloc", "copy", "checksum", "writeback"
+};
+static const char* const COUNTER_NAMES[STATS_COUNTERS] = {
+    "bytes_read", "bytes_written", "syscalls", "bitmap_words", "blocks_allocated", "crc_bytes"
+};
+
+static int stats_mode;
+static stats_phase_t current_phase = STATS_PARSE;
+static uint64_t phase_wall_start;
+static uint64_t phase_cpu_start;
+static uint64_t wall_ns[STATS_PHASES];
+static uint64_t cpu_ns[STATS_PHASES];
+// Checksum time inside the running phase, taken off it when it closes
+static _Atomic uint64_t carved_ns;
+static _Atomic uint64_t checksum_ns;
+
+static uint64_t clock_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+uint64_t stats_clock_ns(void) {
+    return clock_ns(CLOCK_MONOTONIC);
+}
+
+void stats_begin(void) {
+    current_phase = STATS_PARSE;
+    phase_wall_start = clock_ns(CLOCK_MONOTONIC);
+    phase_cpu_start = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+int stats_parse_mode(const char* arg) {
+    if (!arg) return STATS_TEXT;
+    if (strcmp(arg, "json") == 0) return STATS_JSON;
+    fprintf(stderr, "Error: Invalid --stats format '%s' (use --stats or --stats=json)\n", arg);
+    return -1;
+}
+
+void stats_enable(int mode) {
+    stats_mode = mode;
+    g_stats_enabled = 1;
+}
+
+stats_phase_t stats_phase(stats_phase_t phase) {
+    stats_phase_t previous = current_phase;
+    if (!g_stats_enabled) return previous;
+    uint64_t wall = clock_ns(CLOCK_MONOTONIC);
+    uint64_t cpu = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+    uint64_t carved = atomic_exchange(&carved_ns, 0);
+    uint64_t wall_spent = wall - phase_wall_start;
+    uint64_t cpu_spent = cpu - phase_cpu_start;
+    wall_ns[current_phase] += wall_spent > carved ? wall_spent - carved : 0;
+    cpu_ns[current_phase] += cpu_spent > carved ? cpu_spent - carved : 0;
+    current_phase = phase;
+    phase_wall_start = wall;
+    phase_cpu_start = cpu;
+    return previous;
+}
+
+// CRC32 never blocks, so its wall time stands in for its CPU time too
+void stats_checksum(uint64_t start_ns, size_t bytes) {
+    uint64_t spent = stats_clock_ns() - start_ns;
+    atomic_fetch_add_explicit(&carved_ns, spent, memory_order_relaxed);
+    atomic_fetch_add_explicit(&checksum_ns, spent, memory_order_relaxed);
+    atomic_fetch_add_explicit(&g_stats_counters[STATS_CRC_BYTES], bytes, memory_order_relaxed);
+}
+
+void stats_report(const char* tool) {
+    if (!g_stats_enabled) return;
+    stats_phase(current_phase);
+    g_stats_enabled = 0;
+    wall_ns[STATS_CHECKSUM] += atomic_load(&checksum_ns);
+    cpu_ns[STATS_CHECKSUM] += atomic_load(&checksum_ns);
+    atomic_store(&checksum_ns, 0);
+
+    uint64_t total_wall = 0, total_cpu = 0;
+    for (int p = 0; p < STATS_PHASES; p++) {
+        total_wall += wall_ns[p];
+        total_cpu += cpu_ns[p];
+    }
+
+    if (stats_mode == STATS_JSON) {
+        fprintf(stderr, "{\"tool\":\"%s\",\"phases\":{", tool);
+        for (int p = 0; p < STATS_PHASES; p++) {
+            fprintf(stderr, "%s\"%s\":{\"wall_ms\":%.3f,\"cpu_ms\":%.3f}", p ? "," : "", PHASE_NAMES[p],
+                    wall_ns[p] / 1e6, cpu_ns[p] / 1e6);
+        }
+        fprintf(stderr, ",\"total\":{\"wall_ms\":%.3f,\"cpu_ms\":%.3f}},\"counters\":{", total_wall / 1e6,
+                total_cpu / 1e6);
+        for (int c = 0; c < STATS_COUNTERS; c++) {
+            fprintf(stderr, "%s\"%s\":%lu", c ? "," : "", COUNTER_NAMES[c], (unsigned long)g_stats_counters[c]);
+        }
+        fprintf(stderr, "}}\n");
+        return;
+    }
+
+    fprintf(stderr, "%-12s %12s %12s\n", "phase", "wall ms", "cpu ms");
+    for (int p = 0; p < STATS_PHASES; p++) {
+        fprintf(stderr, "%-12s %12.3f %12.3f\n", PHASE_NAMES[p], wall_ns[p] / 1e6, cpu_ns[p] / 1e6);
+    }
+    fprintf(stderr, "%-12s %12.3f %12.3f\n", "total", total_wall / 1e6, total_cpu / 1e6);
+    for (int c = 0; c < STATS_COUNTERS; c++) {
+        fprintf(stderr, "%-17s %lu\n", COUNTER_NAMES[c], (unsigned long)g_stats_counters[c]);
+    }
+}
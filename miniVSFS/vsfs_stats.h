@@ -0,0 +1,76 @@
+#ifndef MINIVSFS_STATS_H
+#define MINIVSFS_STATS_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Per-phase timers and counters behind the --stats option of the tools.
+//
+// Time is charged to one phase at a time: stats_phase() closes the running
+// phase and opens the next, so the phases add up to the run time. CRC32 time
+// is carved out of whichever phase is running and charged to STATS_CHECKSUM.
+// CPU time is the whole process's, so a phase run on several threads can
+// show more CPU than wall time.
+//
+// Nothing is counted until stats_enable(); counters are atomic so worker
+// threads can add to them.
+
+typedef enum {
+    STATS_PARSE,            // options, manifest, geometry
+    STATS_LOAD,             // opening the image: superblock, bitmaps, journal replay
+    STATS_ALLOC,            // path resolution, bitmap searches, inode and directory updates
+    STATS_COPY,             // reading file data into the image
+    STATS_CHECKSUM,         // CRC32
+    STATS_WRITEBACK,        // formatting, flushing and syncing the image
+    STATS_PHASES
+} stats_phase_t;
+
+typedef enum {
+    STATS_BYTES_READ,
+    STATS_BYTES_WRITTEN,
+    STATS_SYSCALLS,         // I/O calls: reads, writes, syncs, clones, sizing
+    STATS_BITMAP_WORDS,     // 64-bit bitmap words examined by searches and counts
+    STATS_BLOCKS_ALLOCATED, // data blocks
+    STATS_CRC_BYTES,
+    STATS_COUNTERS
+} stats_counter_t;
+
+enum { STATS_TEXT = 1, STATS_JSON = 2 };
+
+extern int g_stats_enabled;
+extern _Atomic uint64_t g_stats_counters[STATS_COUNTERS];
+
+static inline void stats_add(stats_counter_t counter, uint64_t n) {
+    if (g_stats_enabled) atomic_fetch_add_explicit(&g_stats_counters[counter], n, memory_order_relaxed);
+}
+
+// One I/O call that read and wrote the given byte counts
+static inline void stats_io(uint64_t read, uint64_t written) {
+    if (!g_stats_enabled) return;
+    atomic_fetch_add_explicit(&g_stats_counters[STATS_SYSCALLS], 1, memory_order_relaxed);
+    if (read) atomic_fetch_add_explicit(&g_stats_counters[STATS_BYTES_READ], read, memory_order_relaxed);
+    if (written) atomic_fetch_add_explicit(&g_stats_counters[STATS_BYTES_WRITTEN], written, memory_order_relaxed);
+}
+
+// Starts the clock; call first thing in main() so parsing is timed too
+void stats_begin(void);
+
+// Parses the --stats argument: no value for a table, "json" for one JSON
+// line. Returns STATS_TEXT or STATS_JSON, or -1 after printing an error.
+int stats_parse_mode(const char* arg);
+
+void stats_enable(int mode);
+
+// Switches to `phase`; returns the phase that was running
+stats_phase_t stats_phase(stats_phase_t phase);
+
+uint64_t stats_clock_ns(void);
+
+// Charges the time since start_ns and `bytes` hashed bytes to the checksum phase
+void stats_checksum(uint64_t start_ns, size_t bytes);
+
+// Closes the running phase and prints the report to stderr, if enabled
+void stats_report(const char* tool);
+
+#endif